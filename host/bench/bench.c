@@ -0,0 +1,528 @@
+/* Microbenchmarks of the library's hot paths against the simulated nv
+ * services.  Absolute numbers say little about the console, the calls into
+ * nv services per operation and relative changes do.
+ *
+ *   bench [-n iterations] [suite...]
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <nouveau.h>
+#include <host.h>
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+struct bench_ctx {
+	struct nouveau_drm *drm;
+	struct nouveau_device *dev;
+	struct nouveau_client *client;
+	struct nouveau_object *chan;
+	struct nouveau_pushbuf *push;
+};
+
+struct bench_result {
+	uint64_t *ns;
+	int nr;
+	uint64_t total_ns;
+	HostNvStats stats;
+};
+
+static int iterations = 20000;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_init(struct bench_ctx *ctx, const struct nouveau_pushbuf_attr *attr)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	CHECK(!nouveau_drm_new(0, &ctx->drm));
+	CHECK(!nouveau_device_new(&ctx->drm->client, NOUVEAU_DEVICE_CLASS, NULL, 0,
+				  &ctx->dev));
+	CHECK(!nouveau_client_new(ctx->dev, &ctx->client));
+	CHECK(!nouveau_object_new(&ctx->dev->object, 0, NOUVEAU_FIFO_CHANNEL_CLASS,
+				  NULL, 0, &ctx->chan));
+	CHECK(!nouveau_pushbuf_new_attr(ctx->client, ctx->chan, 4, 0x10000, true,
+					attr, &ctx->push));
+}
+
+static void
+bench_fini(struct bench_ctx *ctx)
+{
+	nouveau_pushbuf_del(&ctx->push);
+	nouveau_object_del(&ctx->chan);
+	nouveau_client_del(&ctx->client);
+	nouveau_device_del(&ctx->dev);
+	nouveau_drm_del(&ctx->drm);
+	hostGpuIdle();
+}
+
+static void
+result_begin(struct bench_result *res, int nr)
+{
+	res->ns = calloc(nr, sizeof(*res->ns));
+	CHECK(res->ns);
+	res->nr = 0;
+	hostResetStats();
+	res->total_ns = now_ns();
+}
+
+static inline void
+result_add(struct bench_result *res, uint64_t ns)
+{
+	res->ns[res->nr++] = ns;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+result_end(struct bench_result *res, const char *name)
+{
+	double ops;
+
+	res->total_ns = now_ns() - res->total_ns;
+	hostGetStats(&res->stats);
+	qsort(res->ns, res->nr, sizeof(*res->ns), cmp_u64);
+
+	ops = res->nr * 1e9 / (res->total_ns ? res->total_ns : 1);
+	printf("%-36s %12.0f ops/s  p50 %8llu ns  p99 %8llu ns  %6.2f nv calls/op\n",
+	       name, ops, (unsigned long long)res->ns[res->nr / 2],
+	       (unsigned long long)res->ns[res->nr * 99 / 100],
+	       (double)res->stats.nv_calls / res->nr);
+	free(res->ns);
+}
+
+static void
+bench_bo_new(uint32_t flags, uint64_t size, bool cache, const char *name)
+{
+	struct bench_ctx ctx;
+	struct bench_result res;
+	struct nouveau_bo *bo;
+	uint64_t t;
+	int i;
+
+	bench_init(&ctx, NULL);
+	if (!cache)
+		nouveau_device_set_bo_cache(ctx.dev, 0, 0);
+	result_begin(&res, iterations);
+	for (i = 0; i < iterations; i++) {
+		bo = NULL;
+		t = now_ns();
+		CHECK(!nouveau_bo_new(ctx.dev, flags, 0, size, NULL, &bo));
+		nouveau_bo_ref(NULL, &bo);
+		result_add(&res, now_ns() - t);
+	}
+	result_end(&res, name);
+	bench_fini(&ctx);
+}
+
+static void
+suite_bo(void)
+{
+	bench_bo_new(NOUVEAU_BO_GART, 0x100, false, "bo_new+del gart 256B, slab");
+	bench_bo_new(NOUVEAU_BO_GART, 0x4000, false, "bo_new+del gart 16KiB, slab");
+	bench_bo_new(NOUVEAU_BO_GART, 0x8000, false, "bo_new+del gart 32KiB, no cache");
+	bench_bo_new(NOUVEAU_BO_GART, 0x8000, true, "bo_new+del gart 32KiB, cache");
+	bench_bo_new(NOUVEAU_BO_GART | NOUVEAU_BO_NOZERO, 0x100000, true,
+		     "bo_new+del gart 1MiB nozero");
+	bench_bo_new(NOUVEAU_BO_VRAM, 0x100000, true, "bo_new+del vram 1MiB");
+}
+
+/* CPU and GPU bandwidth of bos of each placement.  Cached bos pay for the
+ * cache maintenance that makes their writes visible to the GPU.
+ */
+#define BW_SIZE 0x400000
+
+static void
+result_end_bw(struct bench_result *res, const char *name, uint64_t bytes)
+{
+	res->total_ns = now_ns() - res->total_ns;
+	hostGetStats(&res->stats);
+	qsort(res->ns, res->nr, sizeof(*res->ns), cmp_u64);
+
+	printf("%-36s %12.0f MiB/s  p50 %8llu ns  p99 %8llu ns  %6.2f nv calls/op\n",
+	       name, (double)bytes * res->nr / (1 << 20) * 1e9 /
+	       (res->total_ns ? res->total_ns : 1),
+	       (unsigned long long)res->ns[res->nr / 2],
+	       (unsigned long long)res->ns[res->nr * 99 / 100],
+	       (double)res->stats.nv_calls / res->nr);
+	free(res->ns);
+}
+
+static void
+bench_bw(uint32_t flags, const char *placement)
+{
+	struct bench_result res;
+	struct bench_ctx ctx;
+	struct nouveau_bo *bo = NULL, *dst = NULL;
+	struct nouveau_fence fence;
+	volatile uint64_t sum = 0;
+	char name[64];
+	uint64_t t, *map;
+	int i, j, n = iterations / 1000 + 4;
+
+	bench_init(&ctx, NULL);
+	CHECK(!nouveau_bo_new(ctx.dev, flags | NOUVEAU_BO_MAP, 0, BW_SIZE, NULL, &bo));
+	CHECK(!nouveau_bo_new(ctx.dev, flags, 0, BW_SIZE, NULL, &dst));
+	CHECK(!nouveau_bo_map(bo, NOUVEAU_BO_RDWR, ctx.client));
+	map = bo->map;
+
+	result_begin(&res, n);
+	for (i = 0; i < n; i++) {
+		t = now_ns();
+		memset(map, i, BW_SIZE);
+		CHECK(!nouveau_bo_flush_range(bo, 0, BW_SIZE));
+		result_add(&res, now_ns() - t);
+	}
+	snprintf(name, sizeof(name), "cpu write 4MiB %s", placement);
+	result_end_bw(&res, name, BW_SIZE);
+
+	result_begin(&res, n);
+	for (i = 0; i < n; i++) {
+		t = now_ns();
+		CHECK(!nouveau_bo_invalidate_range(bo, 0, BW_SIZE));
+		for (j = 0; j < BW_SIZE / 8; j++)
+			sum += map[j];
+		result_add(&res, now_ns() - t);
+	}
+	snprintf(name, sizeof(name), "cpu read 4MiB %s", placement);
+	result_end_bw(&res, name, BW_SIZE);
+
+	result_begin(&res, n);
+	for (i = 0; i < n; i++) {
+		t = now_ns();
+		CHECK(!nouveau_bo_copy(dst, 0, bo, 0, BW_SIZE, &fence));
+		CHECK(!nouveau_fence_wait(&fence, -1));
+		result_add(&res, now_ns() - t);
+	}
+	snprintf(name, sizeof(name), "gpu copy 4MiB %s", placement);
+	result_end_bw(&res, name, BW_SIZE);
+
+	nouveau_bo_ref(NULL, &bo);
+	nouveau_bo_ref(NULL, &dst);
+	bench_fini(&ctx);
+}
+
+static void
+suite_bw(void)
+{
+	bench_bw(NOUVEAU_BO_VRAM, "vram");
+	bench_bw(NOUVEAU_BO_GART, "gart");
+	bench_bw(NOUVEAU_BO_GART | NOUVEAU_BO_CACHED, "gart cached");
+}
+
+/* Looks bos up in the client bo map with nr of them referenced.  Another
+ * client references them first and keeps the per-bo kref slot, so that
+ * every lookup of this one goes through its map.  The lookups go to a
+ * random set of hot bos; with all of them hot the cost is dominated by
+ * cache misses on the bos and the table once those outgrow the caches.
+ */
+static void
+bench_bomap(int nr, int hot, const char *name)
+{
+	struct nouveau_pushbuf_attr attr = { .max_buffers = nr + 16 };
+	struct nouveau_pushbuf_refn ref;
+	struct nouveau_client *client;
+	struct nouveau_pushbuf *push;
+	struct bench_result res;
+	struct bench_ctx ctx;
+	struct nouveau_bo **bos;
+	unsigned seed = 1;
+	uint64_t t;
+	int *set, i;
+
+	bench_init(&ctx, &attr);
+	CHECK(!nouveau_client_new(ctx.dev, &client));
+	CHECK(!nouveau_pushbuf_new_attr(client, ctx.chan, 1, 0x1000, false, &attr,
+					&push));
+	bos = calloc(nr, sizeof(*bos));
+	CHECK(bos);
+	for (i = 0; i < nr; i++) {
+		CHECK(!nouveau_bo_new(ctx.dev, NOUVEAU_BO_GART | NOUVEAU_BO_NOZERO, 0,
+				      0x100, NULL, &bos[i]));
+		ref = (struct nouveau_pushbuf_refn){ bos[i], NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+		CHECK(!nouveau_pushbuf_refn(push, &ref, 1));
+		CHECK(!nouveau_pushbuf_refn(ctx.push, &ref, 1));
+	}
+
+	set = calloc(hot, sizeof(*set));
+	CHECK(set);
+	for (i = 0; i < hot; i++)
+		set[i] = rand_r(&seed) % nr;
+
+	result_begin(&res, iterations);
+	for (i = 0; i < iterations; i++) {
+		ref.bo = bos[set[rand_r(&seed) % hot]];
+		t = now_ns();
+		CHECK(nouveau_pushbuf_refd(ctx.push, ref.bo));
+		result_add(&res, now_ns() - t);
+	}
+	result_end(&res, name);
+
+	nouveau_pushbuf_kick(ctx.push, ctx.chan);
+	nouveau_pushbuf_del(&push);
+	nouveau_client_del(&client);
+	for (i = 0; i < nr; i++)
+		nouveau_bo_ref(NULL, &bos[i]);
+	free(bos);
+	free(set);
+	bench_fini(&ctx);
+}
+
+static void
+suite_bomap(void)
+{
+	bench_bomap(10, 10, "bo map lookup, 10 bos");
+	bench_bomap(100, 100, "bo map lookup, 100 bos");
+	bench_bomap(1000, 1000, "bo map lookup, 1k bos");
+	bench_bomap(10000, 1000, "bo map lookup, 10k bos, 1k hot");
+	bench_bomap(100000, 1000, "bo map lookup, 100k bos, 1k hot");
+	bench_bomap(10000, 10000, "bo map lookup, 10k bos, all hot");
+	bench_bomap(100000, 100000, "bo map lookup, 100k bos, all hot");
+}
+
+/* References 16 bos, records a few methods and kicks */
+static void
+bench_kick(const struct nouveau_pushbuf_attr *attr, const char *name)
+{
+	struct nouveau_pushbuf_refn refs[16];
+	struct nouveau_pushbuf_stats stats;
+	struct bench_result res;
+	struct bench_ctx ctx;
+	struct nouveau_bo *bos[16];
+	uint64_t t;
+	int i, j;
+
+	bench_init(&ctx, attr);
+	for (i = 0; i < 16; i++) {
+		CHECK(!nouveau_bo_new(ctx.dev, NOUVEAU_BO_GART, 0, 0x10000, NULL, &bos[i]));
+		refs[i] = (struct nouveau_pushbuf_refn){ bos[i],
+			(i & 1 ? NOUVEAU_BO_WR : NOUVEAU_BO_RD) | NOUVEAU_BO_GART };
+	}
+
+	result_begin(&res, iterations);
+	for (i = 0; i < iterations; i++) {
+		t = now_ns();
+		CHECK(!nouveau_pushbuf_space(ctx.push, 64, 0, 0));
+		CHECK(!nouveau_pushbuf_refn(ctx.push, refs, 16));
+		for (j = 0; j < 32; j++)
+			*ctx.push->cur++ = 0;
+		CHECK(!nouveau_pushbuf_kick(ctx.push, ctx.chan));
+		result_add(&res, now_ns() - t);
+	}
+	result_end(&res, name);
+	nouveau_pushbuf_get_stats(ctx.push, &stats);
+	if (attr && (attr->flags & NOUVEAU_PUSHBUF_RING))
+		printf("%-36s %12llu\n", "  ring stalls",
+		       (unsigned long long)stats.ring_stalls);
+
+	for (i = 0; i < 16; i++)
+		nouveau_bo_ref(NULL, &bos[i]);
+	bench_fini(&ctx);
+}
+
+static void
+suite_kick(void)
+{
+	struct nouveau_pushbuf_attr ring = { .flags = NOUVEAU_PUSHBUF_RING };
+
+	bench_kick(NULL, "refn 16 bos + kick");
+	bench_kick(&ring, "refn 16 bos + kick, ring");
+}
+
+static void
+suite_fence(void)
+{
+	struct bench_result res;
+	struct bench_ctx ctx;
+	struct nouveau_fence fence;
+	uint64_t t;
+	int i, n = iterations / 10;
+
+	bench_init(&ctx, NULL);
+
+	result_begin(&res, n);
+	for (i = 0; i < n; i++) {
+		t = now_ns();
+		CHECK(!nouveau_pushbuf_space(ctx.push, 8, 0, 0));
+		*ctx.push->cur++ = 0;
+		CHECK(!nouveau_pushbuf_kick_fence(ctx.push, ctx.chan, &fence));
+		CHECK(!nouveau_fence_wait(&fence, -1));
+		result_add(&res, now_ns() - t);
+	}
+	result_end(&res, "kick + fence wait round trip");
+
+	result_begin(&res, iterations);
+	for (i = 0; i < iterations; i++) {
+		t = now_ns();
+		CHECK(!nouveau_fence_wait(&fence, -1));
+		result_add(&res, now_ns() - t);
+	}
+	result_end(&res, "fence wait, signaled");
+
+	bench_fini(&ctx);
+}
+
+/* Threads recording into pushbufs of their own on one client, all reading
+ * a few shared bos.  A thread finding a shared bo on another thread's
+ * pushbuf gets -EBUSY, kicks its own and tries again.
+ */
+struct contend_thread {
+	struct nouveau_object *chan;
+	struct nouveau_pushbuf *push;
+	struct nouveau_bo **shared;
+	uint64_t *ns;
+	int retries;
+	pthread_t thread;
+};
+
+#define NR_SHARED 4
+
+static void *
+contend_run(void *arg)
+{
+	struct contend_thread *thr = arg;
+	struct nouveau_pushbuf_refn refs[NR_SHARED];
+	uint64_t t;
+	int i, j, ret;
+
+	for (i = 0; i < NR_SHARED; i++)
+		refs[i] = (struct nouveau_pushbuf_refn){ thr->shared[i],
+			NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+
+	for (i = 0; i < iterations; i++) {
+		t = now_ns();
+		for (;;) {
+			CHECK(!nouveau_pushbuf_space(thr->push, 64, 0, 0));
+			ret = nouveau_pushbuf_refn(thr->push, refs, NR_SHARED);
+			if (ret != -EBUSY)
+				break;
+			thr->retries++;
+			CHECK(!nouveau_pushbuf_kick(thr->push, thr->chan));
+		}
+		CHECK(!ret);
+		for (j = 0; j < 32; j++)
+			*thr->push->cur++ = 0;
+		CHECK(!nouveau_pushbuf_kick(thr->push, thr->chan));
+		thr->ns[i] = now_ns() - t;
+	}
+
+	return NULL;
+}
+
+static void
+bench_contend(int nr)
+{
+	struct contend_thread thr[4];
+	struct nouveau_bo *shared[NR_SHARED];
+	struct bench_result res;
+	struct bench_ctx ctx;
+	char name[64];
+	int i, retries = 0;
+
+	bench_init(&ctx, NULL);
+	for (i = 0; i < NR_SHARED; i++)
+		CHECK(!nouveau_bo_new(ctx.dev, NOUVEAU_BO_GART, 0, 0x10000, NULL,
+				      &shared[i]));
+
+	result_begin(&res, nr * iterations);
+	for (i = 0; i < nr; i++) {
+		thr[i] = (struct contend_thread){ NULL, NULL, shared,
+						  res.ns + i * iterations };
+		CHECK(!nouveau_object_new(&ctx.dev->object, 0, NOUVEAU_FIFO_CHANNEL_CLASS,
+					  NULL, 0, &thr[i].chan));
+		CHECK(!nouveau_pushbuf_new(ctx.client, thr[i].chan, 4, 0x10000, true,
+					   &thr[i].push));
+	}
+	res.total_ns = now_ns();
+	for (i = 0; i < nr; i++)
+		CHECK(!pthread_create(&thr[i].thread, NULL, contend_run, &thr[i]));
+	for (i = 0; i < nr; i++) {
+		pthread_join(thr[i].thread, NULL);
+		retries += thr[i].retries;
+	}
+	res.nr = nr * iterations;
+	snprintf(name, sizeof(name), "refn shared + kick, %d thread%s, %.2f busy/op",
+		 nr, nr > 1 ? "s" : "", (double)retries / res.nr);
+	result_end(&res, name);
+
+	for (i = 0; i < nr; i++) {
+		nouveau_pushbuf_del(&thr[i].push);
+		nouveau_object_del(&thr[i].chan);
+	}
+	for (i = 0; i < NR_SHARED; i++)
+		nouveau_bo_ref(NULL, &shared[i]);
+	bench_fini(&ctx);
+}
+
+static void
+suite_contend(void)
+{
+	int nr;
+
+	for (nr = 1; nr <= 4; nr++)
+		bench_contend(nr);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} suites[] = {
+	{ "bo", suite_bo },
+	{ "bomap", suite_bomap },
+	{ "bw", suite_bw },
+	{ "kick", suite_kick },
+	{ "fence", suite_fence },
+	{ "contend", suite_contend },
+};
+
+#define NR_SUITES (int)(sizeof(suites) / sizeof(suites[0]))
+
+int
+main(int argc, char **argv)
+{
+	int opt, i, j;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		if (opt == 'n')
+			iterations = atoi(optarg);
+		else {
+			fprintf(stderr, "usage: %s [-n iterations] [suite...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (iterations < 100)
+		iterations = 100;
+
+	for (i = 0; i < NR_SUITES; i++) {
+		bool run = optind == argc;
+		for (j = optind; j < argc; j++)
+			run |= !strcmp(argv[j], suites[i].name);
+		if (run) {
+			printf("%s:\n", suites[i].name);
+			suites[i].run();
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+/* Knobs and introspection of the simulated nv services, for the tests and
+ * benchmarks.  None of this exists on the console.
+ */
+#ifndef __HOST_H__
+#define __HOST_H__
+
+#include <switch.h>
+
+/* Calls into the simulated nv services, which on the console each cost a
+ * round trip to the nvservices sysmodule.
+ */
+typedef struct {
+	u64 nv_calls;
+	u64 map_creates;
+	u64 as_maps;
+	u64 kickoffs;
+	u64 gpfifo_entries;
+	u64 fence_waits;
+	u64 fence_polls;
+	u64 ioctls;
+	u64 dcache_ops;
+	u64 dcache_bytes;
+	u64 watchdog_timeouts;
+} HostNvStats;
+
+void hostGetStats(HostNvStats *stats);
+void hostResetStats(void);
+
+/* Time between a kickoff and the GPU starting to run it, 10us by default */
+void hostGpuSetLatency(u64 ns);
+
+/* Time a channel may sit in a syncpoint wait before the watchdog kills it
+ * and forces its syncpoint to its max value, 2s by default.
+ */
+void hostGpuSetWatchdog(u64 ns);
+
+/* Holds back, or lets go of, the channel incrementing a syncpoint */
+void hostGpuPause(u32 syncpt_id, bool pause);
+
+/* Blocks until every submission made so far has run */
+void hostGpuIdle(void);
+
+u32 hostSyncptRead(u32 id);
+u32 hostSyncptMax(u32 id);
+
+typedef struct {
+	u32 priority;
+	u32 timeslice_us;
+	bool dead;
+} HostChannelInfo;
+
+bool hostChannelQuery(u32 syncpt_id, HostChannelInfo *info);
+
+typedef struct {
+	iova_t iova;
+	u64 size;
+	u32 page_size;
+	NvKind kind;
+	bool fixed;
+	bool cpu_cacheable;
+	bool gpu_cacheable;
+	void *cpu_addr;
+} HostMapInfo;
+
+/* Looks up the mapping an address falls into */
+bool hostAddressSpaceQuery(NvAddressSpace *a, iova_t iova, HostMapInfo *info);
+
+#endif /* __HOST_H__ */
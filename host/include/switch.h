@@ -0,0 +1,267 @@
+/* Stand-in for the parts of libnx the library uses, for building and
+ * running it on a host.  The nv services are simulated in ../nx, see
+ * host.h for the knobs the tests and benchmarks use.
+ */
+#ifndef __HOST_SWITCH_H__
+#define __HOST_SWITCH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t   s8;
+typedef int16_t  s16;
+typedef int32_t  s32;
+typedef int64_t  s64;
+
+typedef u32 Result;
+typedef u32 Handle;
+typedef u64 iova_t;
+
+#define BIT(n) (1U << (n))
+
+#define R_SUCCEEDED(res)   ((res) == 0)
+#define R_FAILED(res)      ((res) != 0)
+#define R_MODULE(res)      ((res) & 0x1FF)
+#define R_DESCRIPTION(res) (((res) >> 9) & 0x1FFF)
+#define MAKERESULT(module, description) \
+	((((module) & 0x1FF)) | ((description) & 0x1FFF) << 9)
+
+enum {
+	Module_Libnx = 345,
+	Module_LibnxNvidia = 348,
+};
+
+enum {
+	LibnxNvidiaError_Unknown = 1,
+	LibnxNvidiaError_NotImplemented,
+	LibnxNvidiaError_NotSupported,
+	LibnxNvidiaError_NotInitialized,
+	LibnxNvidiaError_BadParameter,
+	LibnxNvidiaError_Timeout,
+	LibnxNvidiaError_InsufficientMemory,
+	LibnxNvidiaError_ReadOnlyAttribute,
+	LibnxNvidiaError_InvalidState,
+	LibnxNvidiaError_InvalidAddress,
+	LibnxNvidiaError_InvalidSize,
+	LibnxNvidiaError_BadValue,
+	LibnxNvidiaError_AlreadyAllocated,
+	LibnxNvidiaError_Busy,
+	LibnxNvidiaError_ResourceError,
+	LibnxNvidiaError_CountMismatch,
+	LibnxNvidiaError_SharedMemoryTooSmall,
+	LibnxNvidiaError_FileOperationFailed,
+	LibnxNvidiaError_IoctlFailed,
+};
+
+/* kernel */
+typedef struct {
+	pthread_mutex_t mutex;
+	void *owner;
+} Mutex;
+
+void mutexInit(Mutex *m);
+void mutexLock(Mutex *m);
+bool mutexTryLock(Mutex *m);
+void mutexUnlock(Mutex *m);
+
+void svcSleepThread(s64 nano);
+
+/* arm */
+u64 armGetSystemTick(void);
+
+static inline u64
+armGetSystemTickFreq(void)
+{
+	return 19200000;
+}
+
+static inline u64
+armNsToTicks(u64 ns)
+{
+	return (ns * 12) / 625;
+}
+
+static inline u64
+armTicksToNs(u64 tick)
+{
+	return (tick * 625) / 12;
+}
+
+void armDCacheFlush(void *addr, size_t size);
+void armDCacheClean(void *addr, size_t size);
+
+/* nvidia */
+Result nvInitialize(void);
+void nvExit(void);
+
+Result nvOpen(u32 *fd, const char *devicepath);
+Result nvIoctl(u32 fd, u32 request, void *argp);
+Result nvClose(u32 fd);
+
+#define _NV_IOC_NONE  0U
+#define _NV_IOC_WRITE 1U
+#define _NV_IOC_READ  2U
+
+#define _NV_IOC(dir, type, nr, size) \
+	(((dir) << 30) | ((size) << 16) | ((type) << 8) | (nr))
+#define _NV_IO(type, nr)         _NV_IOC(_NV_IOC_NONE, (type), (nr), 0)
+#define _NV_IOR(type, nr, size)  _NV_IOC(_NV_IOC_READ, (type), (nr), sizeof(size))
+#define _NV_IOW(type, nr, size)  _NV_IOC(_NV_IOC_WRITE, (type), (nr), sizeof(size))
+#define _NV_IOWR(type, nr, size) \
+	_NV_IOC(_NV_IOC_READ | _NV_IOC_WRITE, (type), (nr), sizeof(size))
+
+typedef struct {
+	u32 id;
+	u32 value;
+} NvFence;
+
+typedef struct {
+	u32 num_fences;
+	NvFence fences[4];
+} NvMultiFence;
+
+Result nvFenceInit(void);
+void nvFenceExit(void);
+Result nvFenceWait(NvFence *f, s32 timeout_us);
+
+typedef enum {
+	NvKind_Pitch = 0x0,
+	NvKind_Z16 = 0x1,
+	NvKind_Z16_2C = 0x2,
+	NvKind_C32_2C = 0xdb,
+	NvKind_C32_2CRA = 0xdd,
+	NvKind_Generic_16BX2 = 0xfe,
+	NvKind_Invalid = 0xff,
+} NvKind;
+
+typedef struct {
+	u32 handle;
+	u32 id;
+	u32 size;
+	void *cpu_addr;
+	NvKind kind;
+	bool has_init;
+	bool is_cpu_cacheable;
+} NvMap;
+
+Result nvMapInit(void);
+void nvMapExit(void);
+Result nvMapCreate(NvMap *m, void *cpu_addr, u32 size, u32 align, NvKind kind,
+		   bool is_cpu_cacheable);
+Result nvMapLoadRemote(NvMap *m, u32 id);
+void nvMapClose(NvMap *m);
+
+static inline u32 nvMapGetHandle(NvMap *m) { return m->handle; }
+static inline u32 nvMapGetId(NvMap *m) { return m->id; }
+static inline u32 nvMapGetSize(NvMap *m) { return m->size; }
+static inline void *nvMapGetCpuAddr(NvMap *m) { return m->cpu_addr; }
+
+typedef struct {
+	u32 fd;
+	u32 page_size;
+	bool has_init;
+} NvAddressSpace;
+
+Result nvAddressSpaceCreate(NvAddressSpace *a, u32 page_size);
+void nvAddressSpaceClose(NvAddressSpace *a);
+Result nvAddressSpaceAlloc(NvAddressSpace *a, bool sparse, u64 size, iova_t *iova_out);
+Result nvAddressSpaceAllocFixed(NvAddressSpace *a, bool sparse, u64 size, iova_t iova);
+Result nvAddressSpaceFree(NvAddressSpace *a, iova_t iova, u64 size);
+Result nvAddressSpaceMap(NvAddressSpace *a, u32 nvmap_handle, bool is_gpu_cacheable,
+			 NvKind kind, iova_t *iova_out);
+Result nvAddressSpaceMapFixed(NvAddressSpace *a, u32 nvmap_handle, bool is_gpu_cacheable,
+			      NvKind kind, iova_t iova);
+Result nvAddressSpaceUnmap(NvAddressSpace *a, iova_t iova);
+
+typedef struct {
+	u32 fd;
+	bool has_init;
+} NvChannel;
+
+typedef enum {
+	NvChannelPriority_Low = 50,
+	NvChannelPriority_Medium = 100,
+	NvChannelPriority_High = 150,
+} NvChannelPriority;
+
+Result nvChannelSetPriority(NvChannel *c, NvChannelPriority prio);
+
+#define GPFIFO_QUEUE_SIZE 0x800
+#define GPFIFO_ENTRY_NOT_MAIN BIT(9)
+#define GPFIFO_ENTRY_NO_PREFETCH BIT(31)
+
+typedef struct {
+	union {
+		u64 desc;
+		u32 desc32[2];
+	};
+} nvioctl_gpfifo_entry;
+
+typedef struct {
+	NvChannel base;
+	NvFence fence;
+	u32 fence_incr;
+	nvioctl_gpfifo_entry entries[GPFIFO_QUEUE_SIZE];
+	u32 num_entries;
+} NvGpuChannel;
+
+Result nvGpuChannelCreate(NvGpuChannel *c, NvAddressSpace *as, NvChannelPriority prio);
+void nvGpuChannelClose(NvGpuChannel *c);
+Result nvGpuChannelZcullBind(NvGpuChannel *c, iova_t iova);
+Result nvGpuChannelAppendEntry(NvGpuChannel *c, iova_t start, size_t num_cmds,
+			       u32 flags, u32 flush_threshold);
+Result nvGpuChannelKickoff(NvGpuChannel *c);
+
+static inline u32
+nvGpuChannelGetSyncpointId(NvGpuChannel *c)
+{
+	return c->fence.id;
+}
+
+static inline void
+nvGpuChannelGetFence(NvGpuChannel *c, NvFence *fence_out)
+{
+	fence_out->id = c->fence.id;
+	fence_out->value = c->fence.value + c->fence_incr;
+}
+
+static inline void
+nvGpuChannelIncrFence(NvGpuChannel *c)
+{
+	++c->fence_incr;
+}
+
+typedef struct {
+	u32 arch;
+	u32 impl;
+	u32 rev;
+	u32 num_gpc;
+	u64 L2_cache_size;
+	u64 on_board_video_memory_size;
+	u32 num_tpc_per_gpc;
+	u32 bus_type;
+	u32 big_page_size;
+	u32 compression_page_size;
+	u32 pde_coverage_bit_count;
+	u32 available_big_page_sizes;
+	u32 gpc_mask;
+	u32 sm_arch_sm_version;
+	u32 sm_arch_spa_version;
+	u32 sm_arch_warp_count;
+	u32 gpu_va_bit_count;
+	u32 reserved;
+	u64 flags;
+} nvioctl_gpu_characteristics;
+
+Result nvGpuInit(void);
+void nvGpuExit(void);
+const nvioctl_gpu_characteristics *nvGpuGetCharacteristics(void);
+u32 nvGpuGetZcullCtxSize(void);
+
+#endif /* __HOST_SWITCH_H__ */
@@ -0,0 +1,701 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "internal.h"
+
+/* Each channel runs its submissions in order on a thread of its own, a
+ * timer after they were kicked off.  The commands are interpreted for
+ * what the library emits: syncpoint increments and waits, host semaphore
+ * releases and copy engine copies and fills.  Everything else is skipped.
+ */
+#define NX_MAX_SYNCPTS   192
+#define NX_MAX_CHANNELS  64
+
+#define NX_SUBC_COPY     4
+
+#define NX_SEMAPHOREA    0x0010
+#define NX_SEMAPHORED    0x001c
+#define NX_SYNCPOINTA    0x0070
+#define NX_SYNCPOINTB    0x0074
+#define NX_SYNCPT_ACTION 0x02c8
+
+#define NX_CE_LAUNCH_DMA 0x0300
+#define NX_CE_OFFSET_IN  0x0400
+#define NX_CE_OFFSET_OUT 0x0408
+#define NX_CE_PITCH_IN   0x0410
+#define NX_CE_PITCH_OUT  0x0414
+#define NX_CE_LINE_LEN   0x0418
+#define NX_CE_LINE_COUNT 0x041c
+#define NX_CE_REMAP_A    0x0700
+#define NX_CE_REMAP_COMP 0x0708
+#define NX_CE_METHODS    0x0800
+
+#define NX_CE_MULTI_LINE   0x00000200
+#define NX_CE_REMAP_ENABLE 0x00000400
+
+/* Not wrapped by libnx */
+#define NX_CHANNEL_IOCTL_MAGIC    0x48
+#define NX_SET_TIMESLICE_NR       0x1D
+
+struct nx_job {
+	struct nx_job *next;
+	u64 due_ns;
+	u32 nr;
+	nvioctl_gpfifo_entry entries[];
+};
+
+struct nx_channel {
+	bool used;
+	bool paused;
+	bool dead;
+	bool exit;
+	u32 syncpt;
+	u32 as_fd;
+	u32 priority;
+	u32 timeslice_us;
+	pthread_t thread;
+	pthread_cond_t cond;
+	struct nx_job *head, **tail;
+	bool busy;
+
+	/* method state */
+	u32 sem[4];
+	u32 syncpt_payload;
+	u32 ce[NX_CE_METHODS / 4];
+};
+
+static pthread_mutex_t gpu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gpu_cond;
+static u32 syncpt_val[NX_MAX_SYNCPTS];
+static u32 syncpt_max[NX_MAX_SYNCPTS];
+static struct nx_channel nx_channels[NX_MAX_CHANNELS];
+static u64 gpu_latency_ns = 10000;
+static u64 gpu_watchdog_ns = 2000000000ULL;
+
+static inline bool
+syncpt_passed(u32 id, u32 value)
+{
+	return (s32)(syncpt_val[id] - value) >= 0;
+}
+
+static void
+nx_deadline(struct timespec *ts, u64 ns)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+static void
+nx_cond_init(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* Deadlines are taken from the monotonic clock, like armGetSystemTick() */
+__attribute__((constructor)) static void
+gpu_cond_init(void)
+{
+	nx_cond_init(&gpu_cond);
+}
+
+static void
+gpu_syncpt_incr(u32 id)
+{
+	if (id >= NX_MAX_SYNCPTS)
+		return;
+	pthread_mutex_lock(&gpu_lock);
+	syncpt_val[id]++;
+	pthread_cond_broadcast(&gpu_cond);
+	pthread_mutex_unlock(&gpu_lock);
+}
+
+static bool
+gpu_syncpt_wait(struct nx_channel *ch, u32 id, u32 value)
+{
+	struct timespec ts;
+	int ret = 0;
+
+	if (id >= NX_MAX_SYNCPTS)
+		return false;
+
+	nx_deadline(&ts, gpu_watchdog_ns);
+	pthread_mutex_lock(&gpu_lock);
+	while (!syncpt_passed(id, value) && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&gpu_cond, &gpu_lock, &ts);
+	ret = syncpt_passed(id, value);
+	pthread_mutex_unlock(&gpu_lock);
+
+	if (!ret) {
+		fprintf(stderr, "host: channel of syncpoint %u timed out waiting for "
+			"syncpoint %u to reach %u (at %u, max %u)\n", ch->syncpt, id,
+			value, syncpt_val[id], syncpt_max[id]);
+		NX_STAT(watchdog_timeouts, 1);
+	}
+	return ret;
+}
+
+static void
+gpu_semaphore(struct nx_channel *ch)
+{
+	iova_t addr = ((u64)(ch->sem[0] & 0xff) << 32) | ch->sem[1];
+	bool four_bytes = ch->sem[3] & (1 << 24);
+	u32 *p;
+
+	// Only releases are emitted by the library
+	if ((ch->sem[3] & 0x1f) != 2)
+		return;
+
+	p = nx_as_translate(ch->as_fd, addr, four_bytes ? 4 : 16);
+	if (!p) {
+		fprintf(stderr, "host: semaphore release to unmapped 0x%llx\n",
+			(unsigned long long)addr);
+		return;
+	}
+
+	p[0] = ch->sem[2];
+	if (!four_bytes) {
+		u64 now = nx_now_ns();
+		p[1] = 0;
+		memcpy(&p[2], &now, sizeof(now));
+	}
+	__sync_synchronize();
+}
+
+static void
+gpu_copy(struct nx_channel *ch, u32 launch)
+{
+	iova_t src = ((u64)(ch->ce[NX_CE_OFFSET_IN / 4] & 0xff) << 32) |
+		     ch->ce[NX_CE_OFFSET_IN / 4 + 1];
+	iova_t dst = ((u64)(ch->ce[NX_CE_OFFSET_OUT / 4] & 0xff) << 32) |
+		     ch->ce[NX_CE_OFFSET_OUT / 4 + 1];
+	u32 pitch_in = ch->ce[NX_CE_PITCH_IN / 4];
+	u32 pitch_out = ch->ce[NX_CE_PITCH_OUT / 4];
+	u32 len = ch->ce[NX_CE_LINE_LEN / 4];
+	u32 lines = (launch & NX_CE_MULTI_LINE) ? ch->ce[NX_CE_LINE_COUNT / 4] : 1;
+	bool remap = launch & NX_CE_REMAP_ENABLE;
+	u32 value = ch->ce[NX_CE_REMAP_A / 4];
+	u32 l, i;
+
+	// Remapped lines are counted in components, the library uses 4 bytes
+	if (remap) {
+		if ((ch->ce[NX_CE_REMAP_COMP / 4] & 0x7) != 4) {
+			fprintf(stderr, "host: unsupported copy engine remap\n");
+			return;
+		}
+		len *= 4;
+	}
+
+	for (l = 0; l < lines; l++) {
+		u8 *d = nx_as_translate(ch->as_fd, dst + (u64)l * pitch_out, len);
+		u8 *s = remap ? NULL : nx_as_translate(ch->as_fd, src + (u64)l * pitch_in, len);
+
+		if (!d || (!remap && !s)) {
+			fprintf(stderr, "host: copy engine access to unmapped memory\n");
+			return;
+		}
+
+		if (remap) {
+			for (i = 0; i < len; i += 4)
+				memcpy(d + i, &value, 4);
+		} else
+			memmove(d, s, len);
+	}
+	__sync_synchronize();
+}
+
+static bool
+gpu_method(struct nx_channel *ch, u32 subc, u32 mthd, u32 data)
+{
+	if (mthd == NX_SYNCPT_ACTION) {
+		if (data & (1 << 20))
+			gpu_syncpt_incr(data & 0xffff);
+		return true;
+	}
+
+	if (mthd < 0x100) {
+		if (mthd >= NX_SEMAPHOREA && mthd <= NX_SEMAPHORED) {
+			ch->sem[(mthd - NX_SEMAPHOREA) / 4] = data;
+			if (mthd == NX_SEMAPHORED)
+				gpu_semaphore(ch);
+		} else if (mthd == NX_SYNCPOINTA) {
+			ch->syncpt_payload = data;
+		} else if (mthd == NX_SYNCPOINTB) {
+			u32 id = (data >> 8) & 0xfff;
+			if (data & 1)
+				gpu_syncpt_incr(id);
+			else if (!gpu_syncpt_wait(ch, id, ch->syncpt_payload))
+				return false;
+		}
+		return true;
+	}
+
+	if (subc == NX_SUBC_COPY && mthd < NX_CE_METHODS) {
+		ch->ce[mthd / 4] = data;
+		if (mthd == NX_CE_LAUNCH_DMA)
+			gpu_copy(ch, data);
+	}
+	return true;
+}
+
+static bool
+gpu_exec(struct nx_channel *ch, const u32 *cmd, u32 nr)
+{
+	u32 i = 0, j;
+
+	while (i < nr) {
+		u32 hdr = cmd[i++];
+		u32 type = hdr >> 29;
+		u32 count = (hdr >> 16) & 0x1fff;
+		u32 subc = (hdr >> 13) & 7;
+		u32 mthd = (hdr & 0x1fff) << 2;
+
+		switch (type) {
+		case 1: // incrementing
+		case 3: // non-incrementing
+		case 5: // increment once
+			if (i + count > nr) {
+				fprintf(stderr, "host: method 0x%x runs past its cmdlist\n", mthd);
+				return true;
+			}
+			for (j = 0; j < count; j++) {
+				u32 m = mthd;
+				if (type == 1)
+					m += 4 * j;
+				else if (type == 5 && j)
+					m += 4;
+				if (!gpu_method(ch, subc, m, cmd[i++]))
+					return false;
+			}
+			break;
+		case 4: // immediate
+			if (!gpu_method(ch, subc, mthd, count))
+				return false;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void
+gpu_kill(struct nx_channel *ch)
+{
+	struct nx_job *job;
+
+	// nvgpu drops the work and releases whoever waits on the channel
+	pthread_mutex_lock(&gpu_lock);
+	ch->dead = true;
+	while ((job = ch->head)) {
+		ch->head = job->next;
+		free(job);
+	}
+	ch->tail = &ch->head;
+	syncpt_val[ch->syncpt] = syncpt_max[ch->syncpt];
+	pthread_cond_broadcast(&gpu_cond);
+	pthread_mutex_unlock(&gpu_lock);
+}
+
+static void *
+gpu_thread(void *arg)
+{
+	struct nx_channel *ch = arg;
+	struct nx_job *job;
+	struct timespec ts;
+	bool ok;
+	u32 i;
+
+	pthread_mutex_lock(&gpu_lock);
+	for (;;) {
+		job = ch->head;
+		if (!job || ch->paused) {
+			if (ch->exit)
+				break;
+			pthread_cond_wait(&ch->cond, &gpu_lock);
+			continue;
+		}
+
+		u64 now = nx_now_ns();
+		if (now < job->due_ns) {
+			nx_deadline(&ts, job->due_ns - now);
+			pthread_cond_timedwait(&ch->cond, &gpu_lock, &ts);
+			continue;
+		}
+
+		ch->busy = true;
+		pthread_mutex_unlock(&gpu_lock);
+
+		ok = true;
+		for (i = 0; i < job->nr && ok; i++) {
+			iova_t start = job->entries[i].desc32[0] |
+				       ((u64)(job->entries[i].desc32[1] & 0xff) << 32);
+			u32 num = (job->entries[i].desc32[1] >> 10) & 0x1fffff;
+			u32 *cmd = nx_as_translate(ch->as_fd, start, num * 4);
+
+			if (!cmd) {
+				fprintf(stderr, "host: cmdlist at unmapped 0x%llx\n",
+					(unsigned long long)start);
+				continue;
+			}
+			ok = gpu_exec(ch, cmd, num);
+		}
+
+		pthread_mutex_lock(&gpu_lock);
+		ch->busy = false;
+		if (ch->head == job) {
+			ch->head = job->next;
+			if (!ch->head)
+				ch->tail = &ch->head;
+			free(job);
+		}
+		pthread_cond_broadcast(&gpu_cond);
+		if (!ok) {
+			pthread_mutex_unlock(&gpu_lock);
+			gpu_kill(ch);
+			pthread_mutex_lock(&gpu_lock);
+		}
+	}
+	pthread_mutex_unlock(&gpu_lock);
+
+	return NULL;
+}
+
+static struct nx_channel *
+nx_channel_get(u32 fd)
+{
+	if (fd < NX_CHANNEL_FD_BASE || fd >= NX_CHANNEL_FD_BASE + NX_MAX_CHANNELS)
+		return NULL;
+	if (!nx_channels[fd - NX_CHANNEL_FD_BASE].used)
+		return NULL;
+	return &nx_channels[fd - NX_CHANNEL_FD_BASE];
+}
+
+static struct nx_channel *
+nx_channel_by_syncpt(u32 id)
+{
+	int i;
+
+	for (i = 0; i < NX_MAX_CHANNELS; i++) {
+		if (nx_channels[i].used && nx_channels[i].syncpt == id)
+			return &nx_channels[i];
+	}
+	return NULL;
+}
+
+Result
+nvGpuChannelCreate(NvGpuChannel *c, NvAddressSpace *as, NvChannelPriority prio)
+{
+	struct nx_channel *ch = NULL;
+	int i;
+
+	nx_call();
+
+	pthread_mutex_lock(&gpu_lock);
+	for (i = 0; i < NX_MAX_CHANNELS && !ch; i++) {
+		if (!nx_channels[i].used)
+			ch = &nx_channels[i];
+	}
+	if (ch) {
+		memset(ch, 0, sizeof(*ch));
+		ch->used = true;
+		// Syncpoints are not shared between channels, nor reused
+		for (i = 1; i < NX_MAX_SYNCPTS && !ch->syncpt; i++) {
+			if (!syncpt_max[i] && !nx_channel_by_syncpt(i))
+				ch->syncpt = i;
+		}
+		if (!ch->syncpt)
+			ch->used = false;
+	}
+	pthread_mutex_unlock(&gpu_lock);
+
+	if (!ch || !ch->used)
+		return NX_ERROR(ResourceError);
+
+	ch->as_fd = as->fd;
+	ch->priority = prio;
+	ch->tail = &ch->head;
+	nx_cond_init(&ch->cond);
+	if (pthread_create(&ch->thread, NULL, gpu_thread, ch)) {
+		ch->used = false;
+		return NX_ERROR(ResourceError);
+	}
+
+	memset(c, 0, sizeof(*c));
+	c->base.fd = NX_CHANNEL_FD_BASE + (ch - nx_channels);
+	c->base.has_init = true;
+	c->fence.id = ch->syncpt;
+	c->fence.value = syncpt_max[ch->syncpt];
+	return 0;
+}
+
+void
+nvGpuChannelClose(NvGpuChannel *c)
+{
+	struct nx_channel *ch;
+
+	nx_call();
+	if (!c->base.has_init)
+		return;
+
+	ch = nx_channel_get(c->base.fd);
+	if (!ch)
+		return;
+
+	// What was kicked off still runs
+	pthread_mutex_lock(&gpu_lock);
+	ch->exit = true;
+	ch->paused = false;
+	pthread_cond_broadcast(&ch->cond);
+	pthread_mutex_unlock(&gpu_lock);
+
+	pthread_join(ch->thread, NULL);
+	pthread_cond_destroy(&ch->cond);
+
+	pthread_mutex_lock(&gpu_lock);
+	ch->used = false;
+	pthread_mutex_unlock(&gpu_lock);
+
+	c->base.has_init = false;
+}
+
+Result
+nvGpuChannelZcullBind(NvGpuChannel *c, iova_t iova)
+{
+	nx_call();
+	return nx_channel_get(c->base.fd) ? 0 : NX_ERROR(BadParameter);
+}
+
+Result
+nvChannelSetPriority(NvChannel *c, NvChannelPriority prio)
+{
+	struct nx_channel *ch;
+
+	nx_call();
+	ch = nx_channel_get(c->fd);
+	if (!ch)
+		return NX_ERROR(BadParameter);
+	if (prio != NvChannelPriority_Low && prio != NvChannelPriority_Medium &&
+	    prio != NvChannelPriority_High)
+		return NX_ERROR(BadParameter);
+	ch->priority = prio;
+	return 0;
+}
+
+Result
+nx_channel_ioctl(u32 fd, u32 request, void *argp)
+{
+	struct nx_channel *ch = nx_channel_get(fd);
+
+	if (!ch)
+		return NX_ERROR(BadParameter);
+
+	if (((request >> 8) & 0xff) == NX_CHANNEL_IOCTL_MAGIC &&
+	    (request & 0xff) == NX_SET_TIMESLICE_NR) {
+		u32 us = *(u32 *)argp;
+		// nvgpu takes 1ms to 50ms
+		if (us < 1000 || us > 50000)
+			return NX_ERROR(BadParameter);
+		ch->timeslice_us = us;
+		return 0;
+	}
+
+	return NX_ERROR(NotImplemented);
+}
+
+Result
+nvGpuChannelAppendEntry(NvGpuChannel *c, iova_t start, size_t num_cmds, u32 flags,
+			u32 flush_threshold)
+{
+	Result rc;
+
+	if (flush_threshold >= GPFIFO_QUEUE_SIZE)
+		return NX_ERROR(BadParameter);
+
+	if (c->num_entries >= GPFIFO_QUEUE_SIZE - flush_threshold) {
+		rc = nvGpuChannelKickoff(c);
+		if (R_FAILED(rc))
+			return rc;
+	}
+
+	if (start) {
+		nvioctl_gpfifo_entry *entry = &c->entries[c->num_entries++];
+		entry->desc = start;
+		entry->desc32[1] |= flags | (num_cmds << 10);
+	}
+
+	return 0;
+}
+
+Result
+nvGpuChannelKickoff(NvGpuChannel *c)
+{
+	struct nx_channel *ch;
+	struct nx_job *job;
+	Result rc = 0;
+
+	if (!c->num_entries)
+		return 0;
+
+	nx_call();
+	NX_STAT(kickoffs, 1);
+	NX_STAT(gpfifo_entries, c->num_entries);
+
+	job = malloc(sizeof(*job) + c->num_entries * sizeof(job->entries[0]));
+	if (!job)
+		return NX_ERROR(InsufficientMemory);
+	job->next = NULL;
+	job->nr = c->num_entries;
+	job->due_ns = nx_now_ns() + gpu_latency_ns;
+	memcpy(job->entries, c->entries, c->num_entries * sizeof(job->entries[0]));
+
+	pthread_mutex_lock(&gpu_lock);
+	ch = nx_channel_get(c->base.fd);
+	if (!ch)
+		rc = NX_ERROR(BadParameter);
+	else if (ch->dead)
+		rc = NX_ERROR(InvalidState);
+	else {
+		syncpt_max[ch->syncpt] += c->fence_incr;
+		c->fence.id = ch->syncpt;
+		c->fence.value = syncpt_max[ch->syncpt];
+		*ch->tail = job;
+		ch->tail = &job->next;
+		job = NULL;
+		pthread_cond_signal(&ch->cond);
+	}
+	pthread_mutex_unlock(&gpu_lock);
+
+	free(job);
+	if (R_SUCCEEDED(rc)) {
+		c->num_entries = 0;
+		c->fence_incr = 0;
+	}
+	return rc;
+}
+
+Result
+nvFenceWait(NvFence *f, s32 timeout_us)
+{
+	struct timespec ts;
+	Result rc = 0;
+	int ret = 0;
+
+	nx_call();
+	NX_STAT(fence_waits, 1);
+	if (!timeout_us)
+		NX_STAT(fence_polls, 1);
+
+	if (f->id >= NX_MAX_SYNCPTS)
+		return NX_ERROR(BadParameter);
+
+	if (timeout_us > 0)
+		nx_deadline(&ts, (u64)timeout_us * 1000);
+
+	pthread_mutex_lock(&gpu_lock);
+	while (!syncpt_passed(f->id, f->value) && timeout_us && ret != ETIMEDOUT) {
+		if (timeout_us < 0)
+			pthread_cond_wait(&gpu_cond, &gpu_lock);
+		else
+			ret = pthread_cond_timedwait(&gpu_cond, &gpu_lock, &ts);
+	}
+	if (!syncpt_passed(f->id, f->value))
+		rc = NX_ERROR(Timeout);
+	pthread_mutex_unlock(&gpu_lock);
+
+	return rc;
+}
+
+void
+hostGpuSetLatency(u64 ns)
+{
+	gpu_latency_ns = ns;
+}
+
+void
+hostGpuSetWatchdog(u64 ns)
+{
+	gpu_watchdog_ns = ns;
+}
+
+void
+hostGpuPause(u32 syncpt_id, bool pause)
+{
+	struct nx_channel *ch;
+
+	pthread_mutex_lock(&gpu_lock);
+	ch = nx_channel_by_syncpt(syncpt_id);
+	if (ch) {
+		ch->paused = pause;
+		pthread_cond_signal(&ch->cond);
+	}
+	pthread_mutex_unlock(&gpu_lock);
+}
+
+void
+hostGpuIdle(void)
+{
+	bool busy;
+	int i;
+
+	pthread_mutex_lock(&gpu_lock);
+	do {
+		busy = false;
+		for (i = 0; i < NX_MAX_CHANNELS; i++) {
+			struct nx_channel *ch = &nx_channels[i];
+			if (ch->used && !ch->paused && (ch->head || ch->busy))
+				busy = true;
+		}
+		if (busy)
+			pthread_cond_wait(&gpu_cond, &gpu_lock);
+	} while (busy);
+	pthread_mutex_unlock(&gpu_lock);
+}
+
+u32
+hostSyncptRead(u32 id)
+{
+	u32 val;
+
+	pthread_mutex_lock(&gpu_lock);
+	val = id < NX_MAX_SYNCPTS ? syncpt_val[id] : 0;
+	pthread_mutex_unlock(&gpu_lock);
+	return val;
+}
+
+u32
+hostSyncptMax(u32 id)
+{
+	u32 val;
+
+	pthread_mutex_lock(&gpu_lock);
+	val = id < NX_MAX_SYNCPTS ? syncpt_max[id] : 0;
+	pthread_mutex_unlock(&gpu_lock);
+	return val;
+}
+
+bool
+hostChannelQuery(u32 syncpt_id, HostChannelInfo *info)
+{
+	struct nx_channel *ch;
+
+	pthread_mutex_lock(&gpu_lock);
+	ch = nx_channel_by_syncpt(syncpt_id);
+	if (ch) {
+		info->priority = ch->priority;
+		info->timeslice_us = ch->timeslice_us;
+		info->dead = ch->dead;
+	}
+	pthread_mutex_unlock(&gpu_lock);
+
+	return ch != NULL;
+}
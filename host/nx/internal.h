@@ -0,0 +1,31 @@
+#ifndef __HOST_NX_INTERNAL_H__
+#define __HOST_NX_INTERNAL_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <host.h>
+
+#define NX_ERROR(e) MAKERESULT(Module_LibnxNvidia, LibnxNvidiaError_##e)
+
+#define NX_STAT(field, n) __sync_fetch_and_add(&nx_stats.field, (n))
+
+extern HostNvStats nx_stats;
+
+/* Every call into the nv services is a round trip on the console */
+static inline void
+nx_call(void)
+{
+	NX_STAT(nv_calls, 1);
+}
+
+u64 nx_now_ns(void);
+
+/* Translates a GPU range that must lie within a single mapping */
+void *nx_as_translate(u32 as_fd, iova_t iova, u64 size);
+
+/* Channel file descriptors are handed out by gpu.c */
+#define NX_CHANNEL_FD_BASE 0x1000
+
+Result nx_channel_ioctl(u32 fd, u32 request, void *argp);
+
+#endif /* __HOST_NX_INTERNAL_H__ */
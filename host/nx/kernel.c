@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include "internal.h"
+
+HostNvStats nx_stats;
+
+/* Identifies the calling thread, libnx mutexes are not recursive */
+static __thread char nx_thread_tag;
+
+void
+mutexInit(Mutex *m)
+{
+	pthread_mutex_init(&m->mutex, NULL);
+	m->owner = NULL;
+}
+
+void
+mutexLock(Mutex *m)
+{
+	if (m->owner == &nx_thread_tag) {
+		fprintf(stderr, "host: recursive lock of mutex %p\n", (void *)m);
+		abort();
+	}
+	pthread_mutex_lock(&m->mutex);
+	m->owner = &nx_thread_tag;
+}
+
+bool
+mutexTryLock(Mutex *m)
+{
+	if (pthread_mutex_trylock(&m->mutex))
+		return false;
+	m->owner = &nx_thread_tag;
+	return true;
+}
+
+void
+mutexUnlock(Mutex *m)
+{
+	if (m->owner != &nx_thread_tag) {
+		fprintf(stderr, "host: unlock of mutex %p not held\n", (void *)m);
+		abort();
+	}
+	m->owner = NULL;
+	pthread_mutex_unlock(&m->mutex);
+}
+
+void
+svcSleepThread(s64 nano)
+{
+	struct timespec ts = { nano / 1000000000, nano % 1000000000 };
+
+	if (nano <= 0) {
+		sched_yield();
+		return;
+	}
+	nanosleep(&ts, NULL);
+}
+
+u64
+nx_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+u64
+armGetSystemTick(void)
+{
+	return armNsToTicks(nx_now_ns());
+}
+
+void
+armDCacheFlush(void *addr, size_t size)
+{
+	NX_STAT(dcache_ops, 1);
+	NX_STAT(dcache_bytes, size);
+	__sync_synchronize();
+}
+
+void
+armDCacheClean(void *addr, size_t size)
+{
+	NX_STAT(dcache_ops, 1);
+	NX_STAT(dcache_bytes, size);
+	__sync_synchronize();
+}
+
+void
+hostGetStats(HostNvStats *stats)
+{
+	__sync_synchronize();
+	*stats = nx_stats;
+}
+
+void
+hostResetStats(void)
+{
+	HostNvStats zero = { 0 };
+
+	nx_stats = zero;
+	__sync_synchronize();
+}
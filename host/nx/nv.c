@@ -0,0 +1,752 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+/* nvmap objects are shared between the handles referring to them, they
+ * stand for the memory the caller handed to nvMapCreate().
+ */
+struct nx_object {
+	void *cpu_addr;
+	u32 size;
+	u32 align;
+	u32 id;
+	NvKind kind;
+	bool cpu_cacheable;
+	int refs;
+};
+
+struct nx_mapping {
+	iova_t iova;
+	u64 size;
+	u32 page_size;
+	NvKind kind;
+	bool fixed;
+	bool gpu_cacheable;
+	struct nx_object *obj;
+};
+
+struct nx_range {
+	u64 start;
+	u64 end;
+};
+
+struct nx_range_list {
+	struct nx_range *r;
+	int nr;
+	int max;
+};
+
+/* GPU virtual addresses are handed out first fit from a sorted list of
+ * holes, so freed ranges are reused as nvgpu does.  A two level table of
+ * 4KiB pages points back at the mappings for translation.
+ */
+#define NX_VA_START  0x0004000000ULL
+#define NX_VA_END    0x10000000000ULL
+#define NX_PAGE      0x1000ULL
+#define NX_PT_SHIFT  24
+#define NX_PT_L2     (1 << (NX_PT_SHIFT - 12))
+#define NX_PT_L1     (NX_VA_END >> NX_PT_SHIFT)
+
+#define NX_MAX_AS 16
+
+struct nx_as {
+	bool used;
+	u32 big_page_size;
+	struct nx_range_list holes;
+	struct nx_range_list resv;
+	struct nx_mapping **pt[NX_PT_L1];
+};
+
+static pthread_mutex_t nx_lock = PTHREAD_MUTEX_INITIALIZER;
+static int nx_refs;
+static struct nx_as nx_as[NX_MAX_AS];
+
+static struct nx_object **nx_handles;
+static u32 nx_nr_handles;
+static u32 nx_max_handles;
+static u32 *nx_free_handles;
+static u32 nx_nr_free_handles;
+static u32 nx_next_id = 1;
+
+static const nvioctl_gpu_characteristics nx_gpu_info = {
+	.arch = 0x120,
+	.impl = 0xb,
+	.num_gpc = 1,
+	.num_tpc_per_gpc = 2,
+	.big_page_size = 0x20000,
+	.compression_page_size = 0x20000,
+	.available_big_page_sizes = 0x20000,
+	.gpu_va_bit_count = 40,
+};
+
+#define NX_CTRL_GPU_FD 1
+
+/* Not wrapped by libnx */
+#define NX_GET_GPU_TIME_NR 0x1C
+#define NX_GPU_IOCTL_MAGIC 0x47
+
+Result
+nvInitialize(void)
+{
+	pthread_mutex_lock(&nx_lock);
+	nx_refs++;
+	pthread_mutex_unlock(&nx_lock);
+	return 0;
+}
+
+void
+nvExit(void)
+{
+	pthread_mutex_lock(&nx_lock);
+	nx_refs--;
+	pthread_mutex_unlock(&nx_lock);
+}
+
+Result
+nvOpen(u32 *fd, const char *devicepath)
+{
+	nx_call();
+	if (strcmp(devicepath, "/dev/nvhost-ctrl-gpu"))
+		return NX_ERROR(NotSupported);
+	*fd = NX_CTRL_GPU_FD;
+	return 0;
+}
+
+Result
+nvIoctl(u32 fd, u32 request, void *argp)
+{
+	nx_call();
+	NX_STAT(ioctls, 1);
+
+	if (fd >= NX_CHANNEL_FD_BASE)
+		return nx_channel_ioctl(fd, request, argp);
+
+	if (fd == NX_CTRL_GPU_FD && ((request >> 8) & 0xff) == NX_GPU_IOCTL_MAGIC &&
+	    (request & 0xff) == NX_GET_GPU_TIME_NR) {
+		*(u64 *)argp = nx_now_ns();
+		return 0;
+	}
+
+	return NX_ERROR(NotImplemented);
+}
+
+Result
+nvClose(u32 fd)
+{
+	nx_call();
+	return fd == NX_CTRL_GPU_FD ? 0 : NX_ERROR(BadParameter);
+}
+
+Result nvFenceInit(void) { return 0; }
+void nvFenceExit(void) { }
+Result nvMapInit(void) { return 0; }
+void nvMapExit(void) { }
+Result nvGpuInit(void) { return 0; }
+void nvGpuExit(void) { }
+
+const nvioctl_gpu_characteristics *
+nvGpuGetCharacteristics(void)
+{
+	return &nx_gpu_info;
+}
+
+u32
+nvGpuGetZcullCtxSize(void)
+{
+	return 0x8000;
+}
+
+static u32
+nx_handle_new(struct nx_object *obj)
+{
+	u32 handle;
+
+	if (nx_nr_free_handles) {
+		handle = nx_free_handles[--nx_nr_free_handles];
+	} else {
+		if (nx_nr_handles == nx_max_handles) {
+			u32 max = nx_max_handles ? nx_max_handles * 2 : 64;
+			struct nx_object **handles;
+			u32 *free_handles;
+
+			handles = realloc(nx_handles, max * sizeof(*handles));
+			if (!handles)
+				return 0;
+			nx_handles = handles;
+			free_handles = realloc(nx_free_handles, max * sizeof(*free_handles));
+			if (!free_handles)
+				return 0;
+			nx_free_handles = free_handles;
+			nx_max_handles = max;
+		}
+		// Handle zero is never valid
+		if (!nx_nr_handles)
+			nx_handles[nx_nr_handles++] = NULL;
+		handle = nx_nr_handles++;
+	}
+
+	nx_handles[handle] = obj;
+	obj->refs++;
+	return handle;
+}
+
+static struct nx_object *
+nx_handle_get(u32 handle)
+{
+	if (!handle || handle >= nx_nr_handles)
+		return NULL;
+	return nx_handles[handle];
+}
+
+Result
+nvMapCreate(NvMap *m, void *cpu_addr, u32 size, u32 align, NvKind kind,
+	    bool is_cpu_cacheable)
+{
+	struct nx_object *obj;
+
+	nx_call();
+	NX_STAT(map_creates, 1);
+
+	if (!size || (align & (align - 1)) || ((uintptr_t)cpu_addr & (NX_PAGE - 1)))
+		return NX_ERROR(BadParameter);
+
+	// libnx writes back the cache and makes the memory uncached
+	if (!is_cpu_cacheable)
+		armDCacheFlush(cpu_addr, size);
+
+	obj = calloc(1, sizeof(*obj));
+	if (!obj)
+		return NX_ERROR(InsufficientMemory);
+
+	obj->cpu_addr = cpu_addr;
+	obj->size = size;
+	obj->align = align < NX_PAGE ? NX_PAGE : align;
+	obj->kind = kind;
+	obj->cpu_cacheable = is_cpu_cacheable;
+
+	pthread_mutex_lock(&nx_lock);
+	obj->id = nx_next_id++;
+	m->handle = nx_handle_new(obj);
+	pthread_mutex_unlock(&nx_lock);
+
+	if (!m->handle) {
+		free(obj);
+		return NX_ERROR(InsufficientMemory);
+	}
+
+	m->id = obj->id;
+	m->size = size;
+	m->cpu_addr = cpu_addr;
+	m->kind = kind;
+	m->has_init = true;
+	m->is_cpu_cacheable = is_cpu_cacheable;
+	return 0;
+}
+
+Result
+nvMapLoadRemote(NvMap *m, u32 id)
+{
+	struct nx_object *obj = NULL;
+	u32 i;
+
+	nx_call();
+
+	pthread_mutex_lock(&nx_lock);
+	for (i = 1; i < nx_nr_handles && !obj; i++) {
+		if (nx_handles[i] && nx_handles[i]->id == id)
+			obj = nx_handles[i];
+	}
+	m->handle = obj ? nx_handle_new(obj) : 0;
+	pthread_mutex_unlock(&nx_lock);
+
+	if (!m->handle)
+		return NX_ERROR(BadParameter);
+
+	m->id = id;
+	m->size = obj->size;
+	m->cpu_addr = NULL;
+	m->kind = obj->kind;
+	m->has_init = true;
+	m->is_cpu_cacheable = obj->cpu_cacheable;
+	return 0;
+}
+
+void
+nvMapClose(NvMap *m)
+{
+	struct nx_object *obj;
+
+	nx_call();
+	if (!m->has_init)
+		return;
+
+	pthread_mutex_lock(&nx_lock);
+	obj = nx_handle_get(m->handle);
+	if (obj) {
+		nx_handles[m->handle] = NULL;
+		nx_free_handles[nx_nr_free_handles++] = m->handle;
+		// Mappings keep the memory alive on the GPU side
+		if (!--obj->refs)
+			free(obj);
+	}
+	pthread_mutex_unlock(&nx_lock);
+
+	memset(m, 0, sizeof(*m));
+}
+
+static int
+nx_range_insert(struct nx_range_list *list, int i, u64 start, u64 end)
+{
+	struct nx_range *tmp;
+
+	if (list->nr == list->max) {
+		int max = list->max ? list->max * 2 : 16;
+		if (!(tmp = realloc(list->r, max * sizeof(*tmp))))
+			return -1;
+		list->r = tmp;
+		list->max = max;
+	}
+
+	memmove(&list->r[i + 1], &list->r[i], (list->nr - i) * sizeof(*tmp));
+	list->r[i].start = start;
+	list->r[i].end = end;
+	list->nr++;
+	return 0;
+}
+
+static void
+nx_range_remove(struct nx_range_list *list, int i)
+{
+	memmove(&list->r[i], &list->r[i + 1], (list->nr - i - 1) * sizeof(*list->r));
+	list->nr--;
+}
+
+/* Carves [start, end) out of the hole containing it */
+static bool
+nx_va_take(struct nx_as *as, u64 start, u64 end)
+{
+	struct nx_range_list *holes = &as->holes;
+	int i;
+
+	for (i = 0; i < holes->nr; i++) {
+		struct nx_range *h = &holes->r[i];
+		u64 hstart = h->start, hend = h->end;
+
+		if (start < hstart || end > hend)
+			continue;
+
+		if (start == hstart && end == hend)
+			nx_range_remove(holes, i);
+		else if (start == hstart)
+			h->start = end;
+		else if (end == hend)
+			h->end = start;
+		else {
+			h->end = start;
+			if (nx_range_insert(holes, i + 1, end, hend))
+				return false;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+static u64
+nx_va_alloc(struct nx_as *as, u64 size, u64 align)
+{
+	struct nx_range_list *holes = &as->holes;
+	int i;
+
+	for (i = 0; i < holes->nr; i++) {
+		u64 start = (holes->r[i].start + align - 1) & ~(align - 1);
+
+		if (start + size <= holes->r[i].end && nx_va_take(as, start, start + size))
+			return start;
+	}
+
+	return 0;
+}
+
+static void
+nx_va_free(struct nx_as *as, u64 start, u64 end)
+{
+	struct nx_range_list *holes = &as->holes;
+	int i;
+
+	for (i = 0; i < holes->nr && holes->r[i].start < start; i++);
+
+	// Merge with the neighbouring holes
+	if (i > 0 && holes->r[i - 1].end == start) {
+		holes->r[i - 1].end = end;
+		if (i < holes->nr && holes->r[i].start == end) {
+			holes->r[i - 1].end = holes->r[i].end;
+			nx_range_remove(holes, i);
+		}
+		return;
+	}
+	if (i < holes->nr && holes->r[i].start == end) {
+		holes->r[i].start = start;
+		return;
+	}
+	nx_range_insert(holes, i, start, end);
+}
+
+static struct nx_mapping **
+nx_pt_entry(struct nx_as *as, u64 iova, bool alloc)
+{
+	struct nx_mapping ***l2 = &as->pt[iova >> NX_PT_SHIFT];
+
+	if (iova >= NX_VA_END)
+		return NULL;
+	if (!*l2) {
+		if (!alloc)
+			return NULL;
+		*l2 = calloc(NX_PT_L2, sizeof(**l2));
+		if (!*l2)
+			return NULL;
+	}
+	return &(*l2)[(iova >> 12) & (NX_PT_L2 - 1)];
+}
+
+static struct nx_mapping *
+nx_pt_lookup(struct nx_as *as, u64 iova)
+{
+	struct nx_mapping **ent = nx_pt_entry(as, iova, false);
+	return ent ? *ent : NULL;
+}
+
+static bool
+nx_pt_set(struct nx_as *as, struct nx_mapping *map, struct nx_mapping *val)
+{
+	u64 va;
+
+	for (va = map->iova; va < map->iova + map->size; va += NX_PAGE) {
+		struct nx_mapping **ent = nx_pt_entry(as, va, true);
+		if (!ent)
+			return false;
+		*ent = val;
+	}
+	return true;
+}
+
+static struct nx_as *
+nx_as_get(NvAddressSpace *a)
+{
+	if (!a->has_init || a->fd >= NX_MAX_AS || !nx_as[a->fd].used)
+		return NULL;
+	return &nx_as[a->fd];
+}
+
+Result
+nvAddressSpaceCreate(NvAddressSpace *a, u32 page_size)
+{
+	struct nx_as *as = NULL;
+	u32 i;
+
+	nx_call();
+
+	pthread_mutex_lock(&nx_lock);
+	for (i = 0; i < NX_MAX_AS && !as; i++) {
+		if (!nx_as[i].used)
+			as = &nx_as[i];
+	}
+	if (as) {
+		memset(as, 0, sizeof(*as));
+		as->used = true;
+		as->big_page_size = page_size;
+		nx_range_insert(&as->holes, 0, NX_VA_START, NX_VA_END);
+	}
+	pthread_mutex_unlock(&nx_lock);
+
+	if (!as)
+		return NX_ERROR(ResourceError);
+
+	a->fd = as - nx_as;
+	a->page_size = page_size;
+	a->has_init = true;
+	return 0;
+}
+
+void
+nvAddressSpaceClose(NvAddressSpace *a)
+{
+	struct nx_as *as;
+	u64 i, j;
+
+	nx_call();
+
+	pthread_mutex_lock(&nx_lock);
+	as = nx_as_get(a);
+	if (as) {
+		for (i = 0; i < NX_PT_L1; i++) {
+			if (!as->pt[i])
+				continue;
+			for (j = 0; j < NX_PT_L2; j++) {
+				struct nx_mapping *map = as->pt[i][j];
+				if (map && map->iova == ((i << NX_PT_SHIFT) | (j << 12))) {
+					if (!--map->obj->refs)
+						free(map->obj);
+					free(map);
+				}
+			}
+			free(as->pt[i]);
+		}
+		free(as->holes.r);
+		free(as->resv.r);
+		as->used = false;
+	}
+	pthread_mutex_unlock(&nx_lock);
+
+	a->has_init = false;
+}
+
+Result
+nvAddressSpaceAlloc(NvAddressSpace *a, bool sparse, u64 size, iova_t *iova_out)
+{
+	struct nx_as *as;
+	u64 iova = 0;
+
+	nx_call();
+
+	pthread_mutex_lock(&nx_lock);
+	as = nx_as_get(a);
+	if (as) {
+		size = (size + NX_PAGE - 1) & ~(NX_PAGE - 1);
+		iova = nx_va_alloc(as, size, as->big_page_size);
+		if (iova)
+			nx_range_insert(&as->resv, as->resv.nr, iova, iova + size);
+	}
+	pthread_mutex_unlock(&nx_lock);
+
+	if (!iova)
+		return NX_ERROR(InsufficientMemory);
+	*iova_out = iova;
+	return 0;
+}
+
+Result
+nvAddressSpaceAllocFixed(NvAddressSpace *a, bool sparse, u64 size, iova_t iova)
+{
+	struct nx_as *as;
+	Result rc = 0;
+
+	nx_call();
+
+	if ((iova | size) & (NX_PAGE - 1) || !size)
+		return NX_ERROR(BadParameter);
+
+	pthread_mutex_lock(&nx_lock);
+	as = nx_as_get(a);
+	if (!as)
+		rc = NX_ERROR(BadParameter);
+	else if (!nx_va_take(as, iova, iova + size))
+		rc = NX_ERROR(AlreadyAllocated);
+	else
+		nx_range_insert(&as->resv, as->resv.nr, iova, iova + size);
+	pthread_mutex_unlock(&nx_lock);
+
+	return rc;
+}
+
+Result
+nvAddressSpaceFree(NvAddressSpace *a, iova_t iova, u64 size)
+{
+	struct nx_as *as;
+	Result rc = NX_ERROR(BadParameter);
+	u64 va;
+	int i;
+
+	nx_call();
+
+	pthread_mutex_lock(&nx_lock);
+	as = nx_as_get(a);
+	for (i = 0; as && i < as->resv.nr; i++) {
+		if (as->resv.r[i].start != iova || as->resv.r[i].end != iova + size)
+			continue;
+
+		// Still mapped ranges can't be freed
+		rc = 0;
+		for (va = iova; va < iova + size && !rc; va += NX_PAGE) {
+			if (nx_pt_lookup(as, va))
+				rc = NX_ERROR(Busy);
+		}
+		if (!rc) {
+			nx_range_remove(&as->resv, i);
+			nx_va_free(as, iova, iova + size);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&nx_lock);
+
+	return rc;
+}
+
+static Result
+nx_as_map(NvAddressSpace *a, u32 handle, bool gpu_cacheable, NvKind kind,
+	  iova_t *iova, bool fixed)
+{
+	struct nx_mapping *map;
+	struct nx_object *obj;
+	struct nx_as *as;
+	Result rc = 0;
+	u64 align, va;
+	int i;
+
+	nx_call();
+	NX_STAT(as_maps, 1);
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return NX_ERROR(InsufficientMemory);
+
+	pthread_mutex_lock(&nx_lock);
+	as = nx_as_get(a);
+	obj = nx_handle_get(handle);
+	if (!as || !obj) {
+		rc = NX_ERROR(BadParameter);
+		goto out;
+	}
+
+	// Big pages are used for what is aligned to and as large as one
+	map->page_size = NX_PAGE;
+	if (obj->size >= as->big_page_size && !(obj->align & (as->big_page_size - 1)))
+		map->page_size = as->big_page_size;
+	map->size = (obj->size + map->page_size - 1) & ~((u64)map->page_size - 1);
+	map->kind = kind;
+	map->fixed = fixed;
+	map->gpu_cacheable = gpu_cacheable;
+	map->obj = obj;
+	align = obj->align > map->page_size ? obj->align : map->page_size;
+
+	if (fixed) {
+		map->iova = *iova;
+		if (map->iova & (align - 1)) {
+			rc = NX_ERROR(BadParameter);
+			goto out;
+		}
+
+		// The range has to be reserved and not mapped yet
+		for (i = 0; i < as->resv.nr; i++) {
+			if (map->iova >= as->resv.r[i].start &&
+			    map->iova + map->size <= as->resv.r[i].end)
+				break;
+		}
+		if (i == as->resv.nr) {
+			rc = NX_ERROR(InvalidAddress);
+			goto out;
+		}
+		for (va = map->iova; va < map->iova + map->size; va += NX_PAGE) {
+			if (nx_pt_lookup(as, va)) {
+				rc = NX_ERROR(AlreadyAllocated);
+				goto out;
+			}
+		}
+	} else {
+		map->iova = nx_va_alloc(as, map->size, align);
+		if (!map->iova) {
+			rc = NX_ERROR(InsufficientMemory);
+			goto out;
+		}
+	}
+
+	if (!nx_pt_set(as, map, map)) {
+		nx_pt_set(as, map, NULL);
+		if (!fixed)
+			nx_va_free(as, map->iova, map->iova + map->size);
+		rc = NX_ERROR(InsufficientMemory);
+		goto out;
+	}
+
+	obj->refs++;
+	*iova = map->iova;
+	map = NULL;
+out:
+	pthread_mutex_unlock(&nx_lock);
+	free(map);
+	return rc;
+}
+
+Result
+nvAddressSpaceMap(NvAddressSpace *a, u32 nvmap_handle, bool is_gpu_cacheable,
+		  NvKind kind, iova_t *iova_out)
+{
+	return nx_as_map(a, nvmap_handle, is_gpu_cacheable, kind, iova_out, false);
+}
+
+Result
+nvAddressSpaceMapFixed(NvAddressSpace *a, u32 nvmap_handle, bool is_gpu_cacheable,
+		       NvKind kind, iova_t iova)
+{
+	return nx_as_map(a, nvmap_handle, is_gpu_cacheable, kind, &iova, true);
+}
+
+Result
+nvAddressSpaceUnmap(NvAddressSpace *a, iova_t iova)
+{
+	struct nx_mapping *map = NULL;
+	struct nx_as *as;
+
+	nx_call();
+
+	pthread_mutex_lock(&nx_lock);
+	as = nx_as_get(a);
+	if (as)
+		map = nx_pt_lookup(as, iova);
+	if (map && map->iova == iova) {
+		nx_pt_set(as, map, NULL);
+		if (!map->fixed)
+			nx_va_free(as, map->iova, map->iova + map->size);
+		if (!--map->obj->refs)
+			free(map->obj);
+	} else
+		map = NULL;
+	pthread_mutex_unlock(&nx_lock);
+
+	if (!map)
+		return NX_ERROR(BadParameter);
+	free(map);
+	return 0;
+}
+
+void *
+nx_as_translate(u32 as_fd, iova_t iova, u64 size)
+{
+	struct nx_mapping *map = NULL;
+	void *ptr = NULL;
+
+	pthread_mutex_lock(&nx_lock);
+	if (as_fd < NX_MAX_AS && nx_as[as_fd].used)
+		map = nx_pt_lookup(&nx_as[as_fd], iova);
+	if (map && map->obj->cpu_addr && iova + size <= map->iova + map->obj->size)
+		ptr = (char *)map->obj->cpu_addr + (iova - map->iova);
+	pthread_mutex_unlock(&nx_lock);
+
+	return ptr;
+}
+
+bool
+hostAddressSpaceQuery(NvAddressSpace *a, iova_t iova, HostMapInfo *info)
+{
+	struct nx_mapping *map = NULL;
+	struct nx_as *as;
+
+	pthread_mutex_lock(&nx_lock);
+	as = nx_as_get(a);
+	if (as)
+		map = nx_pt_lookup(as, iova);
+	if (map) {
+		info->iova = map->iova;
+		info->size = map->size;
+		info->page_size = map->page_size;
+		info->kind = map->kind;
+		info->fixed = map->fixed;
+		info->cpu_cacheable = map->obj->cpu_cacheable;
+		info->gpu_cacheable = map->gpu_cacheable;
+		info->cpu_addr = map->obj->cpu_addr;
+	}
+	pthread_mutex_unlock(&nx_lock);
+
+	return map != NULL;
+}
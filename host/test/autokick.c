@@ -0,0 +1,136 @@
+/* The auto-kick scheduler of immediate pushbufs */
+#include "test.h"
+
+static struct nouveau_pushbuf_stats
+stats(struct nouveau_pushbuf *push)
+{
+	struct nouveau_pushbuf_stats stats;
+
+	nouveau_pushbuf_get_stats(push, &stats);
+	return stats;
+}
+
+static void
+write_bo(struct test_ctx *ctx, struct nouveau_bo *bo)
+{
+	struct nouveau_pushbuf_refn ref = { bo, NOUVEAU_BO_WR | NOUVEAU_BO_GART };
+
+	CHECK_EQ(nouveau_pushbuf_space(ctx->push, 8, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx->push, &ref, 1), 0);
+	*ctx->push->cur++ = 0;
+}
+
+/* Small explicit kicks are submitted even when the scheduler would hold
+ * back lazy ones, so that polling for their completion terminates.
+ */
+static void
+test_kick_submits(void)
+{
+	struct nouveau_pushbuf_autokick ak = { .min_dwords = 1000, .max_delay_us = 1000000 };
+	struct nouveau_fence fence;
+	struct test_ctx ctx;
+	struct nouveau_bo *bo;
+
+	test_init(&ctx);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	CHECK_EQ(nouveau_pushbuf_set_autokick(ctx.push, &ak), 0);
+
+	write_bo(&ctx, bo);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	CHECK_EQ(stats(ctx.push).coalesced_kicks, 0);
+	CHECK_EQ(nouveau_bo_get_fence(bo, &fence), 0);
+	while (!nouveau_fence_signaled(&fence))
+		;
+
+	// The map submits the held back commands, which the paused channel
+	// can't have completed yet
+	hostGpuPause(fence.id, true);
+	write_bo(&ctx, bo);
+	CHECK_EQ(nouveau_pushbuf_kick_lazy(ctx.push, ctx.chan), 0);
+	CHECK_EQ(stats(ctx.push).coalesced_kicks, 1);
+	CHECK_EQ(nouveau_bo_map(bo, NOUVEAU_BO_RD | NOUVEAU_BO_NOBLOCK, ctx.client), -EAGAIN);
+	hostGpuPause(fence.id, false);
+	CHECK_EQ(nouveau_bo_wait(bo, NOUVEAU_BO_RD, ctx.client), 0);
+
+	nouveau_bo_ref(NULL, &bo);
+	test_fini(&ctx);
+}
+
+static int notified;
+
+static void
+notify_record(struct nouveau_pushbuf *push)
+{
+	notified++;
+	CHECK_EQ(nouveau_pushbuf_space(push, 8, 0, 0), 0);
+	*push->cur++ = 0;
+}
+
+/* A kick_notify recording commands doesn't submit from within the kick */
+static void
+test_notify_records(void)
+{
+	struct nouveau_pushbuf_autokick ak = { .max_dwords = 4 };
+	struct test_ctx ctx;
+	struct nouveau_bo *bo;
+	int i;
+
+	test_init(&ctx);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	CHECK_EQ(nouveau_pushbuf_set_autokick(ctx.push, &ak), 0);
+	ctx.push->kick_notify = notify_record;
+
+	notified = 0;
+	for (i = 0; i < 16; i++)
+		write_bo(&ctx, bo);
+	CHECK(stats(ctx.push).autokicks > 0);
+	CHECK_EQ(notified, stats(ctx.push).kicks);
+
+	ctx.push->kick_notify = NULL;
+	nouveau_bo_ref(NULL, &bo);
+	test_fini(&ctx);
+}
+
+/* The idle accounting polls the previous fence, only when asked for */
+static void
+test_idle_stats(void)
+{
+	struct nouveau_pushbuf_attr attr = { .flags = NOUVEAU_PUSHBUF_IDLE_STATS };
+	struct test_ctx ctx;
+	struct nouveau_bo *bo;
+	HostNvStats nv;
+
+	test_init(&ctx);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	hostResetStats();
+	write_bo(&ctx, bo);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	hostGpuIdle();
+	write_bo(&ctx, bo);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	hostGetStats(&nv);
+	CHECK_EQ(nv.fence_polls, 0);
+	CHECK_EQ(stats(ctx.push).idle_kicks, 0);
+	nouveau_bo_ref(NULL, &bo);
+	test_fini(&ctx);
+
+	test_init_attr(&ctx, true, &attr);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	write_bo(&ctx, bo);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	hostGpuIdle();
+	write_bo(&ctx, bo);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	CHECK(stats(ctx.push).idle_kicks >= 1);
+	nouveau_bo_ref(NULL, &bo);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_kick_submits);
+	RUN(test_notify_records);
+	RUN(test_idle_stats);
+	return 0;
+}
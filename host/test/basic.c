@@ -0,0 +1,222 @@
+/* Smoke tests of the host build: commands recorded through the library run
+ * on the simulated GPU and their results are seen through the bos.
+ */
+#include "test.h"
+
+static void
+test_timestamp(void)
+{
+	struct test_ctx ctx;
+	struct nouveau_bo *bo;
+	uint64_t before, after;
+	uint32_t *map;
+
+	test_init(&ctx);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	map = bo->map;
+	memset(map, 0xff, 16);
+
+	CHECK_EQ(nouveau_getparam(ctx.dev, NOUVEAU_GETPARAM_PTIMER_TIME, &before), 0);
+	CHECK_EQ(nouveau_pushbuf_timestamp(ctx.push, bo, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	CHECK_EQ(nouveau_bo_wait(bo, NOUVEAU_BO_RD, ctx.client), 0);
+	CHECK_EQ(nouveau_getparam(ctx.dev, NOUVEAU_GETPARAM_PTIMER_TIME, &after), 0);
+
+	CHECK_EQ(map[0], 0);
+	CHECK_EQ(map[1], 0);
+	CHECK(*(uint64_t *)&map[2] >= before && *(uint64_t *)&map[2] <= after);
+
+	// Unaligned or out of range reports are refused, even when the end wraps
+	CHECK_EQ(nouveau_pushbuf_timestamp(ctx.push, bo, 8), -EINVAL);
+	CHECK_EQ(nouveau_pushbuf_timestamp(ctx.push, bo, 0x1000), -EINVAL);
+	CHECK_EQ(nouveau_pushbuf_timestamp(ctx.push, bo, 0xfffffff0), -EINVAL);
+
+	nouveau_bo_ref(NULL, &bo);
+	test_fini(&ctx);
+}
+
+static void
+test_copy_by_hand(void)
+{
+	struct test_ctx ctx;
+	struct nouveau_bo *src, *dst;
+	struct nouveau_pushbuf_refn refs[2];
+	int i;
+
+	test_init(&ctx);
+	src = test_bo(&ctx, NOUVEAU_BO_GART, 0x4000);
+	dst = test_bo(&ctx, NOUVEAU_BO_GART, 0x4000);
+	for (i = 0; i < 0x1000; i++)
+		((uint32_t *)src->map)[i] = i * 7;
+
+	refs[0] = (struct nouveau_pushbuf_refn){ src, NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+	refs[1] = (struct nouveau_pushbuf_refn){ dst, NOUVEAU_BO_WR | NOUVEAU_BO_GART };
+	CHECK_EQ(nouveau_pushbuf_space(ctx.push, 16, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx.push, refs, 2), 0);
+	test_copy(ctx.push, dst->offset, src->offset, 0x4000);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+
+	CHECK_EQ(nouveau_bo_wait(dst, NOUVEAU_BO_RD, ctx.client), 0);
+	CHECK(!memcmp(src->map, dst->map, 0x4000));
+
+	nouveau_bo_ref(NULL, &src);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+static void
+test_fill_and_fence(void)
+{
+	struct test_ctx ctx;
+	struct nouveau_fence fence;
+	struct nouveau_bo *bo;
+	uint32_t *map;
+	int i;
+
+	test_init(&ctx);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x30000);
+	map = bo->map;
+
+	CHECK_EQ(nouveau_bo_fill(bo, 0x100, 0x20000, 0xcafe, &fence), 0);
+	CHECK_EQ(nouveau_fence_wait(&fence, -1), 0);
+	CHECK(nouveau_fence_signaled(&fence));
+
+	CHECK_EQ(map[0x100 / 4 - 1], 0);
+	for (i = 0x100 / 4; i < 0x20100 / 4; i++)
+		CHECK_EQ(map[i], 0xcafe);
+	CHECK_EQ(map[0x20100 / 4], 0);
+
+	nouveau_bo_ref(NULL, &bo);
+	test_fini(&ctx);
+}
+
+/* Copies are only ordered after submitted work, unsubmitted references
+ * are refused rather than overtaken.
+ */
+static void
+test_copy_unsubmitted(void)
+{
+	struct nouveau_pushbuf_refn ref;
+	struct test_ctx ctx;
+	struct nouveau_fence fence;
+	struct nouveau_bo *src, *dst;
+
+	test_init(&ctx);
+	src = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	dst = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+
+	ref = (struct nouveau_pushbuf_refn){ dst, NOUVEAU_BO_WR | NOUVEAU_BO_GART };
+	CHECK_EQ(nouveau_pushbuf_space(ctx.push, 8, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx.push, &ref, 1), 0);
+	*ctx.push->cur++ = 0;
+	CHECK_EQ(nouveau_bo_copy(dst, 0, src, 0, 0x1000, NULL), -EBUSY);
+	CHECK_EQ(nouveau_bo_copy(src, 0, dst, 0, 0x1000, NULL), -EBUSY);
+	CHECK_EQ(nouveau_bo_fill(dst, 0, 0x1000, 0, NULL), -EBUSY);
+	CHECK_EQ(nouveau_bo_fill(src, 0, 0x1000, 0, NULL), 0);
+
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	CHECK_EQ(nouveau_bo_copy(dst, 0, src, 0, 0x1000, &fence), 0);
+	CHECK_EQ(nouveau_fence_wait(&fence, -1), 0);
+
+	nouveau_bo_ref(NULL, &src);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+/* Ranges past the end of a bo are refused, even when the sum wraps */
+static void
+test_copy_ranges(void)
+{
+	struct test_ctx ctx;
+	struct nouveau_bo *src, *dst;
+	uint64_t huge = ~0ull - 0xfff;
+
+	test_init(&ctx);
+	src = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	dst = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+
+	CHECK_EQ(nouveau_bo_copy(dst, 0, src, 0, 0x1001, NULL), -EINVAL);
+	CHECK_EQ(nouveau_bo_copy(dst, 0x1001, src, 0, 0, NULL), -EINVAL);
+	CHECK_EQ(nouveau_bo_copy(dst, huge, src, 0, 0x1000, NULL), -EINVAL);
+	CHECK_EQ(nouveau_bo_copy(dst, 0, src, huge, 0x1000, NULL), -EINVAL);
+	CHECK_EQ(nouveau_bo_copy(dst, 0x800, src, 0, huge, NULL), -EINVAL);
+	CHECK_EQ(nouveau_bo_fill(dst, 0x1001, 0, 0, NULL), -EINVAL);
+	CHECK_EQ(nouveau_bo_fill(dst, huge, 0x1000, 0, NULL), -EINVAL);
+	CHECK_EQ(nouveau_bo_fill(dst, 0x800, huge, 0, NULL), -EINVAL);
+
+	nouveau_bo_ref(NULL, &src);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+/* Only submissions the limits forced are counted as such */
+static void
+test_limit_flushes(void)
+{
+	struct nouveau_pushbuf_attr attr = { .max_buffers = 4 };
+	struct nouveau_pushbuf_stats stats;
+	struct nouveau_pushbuf_refn ref, refs[4];
+	struct nouveau_bo *bos[6];
+	struct test_ctx ctx;
+	int i;
+
+	test_init_attr(&ctx, true, &attr);
+	for (i = 0; i < 6; i++) {
+		bos[i] = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+		ref = (struct nouveau_pushbuf_refn){ bos[i], NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+		CHECK_EQ(nouveau_pushbuf_space(ctx.push, 8, 0, 0), 0);
+		CHECK_EQ(nouveau_pushbuf_refn(ctx.push, &ref, 1), 0);
+		*ctx.push->cur++ = 0;
+	}
+	nouveau_pushbuf_get_stats(ctx.push, &stats);
+	CHECK_EQ(stats.kicks, 1);
+	CHECK_EQ(stats.limit_flushes, 1);
+
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	nouveau_pushbuf_get_stats(ctx.push, &stats);
+	CHECK_EQ(stats.limit_flushes, 1);
+
+	// More bos than fit at all flush once, then fail
+	for (i = 0; i < 4; i++)
+		refs[i] = (struct nouveau_pushbuf_refn){ bos[i], NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+	CHECK_EQ(nouveau_pushbuf_space(ctx.push, 8, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx.push, refs, 4), -ENOSPC);
+	nouveau_pushbuf_get_stats(ctx.push, &stats);
+	CHECK_EQ(stats.limit_flushes, 2);
+
+	for (i = 0; i < 6; i++)
+		nouveau_bo_ref(NULL, &bos[i]);
+	test_fini(&ctx);
+}
+
+static void
+test_gpu_latency(void)
+{
+	struct test_ctx ctx;
+	struct nouveau_fence fence;
+
+	test_init(&ctx);
+	hostGpuSetLatency(50000000);
+	CHECK_EQ(nouveau_pushbuf_space(ctx.push, 8, 0, 0), 0);
+	*ctx.push->cur++ = 0;
+	CHECK_EQ(nouveau_pushbuf_kick_fence(ctx.push, ctx.chan, &fence), 0);
+	CHECK(!nouveau_fence_signaled(&fence));
+	CHECK_EQ(nouveau_fence_wait(&fence, 1000000), -ETIMEDOUT);
+	CHECK_EQ(nouveau_fence_wait(&fence, -1), 0);
+	hostGpuSetLatency(10000);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_timestamp);
+	RUN(test_copy_by_hand);
+	RUN(test_fill_and_fence);
+	RUN(test_copy_unsubmitted);
+	RUN(test_copy_ranges);
+	RUN(test_limit_flushes);
+	RUN(test_gpu_latency);
+	return 0;
+}
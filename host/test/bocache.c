@@ -0,0 +1,126 @@
+/* Recycling of freed bos through the device's bo cache */
+#include <unistd.h>
+#include "test.h"
+
+#define SIZE 0x10000
+
+static struct nouveau_bo_cache_stats
+cache_stats(struct test_ctx *ctx)
+{
+	struct nouveau_bo_cache_stats stats;
+
+	nouveau_device_get_bo_cache_stats(ctx->dev, &stats);
+	return stats;
+}
+
+static struct nouveau_bo *
+new_bo(struct test_ctx *ctx, uint32_t flags, NvKind kind, uint64_t size)
+{
+	union nouveau_bo_config config = { .nvc0 = { .memtype = kind } };
+	struct nouveau_bo *bo = NULL;
+
+	CHECK_EQ(nouveau_bo_new(ctx->dev, flags | NOUVEAU_BO_NOZERO, 0, size,
+				&config, &bo), 0);
+	return bo;
+}
+
+/* Bos of the same size, kind and attributes are handed out again */
+static void
+test_cache_hit_miss(void)
+{
+	struct nouveau_bo_cache_stats stats;
+	struct nouveau_bo *bo;
+	struct test_ctx ctx;
+	uint32_t handle;
+
+	test_init(&ctx);
+	nouveau_device_set_bo_cache(ctx.dev, 0x1000000, 60000);
+	stats = cache_stats(&ctx);
+
+	bo = new_bo(&ctx, NOUVEAU_BO_GART, NvKind_Pitch, SIZE);
+	handle = bo->handle;
+	nouveau_bo_ref(NULL, &bo);
+	CHECK_EQ(cache_stats(&ctx).count, stats.count + 1);
+	CHECK_EQ(cache_stats(&ctx).bytes, stats.bytes + SIZE);
+
+	bo = new_bo(&ctx, NOUVEAU_BO_GART, NvKind_Pitch, SIZE);
+	CHECK_EQ(bo->handle, handle);
+	CHECK_EQ(cache_stats(&ctx).hits, stats.hits + 1);
+	CHECK_EQ(cache_stats(&ctx).count, stats.count);
+	nouveau_bo_ref(NULL, &bo);
+
+	// Another kind or other CPU cache attributes don't match
+	bo = new_bo(&ctx, NOUVEAU_BO_GART, NvKind_Generic_16BX2, SIZE);
+	CHECK(bo->handle != handle);
+	CHECK_EQ(cache_stats(&ctx).misses, stats.misses + 2);
+	nouveau_bo_ref(NULL, &bo);
+	bo = new_bo(&ctx, NOUVEAU_BO_GART | NOUVEAU_BO_CACHED, NvKind_Pitch, SIZE);
+	CHECK_EQ(cache_stats(&ctx).misses, stats.misses + 3);
+	CHECK_EQ(cache_stats(&ctx).hits, stats.hits + 1);
+	nouveau_bo_ref(NULL, &bo);
+
+	test_fini(&ctx);
+}
+
+/* The least recently freed bos go once the cache outgrows its limit */
+static void
+test_cache_evict(void)
+{
+	struct nouveau_bo_cache_stats stats;
+	struct nouveau_bo *bos[4];
+	struct test_ctx ctx;
+	int i;
+
+	test_init(&ctx);
+	nouveau_device_set_bo_cache(ctx.dev, 2 * SIZE, 60000);
+	stats = cache_stats(&ctx);
+
+	for (i = 0; i < 4; i++)
+		bos[i] = new_bo(&ctx, NOUVEAU_BO_GART, NvKind_Pitch, SIZE);
+	for (i = 0; i < 4; i++)
+		nouveau_bo_ref(NULL, &bos[i]);
+	CHECK_EQ(cache_stats(&ctx).bytes, 2 * SIZE);
+	CHECK_EQ(cache_stats(&ctx).count, 2);
+	CHECK_EQ(cache_stats(&ctx).evictions, stats.evictions + 2);
+
+	// Bos larger than the whole cache aren't kept at all
+	bos[0] = new_bo(&ctx, NOUVEAU_BO_GART, NvKind_Pitch, 4 * SIZE);
+	nouveau_bo_ref(NULL, &bos[0]);
+	CHECK_EQ(cache_stats(&ctx).count, 2);
+
+	nouveau_device_set_bo_cache(ctx.dev, 0, 0);
+	CHECK_EQ(cache_stats(&ctx).count, 0);
+	CHECK_EQ(cache_stats(&ctx).bytes, 0);
+	test_fini(&ctx);
+}
+
+/* Bos idle for longer than the age limit are trimmed */
+static void
+test_cache_trim(void)
+{
+	struct nouveau_bo *bo;
+	struct test_ctx ctx;
+
+	test_init(&ctx);
+	nouveau_device_set_bo_cache(ctx.dev, 0x1000000, 20);
+
+	bo = new_bo(&ctx, NOUVEAU_BO_GART, NvKind_Pitch, SIZE);
+	nouveau_bo_ref(NULL, &bo);
+	nouveau_device_trim_bo_cache(ctx.dev);
+	CHECK_EQ(cache_stats(&ctx).count, 1);
+
+	usleep(40000);
+	nouveau_device_trim_bo_cache(ctx.dev);
+	CHECK_EQ(cache_stats(&ctx).count, 0);
+	CHECK_EQ(cache_stats(&ctx).bytes, 0);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_cache_hit_miss);
+	RUN(test_cache_evict);
+	RUN(test_cache_trim);
+	return 0;
+}
@@ -0,0 +1,206 @@
+/* Reader and writer fences of bos, on simulated syncpoint timelines that
+ * the tests hold back by pausing channels.
+ */
+#include "test.h"
+
+#define NR_CHANS 5
+
+struct chans {
+	struct nouveau_object *chan[NR_CHANS];
+	struct nouveau_pushbuf *push[NR_CHANS];
+	uint32_t syncpt[NR_CHANS];
+};
+
+static void
+chans_init(struct test_ctx *ctx, struct chans *c)
+{
+	struct nouveau_fence fence;
+	int i;
+
+	for (i = 0; i < NR_CHANS; i++) {
+		CHECK_EQ(nouveau_object_new(&ctx->dev->object, 0,
+					    NOUVEAU_FIFO_CHANNEL_CLASS, NULL, 0,
+					    &c->chan[i]), 0);
+		CHECK_EQ(nouveau_pushbuf_new(ctx->client, c->chan[i], 1, 0x1000,
+					     true, &c->push[i]), 0);
+		CHECK_EQ(nouveau_pushbuf_space(c->push[i], 8, 0, 0), 0);
+		*c->push[i]->cur++ = 0;
+		CHECK_EQ(nouveau_pushbuf_kick_fence(c->push[i], c->chan[i], &fence), 0);
+		c->syncpt[i] = fence.id;
+	}
+}
+
+static void
+chans_fini(struct chans *c)
+{
+	int i;
+
+	for (i = 0; i < NR_CHANS; i++) {
+		hostGpuPause(c->syncpt[i], false);
+		nouveau_pushbuf_del(&c->push[i]);
+		nouveau_object_del(&c->chan[i]);
+	}
+}
+
+/* References bo on channel i with the given access */
+static void
+access(struct chans *c, int i, struct nouveau_bo *bo, uint32_t flags)
+{
+	struct nouveau_pushbuf_refn ref = { bo, flags | NOUVEAU_BO_GART };
+
+	CHECK_EQ(nouveau_pushbuf_space(c->push[i], 8, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(c->push[i], &ref, 1), 0);
+	*c->push[i]->cur++ = 0;
+}
+
+static void
+kick(struct chans *c, int i)
+{
+	CHECK_EQ(nouveau_pushbuf_kick(c->push[i], c->chan[i]), 0);
+}
+
+static int
+try_map(struct test_ctx *ctx, struct nouveau_bo *bo, uint32_t access)
+{
+	return nouveau_bo_map(bo, access | NOUVEAU_BO_NOBLOCK, ctx->client);
+}
+
+/* A CPU read only waits for writers, a CPU write for readers as well */
+static void
+test_read_after_read(void)
+{
+	struct test_ctx ctx;
+	struct chans c;
+	struct nouveau_bo *bo;
+
+	test_init(&ctx);
+	chans_init(&ctx, &c);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+
+	hostGpuPause(c.syncpt[0], true);
+	access(&c, 0, bo, NOUVEAU_BO_RD);
+	kick(&c, 0);
+	CHECK_EQ(try_map(&ctx, bo, NOUVEAU_BO_RD), 0);
+	CHECK_EQ(try_map(&ctx, bo, NOUVEAU_BO_WR), -EAGAIN);
+
+	hostGpuPause(c.syncpt[0], false);
+	CHECK_EQ(nouveau_bo_map(bo, NOUVEAU_BO_WR, ctx.client), 0);
+
+	nouveau_bo_ref(NULL, &bo);
+	chans_fini(&c);
+	test_fini(&ctx);
+}
+
+/* A later read on another channel doesn't hide an earlier writer */
+static void
+test_writer_kept_by_reads(void)
+{
+	struct test_ctx ctx;
+	struct chans c;
+	struct nouveau_bo *bo;
+
+	test_init(&ctx);
+	chans_init(&ctx, &c);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+
+	// The read is recorded before the write is submitted, so it doesn't
+	// wait for it on the GPU and completes first
+	access(&c, 1, bo, NOUVEAU_BO_RD);
+	hostGpuPause(c.syncpt[0], true);
+	access(&c, 0, bo, NOUVEAU_BO_WR);
+	kick(&c, 0);
+	kick(&c, 1);
+	hostGpuIdle();
+
+	CHECK_EQ(try_map(&ctx, bo, NOUVEAU_BO_RD), -EAGAIN);
+	hostGpuPause(c.syncpt[0], false);
+	CHECK_EQ(nouveau_bo_map(bo, NOUVEAU_BO_RD, ctx.client), 0);
+	CHECK_EQ(try_map(&ctx, bo, NOUVEAU_BO_WR), 0);
+
+	nouveau_bo_ref(NULL, &bo);
+	chans_fini(&c);
+	test_fini(&ctx);
+}
+
+/* Writers on different channels are all waited for */
+static void
+test_writers_per_syncpoint(void)
+{
+	struct test_ctx ctx;
+	struct chans c;
+	struct nouveau_bo *bo;
+
+	test_init(&ctx);
+	chans_init(&ctx, &c);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+
+	access(&c, 1, bo, NOUVEAU_BO_WR);
+	hostGpuPause(c.syncpt[0], true);
+	hostGpuPause(c.syncpt[1], true);
+	access(&c, 0, bo, NOUVEAU_BO_WR);
+	kick(&c, 0);
+	kick(&c, 1);
+
+	hostGpuPause(c.syncpt[1], false);
+	hostGpuIdle();
+	CHECK_EQ(try_map(&ctx, bo, NOUVEAU_BO_RD), -EAGAIN);
+	hostGpuPause(c.syncpt[0], false);
+	CHECK_EQ(nouveau_bo_map(bo, NOUVEAU_BO_RD, ctx.client), 0);
+
+	nouveau_bo_ref(NULL, &bo);
+	chans_fini(&c);
+	test_fini(&ctx);
+}
+
+/* With all reader slots pending, the oldest reader is retired to make
+ * room.  Waiting on any other one would never return, as those channels
+ * stay paused until the submission is done.
+ */
+static void
+test_reader_eviction(void)
+{
+	struct test_ctx ctx;
+	struct chans c;
+	struct nouveau_bo *bo;
+	struct nouveau_fence fence;
+	int i;
+
+	test_init(&ctx);
+	chans_init(&ctx, &c);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+
+	hostGpuSetLatency(20000000);
+	access(&c, 0, bo, NOUVEAU_BO_RD);
+	kick(&c, 0);
+	hostGpuSetLatency(10000);
+	for (i = 1; i < NR_CHANS; i++) {
+		hostGpuPause(c.syncpt[i], true);
+		access(&c, i, bo, NOUVEAU_BO_RD);
+		kick(&c, i);
+	}
+
+	// The first reader has been waited for, the others are still tracked
+	fence = (struct nouveau_fence){ c.syncpt[0], hostSyncptMax(c.syncpt[0]) };
+	CHECK(nouveau_fence_signaled(&fence));
+	CHECK_EQ(try_map(&ctx, bo, NOUVEAU_BO_RD), 0);
+	CHECK_EQ(try_map(&ctx, bo, NOUVEAU_BO_WR), -EAGAIN);
+	for (i = 1; i < NR_CHANS; i++) {
+		hostGpuPause(c.syncpt[i], false);
+		hostGpuIdle();
+		CHECK_EQ(try_map(&ctx, bo, NOUVEAU_BO_WR), i < NR_CHANS - 1 ? -EAGAIN : 0);
+	}
+
+	nouveau_bo_ref(NULL, &bo);
+	chans_fini(&c);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_read_after_read);
+	RUN(test_writer_kept_by_reads);
+	RUN(test_writers_per_syncpoint);
+	RUN(test_reader_eviction);
+	return 0;
+}
@@ -0,0 +1,92 @@
+/* CPU cache maintenance of bos created with NOUVEAU_BO_CACHED */
+#include "test.h"
+
+static void
+read_and_kick(struct test_ctx *ctx, struct nouveau_bo *bo)
+{
+	struct nouveau_pushbuf_refn ref = { bo, NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+
+	CHECK_EQ(nouveau_pushbuf_space(ctx->push, 8, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx->push, &ref, 1), 0);
+	*ctx->push->cur++ = 0;
+	CHECK_EQ(nouveau_pushbuf_kick(ctx->push, ctx->chan), 0);
+}
+
+/* Bytes cleaned from the CPU caches by a kick reading bo */
+static uint64_t
+kick_cleaned(struct test_ctx *ctx, struct nouveau_bo *bo)
+{
+	HostNvStats stats;
+
+	hostResetStats();
+	read_and_kick(ctx, bo);
+	hostGetStats(&stats);
+	return stats.dcache_bytes;
+}
+
+/* Writes through a mapping kept across kicks are cleaned at every kick */
+static void
+test_cached_kept_mapping(void)
+{
+	struct nouveau_bo *bo = NULL;
+	struct test_ctx ctx;
+	uint32_t *map;
+
+	test_init(&ctx);
+	CHECK_EQ(nouveau_bo_new(ctx.dev, NOUVEAU_BO_GART | NOUVEAU_BO_CACHED |
+				NOUVEAU_BO_NOZERO, 0, 0x10000, NULL, &bo), 0);
+	CHECK_EQ(nouveau_bo_map(bo, NOUVEAU_BO_WR, ctx.client), 0);
+	map = bo->map;
+
+	map[0] = 1;
+	CHECK(kick_cleaned(&ctx, bo) >= 0x10000);
+	map[1] = 2;
+	CHECK(kick_cleaned(&ctx, bo) >= 0x10000);
+
+	// The last writes are cleaned once more after unmapping
+	map[2] = 3;
+	nouveau_bo_unmap(bo);
+	CHECK(kick_cleaned(&ctx, bo) >= 0x10000);
+	CHECK_EQ(kick_cleaned(&ctx, bo), 0);
+
+	// Only the range mapped for writing is kept dirty
+	CHECK_EQ(nouveau_bo_map_range(bo, 0x1000, 0x2000, NOUVEAU_BO_WR, ctx.client), 0);
+	CHECK_EQ(kick_cleaned(&ctx, bo), 0x2000);
+	CHECK_EQ(kick_cleaned(&ctx, bo), 0x2000);
+	nouveau_bo_unmap(bo);
+	CHECK_EQ(kick_cleaned(&ctx, bo), 0x2000);
+	CHECK_EQ(kick_cleaned(&ctx, bo), 0);
+
+	nouveau_bo_ref(NULL, &bo);
+	test_fini(&ctx);
+}
+
+/* An explicit flush doesn't stop tracking a range still mapped for writing */
+static void
+test_cached_flush_range(void)
+{
+	struct nouveau_bo *bo = NULL;
+	struct test_ctx ctx;
+
+	test_init(&ctx);
+	CHECK_EQ(nouveau_bo_new(ctx.dev, NOUVEAU_BO_GART | NOUVEAU_BO_CACHED |
+				NOUVEAU_BO_NOZERO, 0, 0x10000, NULL, &bo), 0);
+	CHECK_EQ(nouveau_bo_map(bo, NOUVEAU_BO_WR, ctx.client), 0);
+	CHECK_EQ(nouveau_bo_flush_range(bo, 0, 0x10000), 0);
+	CHECK(kick_cleaned(&ctx, bo) >= 0x10000);
+
+	nouveau_bo_unmap(bo);
+	CHECK_EQ(nouveau_bo_flush_range(bo, 0, 0x10000), 0);
+	CHECK_EQ(kick_cleaned(&ctx, bo), 0);
+
+	nouveau_bo_ref(NULL, &bo);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_cached_kept_mapping);
+	RUN(test_cached_flush_range);
+	return 0;
+}
@@ -0,0 +1,117 @@
+/* Capturing submissions and replaying them */
+#include <sys/stat.h>
+#include <unistd.h>
+#include "test.h"
+
+static char path[64];
+
+static void
+copy_kick(struct test_ctx *ctx, struct nouveau_bo *dst, uint64_t dst_off,
+	  struct nouveau_bo *src, uint64_t src_off, uint32_t size)
+{
+	struct nouveau_pushbuf_refn refs[2] = {
+		{ src, NOUVEAU_BO_RD | NOUVEAU_BO_GART },
+		{ dst, NOUVEAU_BO_WR | NOUVEAU_BO_GART },
+	};
+
+	CHECK_EQ(nouveau_pushbuf_space(ctx->push, 16, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx->push, refs, 2), 0);
+	test_copy(ctx->push, dst->offset + dst_off, src->offset + src_off, size);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx->push, ctx->chan), 0);
+	CHECK_EQ(nouveau_bo_wait(dst, NOUVEAU_BO_RD, ctx->client), 0);
+}
+
+static uint64_t
+file_size(void)
+{
+	struct stat st;
+
+	CHECK_EQ(stat(path, &st), 0);
+	return st.st_size;
+}
+
+/* Memory written by the CPU between submissions is recorded again */
+static void
+test_capture_cpu_writes(void)
+{
+	struct test_ctx ctx;
+	struct nouveau_bo *src, *dst;
+	uint64_t size;
+
+	test_init(&ctx);
+	src = test_bo(&ctx, NOUVEAU_BO_GART, 0x10000);
+	dst = test_bo(&ctx, NOUVEAU_BO_GART, 0x10000);
+
+	CHECK_EQ(nouveau_device_capture_begin(ctx.dev, path, 0), 0);
+	copy_kick(&ctx, dst, 0, src, 0, 0x10000);
+	copy_kick(&ctx, dst, 0, src, 0, 0x10000);
+	nouveau_device_capture_end(ctx.dev);
+	size = file_size();
+
+	CHECK_EQ(nouveau_device_capture_begin(ctx.dev, path, 0), 0);
+	copy_kick(&ctx, dst, 0, src, 0, 0x10000);
+	CHECK_EQ(nouveau_bo_map(src, NOUVEAU_BO_WR, ctx.client), 0);
+	memset(src->map, 0x42, 0x10000);
+	copy_kick(&ctx, dst, 0, src, 0, 0x10000);
+	nouveau_device_capture_end(ctx.dev);
+	CHECK(file_size() >= size + 0x10000);
+
+	unlink(path);
+	nouveau_bo_ref(NULL, &src);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+/* Bos freed during the capture leave their addresses to later ones, and
+ * the device replaying it has memory of its own mapped in between.
+ */
+static void
+test_replay_recycled(void)
+{
+	struct nouveau_capture_stats stats;
+	struct test_ctx ctx;
+	struct nouveau_bo *gap, *a, *b;
+	uint64_t offset;
+
+	test_init(&ctx);
+	nouveau_device_set_bo_cache(ctx.dev, 0, 0);
+	gap = test_bo(&ctx, NOUVEAU_BO_GART | NOUVEAU_BO_NOZERO, 0x100000);
+	a = test_bo(&ctx, NOUVEAU_BO_GART, 0x200000);
+	offset = a->offset;
+
+	CHECK_EQ(nouveau_device_capture_begin(ctx.dev, path, 0), 0);
+	copy_kick(&ctx, a, 0x10000, a, 0, 0x10000);
+	nouveau_bo_ref(NULL, &a);
+	b = test_bo(&ctx, NOUVEAU_BO_GART, 0x100000);
+	CHECK_EQ(b->offset, offset);
+	copy_kick(&ctx, b, 0x10000, b, 0, 0x10000);
+	nouveau_device_capture_end(ctx.dev);
+
+	nouveau_pushbuf_del(&ctx.push);
+	nouveau_object_del(&ctx.chan);
+	nouveau_bo_ref(NULL, &b);
+
+	CHECK_EQ(nouveau_capture_replay(ctx.dev, path, 0, &stats), 0);
+	CHECK_EQ(stats.submits, 2);
+	CHECK_EQ(nouveau_capture_replay(ctx.dev, path, NOUVEAU_REPLAY_SYNC, &stats), 0);
+	CHECK_EQ(stats.submits, 2);
+
+	// Addresses taken by the device can't be replayed at
+	CHECK_EQ(nouveau_bo_new(ctx.dev, NOUVEAU_BO_GART, 0, 0x200000, NULL, &a), 0);
+	CHECK_EQ(a->offset, offset);
+	CHECK_EQ(nouveau_capture_replay(ctx.dev, path, 0, &stats), -EBUSY);
+	nouveau_bo_ref(NULL, &a);
+
+	unlink(path);
+	nouveau_bo_ref(NULL, &gap);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	snprintf(path, sizeof(path), "/tmp/nouveau-capture-%d", (int)getpid());
+	RUN(test_capture_cpu_writes);
+	RUN(test_replay_recycled);
+	return 0;
+}
@@ -0,0 +1,76 @@
+/* Scheduling parameters of the GPU channel behind a pushbuf */
+#include "test.h"
+
+static uint32_t
+syncpt(struct nouveau_pushbuf *push)
+{
+	struct nouveau_fence fence;
+
+	CHECK_EQ(nouveau_pushbuf_space(push, 8, 0, 0), 0);
+	*push->cur++ = 0;
+	CHECK_EQ(nouveau_pushbuf_kick_fence(push, push->channel, &fence), 0);
+	return fence.id;
+}
+
+static HostChannelInfo
+query(struct nouveau_pushbuf *push)
+{
+	HostChannelInfo info;
+
+	CHECK(hostChannelQuery(syncpt(push), &info));
+	return info;
+}
+
+static void
+test_channel_defaults(void)
+{
+	struct test_ctx ctx;
+
+	test_init(&ctx);
+	CHECK_EQ(query(ctx.push).priority, NOUVEAU_PUSHBUF_PRIORITY_MEDIUM);
+	CHECK_EQ(query(ctx.push).timeslice_us, 0);
+	test_fini(&ctx);
+}
+
+static void
+test_channel_attr(void)
+{
+	struct nouveau_pushbuf_attr attr = {
+		.priority = NOUVEAU_PUSHBUF_PRIORITY_HIGH,
+		.timeslice_us = 4000,
+	};
+	struct test_ctx ctx;
+
+	test_init_attr(&ctx, true, &attr);
+	CHECK_EQ(query(ctx.push).priority, NOUVEAU_PUSHBUF_PRIORITY_HIGH);
+	CHECK_EQ(query(ctx.push).timeslice_us, 4000);
+	test_fini(&ctx);
+}
+
+static void
+test_channel_set(void)
+{
+	struct test_ctx ctx;
+
+	test_init(&ctx);
+	CHECK_EQ(nouveau_pushbuf_set_priority(ctx.push, NOUVEAU_PUSHBUF_PRIORITY_LOW), 0);
+	CHECK_EQ(nouveau_pushbuf_set_timeslice(ctx.push, 2000), 0);
+	CHECK_EQ(query(ctx.push).priority, NOUVEAU_PUSHBUF_PRIORITY_LOW);
+	CHECK_EQ(query(ctx.push).timeslice_us, 2000);
+
+	// Values the channel rejects leave the previous ones in place
+	CHECK(nouveau_pushbuf_set_priority(ctx.push, 42) < 0);
+	CHECK(nouveau_pushbuf_set_timeslice(ctx.push, 100) < 0);
+	CHECK_EQ(query(ctx.push).priority, NOUVEAU_PUSHBUF_PRIORITY_LOW);
+	CHECK_EQ(query(ctx.push).timeslice_us, 2000);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_channel_defaults);
+	RUN(test_channel_attr);
+	RUN(test_channel_set);
+	return 0;
+}
@@ -0,0 +1,103 @@
+/* Clearing new bos with the copy engine */
+#include "test.h"
+#include "private.h"
+
+/* Returns a recycled bo whose memory held 0xff before */
+static struct nouveau_bo *
+dirty_bo(struct test_ctx *ctx, uint64_t size)
+{
+	struct nouveau_bo *bo = test_bo(ctx, NOUVEAU_BO_GART, size);
+	void *map = bo->map;
+
+	memset(map, 0xff, size);
+	nouveau_bo_ref(NULL, &bo);
+	CHECK_EQ(nouveau_bo_new(ctx->dev, NOUVEAU_BO_GART | NOUVEAU_BO_MAP, 0,
+				size, NULL, &bo), 0);
+	CHECK(nouveau_bo(bo)->map_addr == map);
+	return bo;
+}
+
+static bool
+all_zero(const void *map, uint64_t size)
+{
+	const uint8_t *p = map;
+	uint64_t i;
+
+	for (i = 0; i < size; i++)
+		if (p[i])
+			return false;
+	return true;
+}
+
+static void
+test_clear_before_map(void)
+{
+	struct test_ctx ctx;
+	struct nouveau_fence fence;
+	struct nouveau_bo *bo;
+
+	test_init(&ctx);
+	nouveau_device_set_gpu_clear(ctx.dev, 0x10000);
+	hostGpuSetLatency(20000000);
+
+	bo = dirty_bo(&ctx, 0x20000);
+	CHECK_EQ(nouveau_bo_get_fence(bo, &fence), 0);
+	CHECK((int)fence.id >= 0);
+	CHECK(!nouveau_fence_signaled(&fence));
+	CHECK_EQ(nouveau_bo_map(bo, NOUVEAU_BO_RD | NOUVEAU_BO_NOBLOCK, ctx.client), -EAGAIN);
+	CHECK_EQ(nouveau_bo_map(bo, NOUVEAU_BO_RD, ctx.client), 0);
+	CHECK(all_zero(bo->map, bo->size));
+	nouveau_bo_ref(NULL, &bo);
+
+	// Smaller bos are still cleared by the CPU
+	bo = dirty_bo(&ctx, 0x8000);
+	CHECK_EQ(nouveau_bo_get_fence(bo, &fence), 0);
+	CHECK((int)fence.id < 0);
+	CHECK(all_zero(nouveau_bo(bo)->map_addr, bo->size));
+	nouveau_bo_ref(NULL, &bo);
+
+	hostGpuSetLatency(10000);
+	test_fini(&ctx);
+}
+
+/* A channel reading the new bo waits for the clear on the GPU */
+static void
+test_clear_other_channel(void)
+{
+	struct nouveau_pushbuf_refn refs[2];
+	struct test_ctx ctx;
+	struct nouveau_fence fence;
+	struct nouveau_bo *bo, *dst;
+
+	test_init(&ctx);
+	dst = test_bo(&ctx, NOUVEAU_BO_GART, 0x20000);
+	memset(dst->map, 0x55, 0x20000);
+	nouveau_device_set_gpu_clear(ctx.dev, 0x10000);
+
+	bo = dirty_bo(&ctx, 0x20000);
+	CHECK_EQ(nouveau_bo_get_fence(bo, &fence), 0);
+	hostGpuPause(fence.id, true);
+
+	refs[0] = (struct nouveau_pushbuf_refn){ bo, NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+	refs[1] = (struct nouveau_pushbuf_refn){ dst, NOUVEAU_BO_WR | NOUVEAU_BO_GART };
+	CHECK_EQ(nouveau_pushbuf_space(ctx.push, 16, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx.push, refs, 2), 0);
+	test_copy(ctx.push, dst->offset, bo->offset, 0x20000);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+
+	hostGpuPause(fence.id, false);
+	CHECK_EQ(nouveau_bo_wait(dst, NOUVEAU_BO_RD, ctx.client), 0);
+	CHECK(all_zero(dst->map, 0x20000));
+
+	nouveau_bo_ref(NULL, &bo);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_clear_before_map);
+	RUN(test_clear_other_channel);
+	return 0;
+}
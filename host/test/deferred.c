@@ -0,0 +1,121 @@
+/* Deferred pushbufs: recordings that outgrow their command bos and push
+ * limits, replayed and recorded again.
+ */
+#include "test.h"
+
+#define NR_COPIES 512
+#define COPY_SIZE 16
+
+static void
+record(struct nouveau_pushbuf *rec, struct nouveau_bo *dst, struct nouveau_bo *src)
+{
+	struct nouveau_pushbuf_refn refs[2] = {
+		{ src, NOUVEAU_BO_RD | NOUVEAU_BO_GART },
+		{ dst, NOUVEAU_BO_WR | NOUVEAU_BO_GART },
+	};
+	int i;
+
+	for (i = 0; i < NR_COPIES; i++) {
+		CHECK_EQ(nouveau_pushbuf_space(rec, 16, 0, 0), 0);
+		CHECK_EQ(nouveau_pushbuf_refn(rec, refs, 2), 0);
+		test_copy(rec, dst->offset + i * COPY_SIZE, src->offset + i * COPY_SIZE,
+			  COPY_SIZE);
+	}
+}
+
+static void
+replay(struct test_ctx *ctx, struct nouveau_pushbuf *rec, struct nouveau_bo *dst,
+       struct nouveau_bo *src)
+{
+	struct nouveau_fence fence;
+
+	memset(dst->map, 0, NR_COPIES * COPY_SIZE);
+	CHECK_EQ(nouveau_pushbuf_kick_fence(rec, ctx->chan, &fence), 0);
+	CHECK_EQ(nouveau_fence_wait(&fence, -1), 0);
+	CHECK(!memcmp(dst->map, src->map, NR_COPIES * COPY_SIZE));
+}
+
+static void
+test_deferred_reuse(void)
+{
+	struct nouveau_pushbuf_attr attr = { .max_pushes = 4 };
+	struct nouveau_pushbuf_stats stats;
+	struct nouveau_pushbuf *rec;
+	struct nouveau_bo *src, *dst;
+	struct test_ctx ctx;
+	uint64_t allocs;
+	int i;
+
+	test_init(&ctx);
+	src = test_bo(&ctx, NOUVEAU_BO_GART, NR_COPIES * COPY_SIZE);
+	dst = test_bo(&ctx, NOUVEAU_BO_GART, NR_COPIES * COPY_SIZE);
+	for (i = 0; i < NR_COPIES * COPY_SIZE / 4; i++)
+		((uint32_t *)src->map)[i] = i * 3;
+	CHECK_EQ(nouveau_pushbuf_new_attr(ctx.client, ctx.chan, 1, 0x1000, false,
+					  &attr, &rec), 0);
+
+	// Spills over into several overflow bos and krecs
+	record(rec, dst, src);
+	replay(&ctx, rec, dst, src);
+	replay(&ctx, rec, dst, src);
+	nouveau_pushbuf_get_stats(rec, &stats);
+	CHECK(stats.cmd_bo_allocs >= 4);
+	CHECK_EQ(stats.cmd_bo_reuses, 0);
+	allocs = stats.cmd_bo_allocs;
+
+	// The replays are done, so recording again reuses all of them
+	CHECK_EQ(nouveau_pushbuf_reset(rec), 0);
+	CHECK(!nouveau_pushbuf_refd(rec, dst));
+	record(rec, dst, src);
+	replay(&ctx, rec, dst, src);
+	nouveau_pushbuf_get_stats(rec, &stats);
+	CHECK_EQ(stats.cmd_bo_allocs, allocs);
+	CHECK_EQ(stats.cmd_bo_reuses, allocs);
+	CHECK_EQ(stats.cmd_bo_free_hwm, allocs);
+
+	CHECK_EQ(nouveau_pushbuf_reset(ctx.push), -EINVAL);
+	nouveau_pushbuf_del(&rec);
+	nouveau_bo_ref(NULL, &src);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+/* Bundles take the commands of all the krecs of a recording */
+static void
+test_deferred_bundle(void)
+{
+	struct nouveau_pushbuf_attr attr = { .max_pushes = 4 };
+	struct nouveau_pushbuf *rec;
+	struct nouveau_bundle *bundle = NULL;
+	struct nouveau_bo *src, *dst;
+	struct test_ctx ctx;
+
+	test_init(&ctx);
+	src = test_bo(&ctx, NOUVEAU_BO_GART, NR_COPIES * COPY_SIZE);
+	dst = test_bo(&ctx, NOUVEAU_BO_GART, NR_COPIES * COPY_SIZE);
+	memset(src->map, 0x5a, NR_COPIES * COPY_SIZE);
+	CHECK_EQ(nouveau_pushbuf_new_attr(ctx.client, ctx.chan, 1, 0x1000, false,
+					  &attr, &rec), 0);
+
+	record(rec, dst, src);
+	CHECK_EQ(nouveau_bundle_new(rec, &bundle), 0);
+	nouveau_pushbuf_del(&rec);
+
+	CHECK_EQ(nouveau_pushbuf_bundle(ctx.push, bundle), 0);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	CHECK_EQ(nouveau_bo_wait(dst, NOUVEAU_BO_RD, ctx.client), 0);
+	CHECK(!memcmp(dst->map, src->map, NR_COPIES * COPY_SIZE));
+
+	nouveau_bundle_ref(NULL, &bundle);
+	nouveau_bo_ref(NULL, &src);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_deferred_reuse);
+	RUN(test_deferred_bundle);
+	return 0;
+}
@@ -0,0 +1,128 @@
+/* Fence waits, on one or several syncpoints */
+#include "test.h"
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct nouveau_fence
+kick(struct nouveau_pushbuf *push)
+{
+	struct nouveau_fence fence;
+
+	CHECK_EQ(nouveau_pushbuf_space(push, 8, 0, 0), 0);
+	*push->cur++ = 0;
+	CHECK_EQ(nouveau_pushbuf_kick_fence(push, push->channel, &fence), 0);
+	return fence;
+}
+
+static void
+test_wait_many_empty(void)
+{
+	struct nouveau_fence none = { NOUVEAU_FENCE_NONE, 0 };
+	int index = -1;
+
+	CHECK_EQ(nouveau_fence_wait_many(&none, 0, true, 0, NULL), -EINVAL);
+	CHECK_EQ(nouveau_fence_wait_many(&none, 0, false, 0, &index), -EINVAL);
+	CHECK_EQ(nouveau_fence_wait_many(NULL, 1, false, 0, &index), -EINVAL);
+
+	CHECK_EQ(nouveau_fence_wait_many(&none, 1, true, 0, NULL), 0);
+	CHECK_EQ(nouveau_fence_wait_many(&none, 1, false, 0, &index), 0);
+	CHECK_EQ(index, 0);
+}
+
+/* Failures other than timeouts are passed on */
+static void
+test_wait_error(void)
+{
+	struct nouveau_fence bad = { 0x7fffffff, 1 };
+	int ret;
+
+	ret = nouveau_fence_wait(&bad, 1000000);
+	CHECK(ret < 0 && ret != -ETIMEDOUT);
+	ret = nouveau_fence_wait_many(&bad, 1, false, 1000000, NULL);
+	CHECK(ret < 0 && ret != -ETIMEDOUT);
+}
+
+static void
+test_wait_many_same_syncpoint(void)
+{
+	struct nouveau_fence fences[3];
+	struct test_ctx ctx;
+	int index = -1;
+
+	test_init(&ctx);
+	fences[0] = kick(ctx.push);
+	CHECK_EQ(nouveau_fence_wait(&fences[0], -1), 0);
+
+	hostGpuPause(fences[0].id, true);
+	fences[2] = kick(ctx.push);
+	fences[1] = kick(ctx.push);
+	fences[0] = fences[1];
+	fences[0].value -= 2;
+
+	CHECK_EQ(nouveau_fence_wait_many(fences, 3, false, 0, &index), 0);
+	CHECK_EQ(index, 0);
+	CHECK_EQ(nouveau_fence_wait_many(&fences[1], 2, false, 0, &index), -ETIMEDOUT);
+	CHECK_EQ(nouveau_fence_wait_many(&fences[1], 2, false, 1000000, &index), -ETIMEDOUT);
+	CHECK_EQ(nouveau_fence_wait_many(fences, 3, true, 1000000, NULL), -ETIMEDOUT);
+
+	hostGpuPause(fences[0].id, false);
+	CHECK_EQ(nouveau_fence_wait_many(&fences[1], 2, false, -1, &index), 0);
+	CHECK_EQ(index, 1);
+	CHECK_EQ(nouveau_fence_wait_many(fences, 3, true, -1, NULL), 0);
+	test_fini(&ctx);
+}
+
+/* A signal on any of several syncpoints is seen within a wait slice */
+static void
+test_wait_many_any_latency(void)
+{
+	struct nouveau_object *chan2;
+	struct nouveau_pushbuf *push2;
+	struct nouveau_fence fences[2];
+	struct test_ctx ctx;
+	uint64_t late = 0, start;
+	int i, index;
+
+	test_init(&ctx);
+	CHECK_EQ(nouveau_object_new(&ctx.dev->object, 0, NOUVEAU_FIFO_CHANNEL_CLASS,
+				    NULL, 0, &chan2), 0);
+	CHECK_EQ(nouveau_pushbuf_new(ctx.client, chan2, 1, 0x1000, true, &push2), 0);
+
+	fences[0] = kick(ctx.push);
+	hostGpuPause(fences[0].id, true);
+	fences[0] = kick(ctx.push);
+
+	hostGpuSetLatency(3000000);
+	for (i = 0; i < 10; i++) {
+		start = now_ns();
+		fences[1] = kick(push2);
+		index = -1;
+		CHECK_EQ(nouveau_fence_wait_many(fences, 2, false, -1, &index), 0);
+		CHECK_EQ(index, 1);
+		late += now_ns() - start - 3000000;
+	}
+	hostGpuSetLatency(10000);
+	CHECK(late / 10 < 250000);
+
+	hostGpuPause(fences[0].id, false);
+	nouveau_pushbuf_del(&push2);
+	nouveau_object_del(&chan2);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_wait_many_empty);
+	RUN(test_wait_error);
+	RUN(test_wait_many_same_syncpoint);
+	RUN(test_wait_many_any_latency);
+	return 0;
+}
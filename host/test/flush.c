@@ -0,0 +1,82 @@
+/* GPU cache invalidation in front of submissions */
+#include "test.h"
+
+static void
+read_and_kick(struct test_ctx *ctx, struct nouveau_bo *bo)
+{
+	struct nouveau_pushbuf_refn ref = { bo, NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+
+	CHECK_EQ(nouveau_pushbuf_space(ctx->push, 8, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx->push, &ref, 1), 0);
+	*ctx->push->cur++ = 0;
+	CHECK_EQ(nouveau_pushbuf_kick(ctx->push, ctx->chan), 0);
+}
+
+static struct nouveau_pushbuf_stats
+stats(struct test_ctx *ctx)
+{
+	struct nouveau_pushbuf_stats stats;
+
+	nouveau_pushbuf_get_stats(ctx->push, &stats);
+	return stats;
+}
+
+/* Writes through a mapping kept across submissions are invisible to the
+ * library, so by default every submission invalidates the caches.
+ */
+static void
+test_flush_default(void)
+{
+	struct test_ctx ctx;
+	struct nouveau_bo *bo;
+	int i;
+
+	test_init(&ctx);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	for (i = 0; i < 4; i++) {
+		((uint32_t *)bo->map)[0] = i;
+		read_and_kick(&ctx, bo);
+	}
+	CHECK_EQ(stats(&ctx).flushes_elided, 0);
+	CHECK(stats(&ctx).flushes >= 4);
+
+	nouveau_bo_ref(NULL, &bo);
+	test_fini(&ctx);
+}
+
+static void
+test_flush_elide(void)
+{
+	struct nouveau_pushbuf_attr attr = { .flags = NOUVEAU_PUSHBUF_ELIDE_FLUSH };
+	struct test_ctx ctx;
+	struct nouveau_bo *bo;
+	uint64_t flushes;
+
+	test_init_attr(&ctx, true, &attr);
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	read_and_kick(&ctx, bo);
+	flushes = stats(&ctx).flushes;
+
+	read_and_kick(&ctx, bo);
+	CHECK_EQ(stats(&ctx).flushes, flushes);
+	CHECK_EQ(stats(&ctx).flushes_elided, 1);
+
+	nouveau_pushbuf_invalidate(ctx.push);
+	read_and_kick(&ctx, bo);
+	CHECK_EQ(stats(&ctx).flushes, flushes + 1);
+
+	CHECK_EQ(nouveau_bo_map(bo, NOUVEAU_BO_WR, ctx.client), 0);
+	read_and_kick(&ctx, bo);
+	CHECK_EQ(stats(&ctx).flushes, flushes + 2);
+
+	nouveau_bo_ref(NULL, &bo);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_flush_default);
+	RUN(test_flush_elide);
+	return 0;
+}
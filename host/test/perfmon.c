@@ -0,0 +1,274 @@
+/* Perfmon and perfdom objects over a backend reporting canned counters */
+#include "test.h"
+#include "nvif/class.h"
+#include "nvif/if0002.h"
+#include "nvif/if0003.h"
+
+static const char *const gr_signals[] = { "gr_busy", "gr_idle", "gr_launches" };
+static const char *const ce_signals[] = { "ce_bytes" };
+
+static const struct nouveau_perfmon_domain canned_domains[] = {
+	{ "gr", 2, 3, gr_signals },
+	{ "ce", 1, 1, ce_signals },
+};
+
+struct canned {
+	uint64_t value[2][3];
+	int reads;
+};
+
+static int
+canned_read(void *priv, uint8_t domain, uint16_t signal, uint64_t *value)
+{
+	struct canned *c = priv;
+
+	c->reads++;
+	*value = c->value[domain][signal];
+	return 0;
+}
+
+static const struct nouveau_perfmon_backend canned_backend = {
+	.nr_domains = 2,
+	.domains = canned_domains,
+	.read = canned_read,
+};
+
+static struct nouveau_object *
+perfmon_new(struct test_ctx *ctx)
+{
+	struct nouveau_object *perfmon = NULL;
+
+	CHECK_EQ(nouveau_object_new(&ctx->dev->object, 0, NVIF_CLASS_PERFMON,
+				    NULL, 0, &perfmon), 0);
+	return perfmon;
+}
+
+static struct nouveau_object *
+perfdom_new(struct nouveau_object *perfmon, uint8_t domain, uint8_t mode,
+	    uint8_t sig0, uint8_t sig1)
+{
+	struct nvif_perfdom_v0 args = { .domain = domain, .mode = mode };
+	struct nouveau_object *dom = NULL;
+
+	args.ctr[0].signal[0] = sig0;
+	args.ctr[1].signal[0] = sig1;
+	CHECK_EQ(nouveau_object_new(perfmon, 0, NVIF_CLASS_PERFDOM, &args,
+				    sizeof(args), &dom), 0);
+	return dom;
+}
+
+static struct nvif_perfdom_read_v0
+perfdom_read(struct nouveau_object *dom)
+{
+	struct nvif_perfdom_read_v0 args = { .version = 0 };
+
+	CHECK_EQ(nouveau_object_mthd(dom, NVIF_PERFDOM_V0_READ, &args, sizeof(args)), 0);
+	return args;
+}
+
+/* The queries walk the backend's domains and signals */
+static void
+test_perfmon_query(void)
+{
+	struct nvif_perfmon_query_domain_v0 qd = { .version = 0 };
+	struct nvif_perfmon_query_signal_v0 qs = { .version = 0 };
+	struct nvif_perfmon_query_source_v0 qsrc = { .version = 0 };
+	struct nouveau_object *perfmon;
+	struct canned canned = {};
+	struct test_ctx ctx;
+	int nr = 0;
+
+	test_init(&ctx);
+	nouveau_device_set_perfmon_backend(ctx.dev, &canned_backend, &canned);
+	perfmon = perfmon_new(&ctx);
+
+	do {
+		CHECK_EQ(nouveau_object_mthd(perfmon, NVIF_PERFMON_V0_QUERY_DOMAIN,
+					     &qd, sizeof(qd)), 0);
+		if (nr) {
+			CHECK_EQ(qd.id, nr - 1);
+			CHECK(!strcmp(qd.name, canned_domains[nr - 1].name));
+			CHECK_EQ(qd.counter_nr, canned_domains[nr - 1].counter_nr);
+			CHECK_EQ(qd.signal_nr, canned_domains[nr - 1].signal_nr);
+		}
+		nr++;
+	} while (qd.iter != 0xff);
+	CHECK_EQ(nr, 3);
+
+	nr = 0;
+	qs.domain = 0;
+	do {
+		CHECK_EQ(nouveau_object_mthd(perfmon, NVIF_PERFMON_V0_QUERY_SIGNAL,
+					     &qs, sizeof(qs)), 0);
+		if (nr) {
+			CHECK_EQ(qs.signal, nr - 1);
+			CHECK(!strcmp(qs.name, gr_signals[nr - 1]));
+		}
+		nr++;
+	} while (qs.iter != 0xffff);
+	CHECK_EQ(nr, 4);
+
+	qsrc.domain = 1;
+	CHECK_EQ(nouveau_object_mthd(perfmon, NVIF_PERFMON_V0_QUERY_SOURCE,
+				     &qsrc, sizeof(qsrc)), 0);
+	CHECK_EQ(qsrc.iter, 0xff);
+	qs.domain = 2;
+	qs.iter = 0;
+	CHECK_EQ(nouveau_object_mthd(perfmon, NVIF_PERFMON_V0_QUERY_SIGNAL,
+				     &qs, sizeof(qs)), -EINVAL);
+
+	nouveau_object_del(&perfmon);
+	nouveau_device_set_perfmon_backend(ctx.dev, NULL, NULL);
+	test_fini(&ctx);
+}
+
+/* Reads return the counts between the last two samples */
+static void
+test_perfdom_sample(void)
+{
+	struct nvif_perfdom_v0 bad = { .domain = 1 };
+	struct nouveau_object *perfmon, *dom, *obj = NULL;
+	struct canned canned = { .value = { { 100, 5, 7 } } };
+	struct test_ctx ctx;
+
+	test_init(&ctx);
+	nouveau_device_set_perfmon_backend(ctx.dev, &canned_backend, &canned);
+	perfmon = perfmon_new(&ctx);
+	dom = perfdom_new(perfmon, 0, 0, 0, 2);
+
+	canned.value[0][0] += 40;
+	canned.value[0][2] += 3;
+	CHECK_EQ(nouveau_object_mthd(dom, NVIF_PERFDOM_V0_SAMPLE, NULL, 0), 0);
+	CHECK_EQ(perfdom_read(dom).ctr[0], 40);
+	CHECK_EQ(perfdom_read(dom).ctr[1], 3);
+
+	canned.value[0][0] += 2;
+	CHECK_EQ(perfdom_read(dom).ctr[0], 40);
+	CHECK_EQ(nouveau_object_mthd(dom, NVIF_PERFDOM_V0_SAMPLE, NULL, 0), 0);
+	CHECK_EQ(perfdom_read(dom).ctr[0], 2);
+	CHECK_EQ(perfdom_read(dom).ctr[1], 0);
+
+	CHECK_EQ(nouveau_object_mthd(dom, NVIF_PERFDOM_V0_INIT, NULL, 0), 0);
+	CHECK_EQ(perfdom_read(dom).ctr[0], 0);
+
+	// Signals the domain doesn't have are refused
+	bad.ctr[0].signal[0] = 1;
+	CHECK_EQ(nouveau_object_new(perfmon, 0, NVIF_CLASS_PERFDOM, &bad,
+				    sizeof(bad), &obj), -EINVAL);
+
+	nouveau_object_del(&dom);
+	nouveau_object_del(&perfmon);
+	nouveau_device_set_perfmon_backend(ctx.dev, NULL, NULL);
+	test_fini(&ctx);
+}
+
+/* Kick sampled domains are sampled after every submission */
+static void
+test_perfdom_kick(void)
+{
+	struct nouveau_object *perfmon, *dom;
+	struct canned canned = {};
+	struct test_ctx ctx;
+	int i;
+
+	test_init(&ctx);
+	nouveau_device_set_perfmon_backend(ctx.dev, &canned_backend, &canned);
+	perfmon = perfmon_new(&ctx);
+	dom = perfdom_new(perfmon, 1, NOUVEAU_PERFDOM_MODE_KICK, 0, 0);
+
+	for (i = 1; i <= 3; i++) {
+		canned.value[1][0] += i * 0x100;
+		CHECK_EQ(nouveau_pushbuf_space(ctx.push, 8, 0, 0), 0);
+		*ctx.push->cur++ = 0;
+		CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+		CHECK_EQ(perfdom_read(dom).ctr[0], i * 0x100);
+	}
+
+	// Deleted domains are no longer sampled
+	nouveau_object_del(&dom);
+	canned.reads = 0;
+	CHECK_EQ(nouveau_pushbuf_space(ctx.push, 8, 0, 0), 0);
+	*ctx.push->cur++ = 0;
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	CHECK_EQ(canned.reads, 0);
+
+	nouveau_object_del(&perfmon);
+	nouveau_device_set_perfmon_backend(ctx.dev, NULL, NULL);
+	test_fini(&ctx);
+}
+
+/* Perfdoms keep working when their perfmon is deleted first */
+static void
+test_perfmon_del_first(void)
+{
+	struct nouveau_object *perfmon, *dom, *kick;
+	struct canned canned = {};
+	struct test_ctx ctx;
+
+	test_init(&ctx);
+	nouveau_device_set_perfmon_backend(ctx.dev, &canned_backend, &canned);
+	perfmon = perfmon_new(&ctx);
+	dom = perfdom_new(perfmon, 0, 0, 1, 2);
+	kick = perfdom_new(perfmon, 1, NOUVEAU_PERFDOM_MODE_KICK, 0, 0);
+	nouveau_object_del(&perfmon);
+	CHECK(!perfmon);
+
+	canned.value[0][1] += 5;
+	canned.value[1][0] += 6;
+	CHECK_EQ(nouveau_object_mthd(dom, NVIF_PERFDOM_V0_SAMPLE, NULL, 0), 0);
+	CHECK_EQ(perfdom_read(dom).ctr[0], 5);
+	CHECK_EQ(nouveau_pushbuf_space(ctx.push, 8, 0, 0), 0);
+	*ctx.push->cur++ = 0;
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	CHECK_EQ(perfdom_read(kick).ctr[0], 6);
+
+	nouveau_object_del(&dom);
+	nouveau_object_del(&kick);
+	nouveau_device_set_perfmon_backend(ctx.dev, NULL, NULL);
+	test_fini(&ctx);
+}
+
+/* Objects keep their backend, new ones get the default one back */
+static void
+test_perfmon_backend(void)
+{
+	struct nouveau_object *canned_mon, *sw_mon, *canned_dom, *sw_dom;
+	struct canned canned = { .value = { { 1 } } };
+	struct nouveau_bo *bo = NULL;
+	struct test_ctx ctx;
+
+	test_init(&ctx);
+	nouveau_device_set_perfmon_backend(ctx.dev, &canned_backend, &canned);
+	canned_mon = perfmon_new(&ctx);
+	nouveau_device_set_perfmon_backend(ctx.dev, NULL, NULL);
+	sw_mon = perfmon_new(&ctx);
+
+	canned_dom = perfdom_new(canned_mon, 0, 0, 0, 0);
+	// The default backend's first signal counts bo allocations
+	sw_dom = perfdom_new(sw_mon, 0, 0, 0, 0);
+
+	canned.value[0][0] += 9;
+	CHECK_EQ(nouveau_bo_new(ctx.dev, NOUVEAU_BO_GART, 0, 0x1000, NULL, &bo), 0);
+	CHECK_EQ(nouveau_object_mthd(canned_dom, NVIF_PERFDOM_V0_SAMPLE, NULL, 0), 0);
+	CHECK_EQ(nouveau_object_mthd(sw_dom, NVIF_PERFDOM_V0_SAMPLE, NULL, 0), 0);
+	CHECK_EQ(perfdom_read(canned_dom).ctr[0], 9);
+	CHECK_EQ(perfdom_read(sw_dom).ctr[0], 1);
+
+	nouveau_bo_ref(NULL, &bo);
+	nouveau_object_del(&canned_dom);
+	nouveau_object_del(&sw_dom);
+	nouveau_object_del(&canned_mon);
+	nouveau_object_del(&sw_mon);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_perfmon_query);
+	RUN(test_perfdom_sample);
+	RUN(test_perfdom_kick);
+	RUN(test_perfmon_del_first);
+	RUN(test_perfmon_backend);
+	return 0;
+}
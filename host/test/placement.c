@@ -0,0 +1,90 @@
+/* Memory attributes chosen by the placement flags of new bos */
+#include "test.h"
+#include "private.h"
+
+static HostMapInfo
+map_info(struct nouveau_bo *bo)
+{
+	HostMapInfo info;
+
+	CHECK(hostAddressSpaceQuery(&nouveau_device(bo->device)->addr_space,
+				    bo->offset, &info));
+	return info;
+}
+
+static struct nouveau_bo *
+new_bo(struct test_ctx *ctx, uint32_t flags, uint64_t size)
+{
+	struct nouveau_bo *bo = NULL;
+
+	CHECK_EQ(nouveau_bo_new(ctx->dev, flags, 0, size, NULL, &bo), 0);
+	return bo;
+}
+
+static void
+test_placement_attrs(void)
+{
+	uint32_t big = 0x20000;
+	struct nouveau_bo *bo;
+	struct test_ctx ctx;
+
+	test_init(&ctx);
+
+	bo = new_bo(&ctx, NOUVEAU_BO_VRAM, 2 * big);
+	CHECK_EQ(map_info(bo).page_size, big);
+	CHECK(!map_info(bo).cpu_cacheable);
+	nouveau_bo_ref(NULL, &bo);
+
+	// Smaller than a big page, or mapped by the CPU
+	bo = new_bo(&ctx, NOUVEAU_BO_VRAM, big / 2);
+	CHECK_EQ(map_info(bo).page_size, 0x1000);
+	nouveau_bo_ref(NULL, &bo);
+	bo = new_bo(&ctx, NOUVEAU_BO_GART, 2 * big);
+	CHECK_EQ(map_info(bo).page_size, 0x1000);
+	CHECK(!map_info(bo).cpu_cacheable);
+	nouveau_bo_ref(NULL, &bo);
+
+	bo = new_bo(&ctx, NOUVEAU_BO_GART | NOUVEAU_BO_CACHED, 2 * big);
+	CHECK(map_info(bo).cpu_cacheable);
+	nouveau_bo_ref(NULL, &bo);
+	bo = new_bo(&ctx, NOUVEAU_BO_GART | NOUVEAU_BO_CACHED | NOUVEAU_BO_NOSNOOP, 2 * big);
+	CHECK(!map_info(bo).cpu_cacheable);
+	nouveau_bo_ref(NULL, &bo);
+	bo = new_bo(&ctx, NOUVEAU_BO_VRAM | NOUVEAU_BO_CACHED, 2 * big);
+	CHECK(!map_info(bo).cpu_cacheable);
+	nouveau_bo_ref(NULL, &bo);
+
+	bo = new_bo(&ctx, NOUVEAU_BO_GART | NOUVEAU_BO_COHERENT, 2 * big);
+	CHECK(!map_info(bo).gpu_cacheable);
+	nouveau_bo_ref(NULL, &bo);
+
+	test_fini(&ctx);
+}
+
+/* Cached bos mapped with small pages aren't recycled as GPU-only ones */
+static void
+test_placement_recycle(void)
+{
+	uint32_t big = 0x20000;
+	struct nouveau_bo *bo;
+	struct test_ctx ctx;
+	int i;
+
+	test_init(&ctx);
+	for (i = 0; i < 8; i++) {
+		bo = new_bo(&ctx, NOUVEAU_BO_GART | NOUVEAU_BO_NOZERO, 2 * big);
+		nouveau_bo_ref(NULL, &bo);
+		bo = new_bo(&ctx, NOUVEAU_BO_VRAM | NOUVEAU_BO_NOZERO, 2 * big);
+		CHECK_EQ(map_info(bo).page_size, big);
+		nouveau_bo_ref(NULL, &bo);
+	}
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_placement_attrs);
+	RUN(test_placement_recycle);
+	return 0;
+}
@@ -0,0 +1,117 @@
+/* Ring mode pushbufs recording through a single, wrapping command bo */
+#include "test.h"
+
+#define COPIES 4096
+#define COPY 0x40
+#define BATCH 16
+
+static struct nouveau_pushbuf_attr ring_attr = { .flags = NOUVEAU_PUSHBUF_RING };
+
+/* Records COPIES small copies from src to dst, kicked BATCH at a time */
+static void
+ring_copies(struct test_ctx *ctx, struct nouveau_bo *dst, struct nouveau_bo *src,
+	    bool wait)
+{
+	struct nouveau_pushbuf_refn refs[2] = {
+		{ src, NOUVEAU_BO_RD | NOUVEAU_BO_GART },
+		{ dst, NOUVEAU_BO_WR | NOUVEAU_BO_GART },
+	};
+	int i;
+
+	for (i = 0; i < COPIES; i++) {
+		CHECK_EQ(nouveau_pushbuf_space(ctx->push, 16, 0, 0), 0);
+		if (i % BATCH == 0)
+			CHECK_EQ(nouveau_pushbuf_refn(ctx->push, refs, 2), 0);
+		test_copy(ctx->push, dst->offset + i * COPY, src->offset + i * COPY, COPY);
+		if (i % BATCH == BATCH - 1) {
+			CHECK_EQ(nouveau_pushbuf_kick(ctx->push, ctx->chan), 0);
+			if (wait)
+				CHECK_EQ(nouveau_bo_wait(dst, NOUVEAU_BO_RD, ctx->client), 0);
+		}
+	}
+	CHECK_EQ(nouveau_bo_wait(dst, NOUVEAU_BO_RD, ctx->client), 0);
+}
+
+static void
+ring_bos(struct test_ctx *ctx, struct nouveau_bo **dst, struct nouveau_bo **src)
+{
+	int i;
+
+	*src = test_bo(ctx, NOUVEAU_BO_GART, COPIES * COPY);
+	*dst = test_bo(ctx, NOUVEAU_BO_GART, COPIES * COPY);
+	for (i = 0; i < COPIES * COPY / 4; i++)
+		((uint32_t *)(*src)->map)[i] = i * 3 + 1;
+}
+
+/* Commands recorded across the end of the ring arrive intact, and space
+ * the GPU is already done with is reused without waiting.
+ */
+static void
+test_ring_wrap(void)
+{
+	struct nouveau_pushbuf_stats stats;
+	struct nouveau_bo *src, *dst;
+	struct test_ctx ctx;
+
+	test_init_attr(&ctx, true, &ring_attr);
+	ring_bos(&ctx, &dst, &src);
+
+	ring_copies(&ctx, dst, src, true);
+	CHECK(!memcmp(src->map, dst->map, COPIES * COPY));
+
+	nouveau_pushbuf_get_stats(ctx.push, &stats);
+	// The ring is 4 * 0x8000 bytes, it must have wrapped at least once
+	CHECK(stats.dwords * 4 > 4 * 0x8000);
+	CHECK_EQ(stats.ring_stalls, 0);
+
+	nouveau_bo_ref(NULL, &src);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+/* Recording only waits for the GPU when it falls behind */
+static void
+test_ring_stalls(void)
+{
+	struct nouveau_pushbuf_stats stats;
+	struct nouveau_bo *src, *dst;
+	struct test_ctx ctx;
+
+	test_init_attr(&ctx, true, &ring_attr);
+	ring_bos(&ctx, &dst, &src);
+
+	hostGpuSetLatency(1000000);
+	ring_copies(&ctx, dst, src, false);
+	hostGpuSetLatency(10000);
+	CHECK(!memcmp(src->map, dst->map, COPIES * COPY));
+
+	nouveau_pushbuf_get_stats(ctx.push, &stats);
+	CHECK(stats.ring_stalls > 0);
+
+	nouveau_bo_ref(NULL, &src);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+/* Deferred pushbufs are replayed later, so they can't record into a ring */
+static void
+test_ring_deferred(void)
+{
+	struct test_ctx ctx;
+	struct nouveau_pushbuf *push = NULL;
+
+	test_init(&ctx);
+	CHECK_EQ(nouveau_pushbuf_new_attr(ctx.client, ctx.chan, 4, 0x8000, false,
+					  &ring_attr, &push), -EINVAL);
+	CHECK(!push);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_ring_wrap);
+	RUN(test_ring_stalls);
+	RUN(test_ring_deferred);
+	return 0;
+}
@@ -0,0 +1,116 @@
+/* Suballocation of small bos from slabs */
+#include "test.h"
+#include "private.h"
+
+static struct nouveau_bo *
+slab_bo(struct test_ctx *ctx, uint64_t size, NvKind kind)
+{
+	union nouveau_bo_config config = { .nvc0 = { .memtype = kind } };
+	struct nouveau_bo *bo = NULL;
+
+	CHECK_EQ(nouveau_bo_new(ctx->dev, NOUVEAU_BO_GART, 0, size, &config, &bo), 0);
+	return bo;
+}
+
+static bool
+is_slab(struct nouveau_bo *bo)
+{
+	return nouveau_bo(bo)->slab != NULL;
+}
+
+static void
+test_slab_kinds(void)
+{
+	struct test_ctx ctx;
+	struct nouveau_bo *bo;
+
+	test_init(&ctx);
+
+	bo = slab_bo(&ctx, 0x100, NvKind_Pitch);
+	CHECK(is_slab(bo));
+	CHECK(bo->handle & BO_SLAB_HANDLE_BIT);
+	nouveau_bo_ref(NULL, &bo);
+
+	// Generic kinds may be used block-linear, their slots are GOB sized
+	bo = slab_bo(&ctx, 0x100, NvKind_Generic_16BX2);
+	CHECK(is_slab(bo));
+	CHECK_EQ(bo->size, 0x200);
+	CHECK_EQ(bo->offset & 0x1ff, 0);
+	nouveau_bo_ref(NULL, &bo);
+
+	bo = slab_bo(&ctx, 0x100, NvKind_C32_2C);
+	CHECK(!is_slab(bo));
+	CHECK(!(bo->handle & BO_SLAB_HANDLE_BIT));
+	nouveau_bo_ref(NULL, &bo);
+
+	bo = slab_bo(&ctx, 0x1000, NvKind_Z16);
+	CHECK(!is_slab(bo));
+	nouveau_bo_ref(NULL, &bo);
+
+	test_fini(&ctx);
+}
+
+static int
+cmp_handle(const void *a, const void *b)
+{
+	uint32_t x = (*(struct nouveau_bo *const *)a)->handle;
+	uint32_t y = (*(struct nouveau_bo *const *)b)->handle;
+	return x < y ? -1 : x > y;
+}
+
+static void
+check_unique(struct nouveau_bo **bos, int nr)
+{
+	struct nouveau_bo **sorted = malloc(nr * sizeof(*sorted));
+	int i;
+
+	memcpy(sorted, bos, nr * sizeof(*sorted));
+	qsort(sorted, nr, sizeof(*sorted), cmp_handle);
+	for (i = 1; i < nr; i++)
+		CHECK(sorted[i - 1]->handle != sorted[i]->handle);
+	free(sorted);
+}
+
+/* Handles are made of the slab id and slot, so churning through many more
+ * bos than fit in the handle space never hands out a live handle again.
+ */
+static void
+test_slab_handles(void)
+{
+	enum { NR = 4096 };
+	struct nouveau_bo *bos[NR];
+	struct test_ctx ctx;
+	int round, i;
+
+	test_init(&ctx);
+
+	for (i = 0; i < NR; i++)
+		bos[i] = slab_bo(&ctx, 0x100 << (i % 4), NvKind_Pitch);
+	check_unique(bos, NR);
+
+	for (round = 0; round < 64; round++) {
+		for (i = round % 3; i < NR; i += 3) {
+			nouveau_bo_ref(NULL, &bos[i]);
+			bos[i] = slab_bo(&ctx, 0x100 << ((i + round) % 4), NvKind_Pitch);
+		}
+		check_unique(bos, NR);
+	}
+
+	for (i = 0; i < NR; i++) {
+		struct nouveau_bo_slab *slab = nouveau_bo(bos[i])->slab;
+		uint32_t slot = (bos[i]->offset - slab->offset) / slab->slot_size;
+		CHECK_EQ(bos[i]->handle, BO_SLAB_HANDLE_BIT |
+			 (slab->id << BO_SLAB_SLOT_BITS) | slot);
+		nouveau_bo_ref(NULL, &bos[i]);
+	}
+
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_slab_kinds);
+	RUN(test_slab_handles);
+	return 0;
+}
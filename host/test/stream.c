@@ -0,0 +1,84 @@
+/* Streaming uploads through a fence-recycled heap */
+#include "test.h"
+
+#define CHUNK 0x1000
+
+static uint64_t
+upload(struct test_ctx *ctx, struct nouveau_stream *stream, struct nouveau_bo *dst,
+       uint32_t value)
+{
+	struct nouveau_pushbuf_refn ref = { dst, NOUVEAU_BO_WR | NOUVEAU_BO_GART };
+	struct nouveau_bo *bo = nouveau_stream_bo(stream);
+	uint64_t offset;
+	uint32_t *map;
+	int i;
+
+	CHECK_EQ(nouveau_pushbuf_space(ctx->push, 16, 0, 0), 0);
+	CHECK_EQ(nouveau_stream_alloc(stream, CHUNK, 0x100, (void **)&map, &offset), 0);
+	for (i = 0; i < CHUNK / 4; i++)
+		map[i] = value;
+	CHECK_EQ(nouveau_pushbuf_refn(ctx->push, &ref, 1), 0);
+	test_copy(ctx->push, dst->offset, bo->offset + offset, CHUNK);
+	CHECK_EQ(nouveau_pushbuf_kick(ctx->push, ctx->chan), 0);
+	return offset;
+}
+
+/* Allocations that fit don't poll the GPU for space */
+static void
+test_stream_no_polls(void)
+{
+	struct nouveau_stream *stream;
+	struct test_ctx ctx;
+	struct nouveau_bo *dst;
+	HostNvStats stats;
+	int i;
+
+	test_init(&ctx);
+	dst = test_bo(&ctx, NOUVEAU_BO_GART, CHUNK);
+	CHECK_EQ(nouveau_stream_new(ctx.push, 16 * CHUNK, &stream), 0);
+
+	hostResetStats();
+	for (i = 0; i < 8; i++)
+		upload(&ctx, stream, dst, i);
+	hostGetStats(&stats);
+	CHECK_EQ(stats.fence_polls, 0);
+
+	nouveau_stream_del(&stream);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+/* Space is recycled once the GPU has consumed it */
+static void
+test_stream_wrap(void)
+{
+	struct nouveau_stream *stream;
+	struct test_ctx ctx;
+	struct nouveau_bo *dst;
+	bool wrapped = false;
+	int i;
+
+	test_init(&ctx);
+	dst = test_bo(&ctx, NOUVEAU_BO_GART, CHUNK);
+	CHECK_EQ(nouveau_stream_new(ctx.push, 4 * CHUNK, &stream), 0);
+
+	for (i = 1; i <= 16; i++) {
+		if (upload(&ctx, stream, dst, i) == 0 && i > 1)
+			wrapped = true;
+		CHECK_EQ(nouveau_bo_wait(dst, NOUVEAU_BO_RD, ctx.client), 0);
+		CHECK_EQ(((uint32_t *)dst->map)[CHUNK / 4 - 1], i);
+	}
+	CHECK(wrapped);
+
+	nouveau_stream_del(&stream);
+	nouveau_bo_ref(NULL, &dst);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_stream_no_polls);
+	RUN(test_stream_wrap);
+	return 0;
+}
@@ -0,0 +1,112 @@
+/* Helpers shared by the host tests, each of which is a program of its own */
+#ifndef __HOST_TEST_H__
+#define __HOST_TEST_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <nouveau.h>
+#include <nouveau_drm.h>
+#include <host.h>
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__, \
+			__LINE__, __func__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+	long long _a = (long long)(a), _b = (long long)(b); \
+	if (_a != _b) { \
+		fprintf(stderr, "%s:%d: %s: CHECK_EQ(%s, %s) failed: %lld != %lld\n", \
+			__FILE__, __LINE__, __func__, #a, #b, _a, _b); \
+		exit(1); \
+	} \
+} while (0)
+
+#define RUN(test) do { \
+	printf("  %s\n", #test); \
+	test(); \
+} while (0)
+
+struct test_ctx {
+	struct nouveau_drm *drm;
+	struct nouveau_device *dev;
+	struct nouveau_client *client;
+	struct nouveau_object *chan;
+	struct nouveau_pushbuf *push;
+};
+
+static inline void
+test_init_attr(struct test_ctx *ctx, bool immediate,
+	       const struct nouveau_pushbuf_attr *attr)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	CHECK_EQ(nouveau_drm_new(0, &ctx->drm), 0);
+	CHECK_EQ(nouveau_device_new(&ctx->drm->client, NOUVEAU_DEVICE_CLASS,
+				    NULL, 0, &ctx->dev), 0);
+	CHECK_EQ(nouveau_client_new(ctx->dev, &ctx->client), 0);
+	CHECK_EQ(nouveau_object_new(&ctx->dev->object, 0, NOUVEAU_FIFO_CHANNEL_CLASS,
+				    NULL, 0, &ctx->chan), 0);
+	CHECK_EQ(nouveau_pushbuf_new_attr(ctx->client, ctx->chan, 4, 0x8000,
+					  immediate, attr, &ctx->push), 0);
+}
+
+static inline void
+test_init(struct test_ctx *ctx)
+{
+	test_init_attr(ctx, true, NULL);
+}
+
+static inline void
+test_fini(struct test_ctx *ctx)
+{
+	nouveau_pushbuf_del(&ctx->push);
+	nouveau_object_del(&ctx->chan);
+	nouveau_client_del(&ctx->client);
+	nouveau_device_del(&ctx->dev);
+	nouveau_drm_del(&ctx->drm);
+	hostGpuIdle();
+	CHECK_EQ(({ HostNvStats s; hostGetStats(&s); s.watchdog_timeouts; }), 0);
+}
+
+static inline struct nouveau_bo *
+test_bo(struct test_ctx *ctx, uint32_t flags, uint64_t size)
+{
+	struct nouveau_bo *bo = NULL;
+
+	CHECK_EQ(nouveau_bo_new(ctx->dev, flags | NOUVEAU_BO_MAP, 0, size, NULL, &bo), 0);
+	CHECK_EQ(nouveau_bo_map(bo, NOUVEAU_BO_RDWR, ctx->client), 0);
+	return bo;
+}
+
+/* Method headers as Mesa writes them */
+static inline void
+test_mthd(struct nouveau_pushbuf *push, int subc, uint32_t mthd, uint32_t size)
+{
+	*push->cur++ = (mthd >> 2) | (subc << 13) | (size << 16) | (1 << 29);
+}
+
+/* Copies with the copy engine, recorded by hand into push */
+static inline void
+test_copy(struct nouveau_pushbuf *push, uint64_t dst, uint64_t src, uint32_t size)
+{
+	test_mthd(push, 4, 0x0000, 1);
+	*push->cur++ = 0xb0b5;
+	test_mthd(push, 4, 0x0400, 8);
+	*push->cur++ = src >> 32;
+	*push->cur++ = src;
+	*push->cur++ = dst >> 32;
+	*push->cur++ = dst;
+	*push->cur++ = size;
+	*push->cur++ = size;
+	*push->cur++ = size;
+	*push->cur++ = 1;
+	test_mthd(push, 4, 0x0300, 1);
+	*push->cur++ = 0x186;
+}
+
+#endif /* __HOST_TEST_H__ */
@@ -0,0 +1,122 @@
+/* Pushbufs of one client recorded by different threads sharing bos */
+#include <pthread.h>
+#include "test.h"
+
+struct other {
+	struct nouveau_object *chan;
+	struct nouveau_pushbuf *push;
+	struct nouveau_bo *bo;
+};
+
+static void *
+other_record(void *arg)
+{
+	struct other *o = arg;
+	struct nouveau_pushbuf_refn ref = { o->bo, NOUVEAU_BO_WR | NOUVEAU_BO_GART };
+
+	CHECK_EQ(nouveau_pushbuf_space(o->push, 8, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(o->push, &ref, 1), 0);
+	*o->push->cur++ = 0;
+	return NULL;
+}
+
+static void *
+other_space(void *arg)
+{
+	struct other *o = arg;
+
+	CHECK_EQ(nouveau_pushbuf_space(o->push, 8, 0, 0), 0);
+	return NULL;
+}
+
+static void
+on_other(struct other *o, void *(*fn)(void *))
+{
+	pthread_t thread;
+
+	CHECK_EQ(pthread_create(&thread, NULL, fn, o), 0);
+	CHECK_EQ(pthread_join(thread, NULL), 0);
+}
+
+/* A bo on a pushbuf another thread is recording is never waited for nor
+ * submitted from here.  That thread is asked to submit it, and the bo
+ * can be used once it has.
+ */
+static void
+test_busy_until_submitted(void)
+{
+	struct nouveau_pushbuf_refn ref;
+	struct nouveau_pushbuf_stats stats;
+	struct test_ctx ctx;
+	struct other o;
+
+	test_init(&ctx);
+	o.bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	CHECK_EQ(nouveau_object_new(&ctx.dev->object, 0, NOUVEAU_FIFO_CHANNEL_CLASS,
+				    NULL, 0, &o.chan), 0);
+	CHECK_EQ(nouveau_pushbuf_new(ctx.client, o.chan, 1, 0x1000, true, &o.push), 0);
+
+	on_other(&o, other_record);
+	ref = (struct nouveau_pushbuf_refn){ o.bo, NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+	CHECK_EQ(nouveau_pushbuf_space(ctx.push, 8, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx.push, &ref, 1), -EBUSY);
+	CHECK_EQ(nouveau_bo_wait(o.bo, NOUVEAU_BO_RD | NOUVEAU_BO_NOBLOCK, ctx.client),
+		 -EAGAIN);
+	CHECK_EQ(nouveau_bo_wait(o.bo, NOUVEAU_BO_RD, ctx.client), -EBUSY);
+	nouveau_pushbuf_get_stats(o.push, &stats);
+	CHECK_EQ(stats.kicks, 0);
+
+	// The request is served at the other thread's next safe point
+	on_other(&o, other_space);
+	nouveau_pushbuf_get_stats(o.push, &stats);
+	CHECK_EQ(stats.kicks, 1);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx.push, &ref, 1), 0);
+	*ctx.push->cur++ = 0;
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+	CHECK_EQ(nouveau_bo_wait(o.bo, NOUVEAU_BO_RDWR, ctx.client), 0);
+
+	nouveau_pushbuf_del(&o.push);
+	nouveau_object_del(&o.chan);
+	nouveau_bo_ref(NULL, &o.bo);
+	test_fini(&ctx);
+}
+
+/* Pushbufs recorded by the calling thread are flushed to keep the order */
+static void
+test_same_thread_flush(void)
+{
+	struct nouveau_pushbuf_refn ref;
+	struct nouveau_pushbuf_stats stats;
+	struct test_ctx ctx;
+	struct other o;
+
+	test_init(&ctx);
+	o.bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	CHECK_EQ(nouveau_object_new(&ctx.dev->object, 0, NOUVEAU_FIFO_CHANNEL_CLASS,
+				    NULL, 0, &o.chan), 0);
+	CHECK_EQ(nouveau_pushbuf_new(ctx.client, o.chan, 1, 0x1000, true, &o.push), 0);
+
+	other_record(&o);
+	ref = (struct nouveau_pushbuf_refn){ o.bo, NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+	CHECK_EQ(nouveau_pushbuf_space(ctx.push, 8, 0, 0), 0);
+	CHECK_EQ(nouveau_pushbuf_refn(ctx.push, &ref, 1), 0);
+	nouveau_pushbuf_get_stats(ctx.push, &stats);
+	CHECK_EQ(stats.cross_flushes, 1);
+	nouveau_pushbuf_get_stats(o.push, &stats);
+	CHECK_EQ(stats.kicks, 1);
+	*ctx.push->cur++ = 0;
+	CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+
+	nouveau_pushbuf_del(&o.push);
+	nouveau_object_del(&o.chan);
+	nouveau_bo_ref(NULL, &o.bo);
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	RUN(test_busy_until_submitted);
+	RUN(test_same_thread_flush);
+	return 0;
+}
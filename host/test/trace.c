@@ -0,0 +1,253 @@
+/* Traces recorded while enabled and exported as Chrome trace JSON */
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "test.h"
+
+static char path[64];
+
+/* Just enough of a JSON parser to tell whether the export is well formed */
+static bool json_value(const char **p);
+
+static void
+json_ws(const char **p)
+{
+	while (isspace((unsigned char)**p))
+		(*p)++;
+}
+
+static bool
+json_string(const char **p)
+{
+	if (*(*p)++ != '"')
+		return false;
+	while (**p && **p != '"') {
+		if (**p == '\\' && !*++(*p))
+			return false;
+		(*p)++;
+	}
+	return *(*p)++ == '"';
+}
+
+static bool
+json_list(const char **p, char close, bool members)
+{
+	(*p)++;
+	json_ws(p);
+	if (**p == close) {
+		(*p)++;
+		return true;
+	}
+	for (;;) {
+		if (members) {
+			if (!json_string(p))
+				return false;
+			json_ws(p);
+			if (*(*p)++ != ':')
+				return false;
+		}
+		if (!json_value(p))
+			return false;
+		json_ws(p);
+		if (**p == close) {
+			(*p)++;
+			return true;
+		}
+		if (*(*p)++ != ',')
+			return false;
+		json_ws(p);
+	}
+}
+
+static bool
+json_value(const char **p)
+{
+	char *end;
+
+	json_ws(p);
+	switch (**p) {
+	case '{':
+		return json_list(p, '}', true);
+	case '[':
+		return json_list(p, ']', false);
+	case '"':
+		return json_string(p);
+	default:
+		strtod(*p, &end);
+		if (end == *p)
+			return false;
+		*p = end;
+		return true;
+	}
+}
+
+struct trace_counts {
+	int events;
+	int bo_new;
+	int pairs;
+	int tids;
+};
+
+/* Exports the trace, checks that it parses and that the begin and end
+ * events of each thread pair up.  The exporter writes one event a line.
+ */
+static struct trace_counts
+export(void)
+{
+	struct trace_counts counts = {};
+	char *buf, *line, *name, open[64][32];
+	int tid, depth = 0, last_tid = -1;
+	const char *p;
+	long size;
+	FILE *f;
+
+	CHECK_EQ(nouveau_trace_export(path), 0);
+	f = fopen(path, "r");
+	CHECK(f);
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	buf = calloc(1, size + 1);
+	CHECK(buf);
+	CHECK_EQ(fread(buf, 1, size, f), size);
+	fclose(f);
+
+	p = buf;
+	CHECK(json_value(&p));
+	json_ws(&p);
+	CHECK_EQ(*p, 0);
+
+	for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+		name = strstr(line, "\"name\":\"");
+		if (!name)
+			continue;
+		name += 8;
+		CHECK(sscanf(strstr(line, "\"tid\":"), "\"tid\":%d", &tid) == 1);
+		counts.events++;
+		counts.bo_new += !strncmp(name, "bo_new\"", 7);
+
+		// Rings are exported one after the other
+		if (tid != last_tid) {
+			CHECK_EQ(depth, 0);
+			last_tid = tid;
+			counts.tids++;
+		}
+		if (strstr(line, "\"ph\":\"B\"")) {
+			CHECK(depth < 64);
+			snprintf(open[depth++], sizeof(open[0]), "%.*s",
+				 (int)(strchr(name, '"') - name), name);
+		} else if (strstr(line, "\"ph\":\"E\"")) {
+			CHECK(depth > 0);
+			depth--;
+			CHECK(!strncmp(name, open[depth], strlen(open[depth])));
+			counts.pairs++;
+		}
+	}
+	CHECK_EQ(depth, 0);
+
+	free(buf);
+	unlink(path);
+	return counts;
+}
+
+/* Validation and fence waits are exported as pairs, resets drop what
+ * was recorded before them.
+ */
+static void
+test_trace_export(void)
+{
+	struct nouveau_pushbuf_refn ref;
+	struct trace_counts counts;
+	struct nouveau_bo *bo;
+	struct test_ctx ctx;
+	int i;
+
+	test_init(&ctx);
+	nouveau_trace_reset();
+	nouveau_trace_enable(true);
+
+	bo = test_bo(&ctx, NOUVEAU_BO_GART, 0x1000);
+	ref = (struct nouveau_pushbuf_refn){ bo, NOUVEAU_BO_WR | NOUVEAU_BO_GART };
+	for (i = 0; i < 4; i++) {
+		CHECK_EQ(nouveau_pushbuf_space(ctx.push, 8, 0, 0), 0);
+		CHECK_EQ(nouveau_pushbuf_refn(ctx.push, &ref, 1), 0);
+		CHECK_EQ(nouveau_pushbuf_validate(ctx.push), 0);
+		*ctx.push->cur++ = 0;
+		CHECK_EQ(nouveau_pushbuf_kick(ctx.push, ctx.chan), 0);
+		CHECK_EQ(nouveau_bo_wait(bo, NOUVEAU_BO_RD, ctx.client), 0);
+	}
+	nouveau_trace_enable(false);
+
+	counts = export();
+	CHECK_EQ(counts.bo_new, 1);
+	CHECK(counts.pairs >= 4);
+	CHECK_EQ(counts.tids, 1);
+
+	// Nothing is recorded while disabled
+	nouveau_bo_ref(NULL, &bo);
+	CHECK_EQ(export().events, counts.events);
+
+	nouveau_trace_reset();
+	CHECK_EQ(export().events, 0);
+
+	test_fini(&ctx);
+}
+
+static void *
+thread_bo_new(void *arg)
+{
+	struct test_ctx *ctx = arg;
+	struct nouveau_bo *bo = NULL;
+
+	CHECK_EQ(nouveau_bo_new(ctx->dev, NOUVEAU_BO_GART, 0, 0x1000, NULL, &bo), 0);
+	nouveau_bo_ref(NULL, &bo);
+	return NULL;
+}
+
+static void
+on_thread(struct test_ctx *ctx)
+{
+	pthread_t thread;
+
+	CHECK_EQ(pthread_create(&thread, NULL, thread_bo_new, ctx), 0);
+	CHECK_EQ(pthread_join(thread, NULL), 0);
+}
+
+/* The events of finished threads are kept until a new thread takes
+ * their ring over.
+ */
+static void
+test_trace_threads(void)
+{
+	struct trace_counts counts;
+	struct test_ctx ctx;
+	int i;
+
+	test_init(&ctx);
+	nouveau_trace_reset();
+	nouveau_trace_enable(true);
+
+	on_thread(&ctx);
+	counts = export();
+	CHECK_EQ(counts.bo_new, 1);
+	CHECK_EQ(counts.tids, 1);
+
+	for (i = 0; i < 8; i++)
+		on_thread(&ctx);
+	counts = export();
+	CHECK_EQ(counts.bo_new, 1);
+	CHECK_EQ(counts.tids, 1);
+
+	nouveau_trace_enable(false);
+	nouveau_trace_reset();
+	test_fini(&ctx);
+}
+
+int
+main(void)
+{
+	snprintf(path, sizeof(path), "/tmp/nouveau-trace-%d", (int)getpid());
+	RUN(test_trace_export);
+	RUN(test_trace_threads);
+	return 0;
+}
@@ -0,0 +1,85 @@
+/* Plays back a capture made with nouveau_device_capture_begin() on the
+ * simulated nv services and reports how long it took.
+ *
+ *   replay [-s] [-n repeats] capture
+ *
+ * -s waits for each submission to complete before the next one.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <nouveau.h>
+#include <host.h>
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-s] [-n repeats] capture\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nouveau_capture_stats stats;
+	struct nouveau_device *dev = NULL;
+	struct nouveau_drm *drm = NULL;
+	uint32_t flags = 0;
+	int opt, repeats = 1, i, ret;
+	uint64_t t;
+
+	while ((opt = getopt(argc, argv, "sn:")) != -1) {
+		if (opt == 's')
+			flags |= NOUVEAU_REPLAY_SYNC;
+		else if (opt == 'n')
+			repeats = atoi(optarg);
+		else
+			usage(argv[0]);
+	}
+	if (optind != argc - 1 || repeats < 1)
+		usage(argv[0]);
+
+	ret = nouveau_drm_new(0, &drm);
+	if (!ret)
+		ret = nouveau_device_new(&drm->client, NOUVEAU_DEVICE_CLASS, NULL, 0,
+					 &dev);
+	if (ret) {
+		fprintf(stderr, "device: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	for (i = 0; i < repeats && !ret; i++) {
+		t = now_ns();
+		ret = nouveau_capture_replay(dev, argv[optind], flags, &stats);
+		t = now_ns() - t;
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+			break;
+		}
+
+		printf("%d: %llu submits  %llu dwords  cpu %llu ns  gpu done %llu ns  "
+		       "elapsed %llu ns\n", i,
+		       (unsigned long long)stats.submits,
+		       (unsigned long long)stats.dwords,
+		       (unsigned long long)stats.cpu_ns,
+		       (unsigned long long)stats.total_ns,
+		       (unsigned long long)t);
+	}
+
+	nouveau_device_del(&dev);
+	nouveau_drm_del(&drm);
+	hostGpuIdle();
+	return ret ? 1 : 0;
+}
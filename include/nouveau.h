@@ -72,6 +72,111 @@ int nouveau_device_new(struct nouveau_object *parent, int32_t oclass,
 		       void *data, uint32_t size, struct nouveau_device **);
 void nouveau_device_del(struct nouveau_device **);
 
+struct nouveau_bo_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t bytes;
+	uint32_t count;
+};
+
+/* Idle buffer objects are kept around for reuse by nouveau_bo_new() until
+ * the cache holds more than max_bytes, or they have been idle for longer
+ * than max_age_ms.  A max_bytes of zero disables the cache.
+ */
+void nouveau_device_set_bo_cache(struct nouveau_device *, uint64_t max_bytes,
+				 uint32_t max_age_ms);
+void nouveau_device_trim_bo_cache(struct nouveau_device *);
+void nouveau_device_get_bo_cache_stats(struct nouveau_device *,
+				       struct nouveau_bo_cache_stats *);
+
+/* Counters kept for the lifetime of a device, cheap enough to always be on.
+ * bo_bytes is the size of the bos allocated or imported and not yet freed,
+ * fence_wait_ns the time spent blocked waiting for bos to go idle.
+ */
+struct nouveau_device_stats {
+	uint64_t bo_allocs;
+	uint64_t bo_frees;
+	uint64_t bo_bytes;
+	uint64_t bo_bytes_total;
+	uint64_t fence_waits;
+	uint64_t fence_wait_ns;
+};
+
+void nouveau_device_get_stats(struct nouveau_device *,
+			      struct nouveau_device_stats *);
+
+/* Performance counters are reached through an NVIF_CLASS_PERFMON object
+ * created on the device, which answers the NVIF_PERFMON_V0_QUERY_* methods,
+ * and NVIF_CLASS_PERFDOM objects created on it, which sample up to four
+ * signals of a domain.  Perfdoms created with NOUVEAU_PERFDOM_MODE_KICK in
+ * nvif_perfdom_v0.mode are sampled after every submission on the device.
+ * A perfmon may be deleted before its perfdoms, which keep working.
+ *
+ * The counters come from a backend, by default one reporting the library's
+ * own device counters.  Another can be plugged in per device, e.g. a stand-in
+ * returning canned values; read returns the current value of a signal that
+ * only ever counts up.  Objects keep the backend they were created with.
+ */
+#define NOUVEAU_PERFDOM_MODE_KICK 0x01
+
+struct nouveau_perfmon_domain {
+	const char *name;
+	uint8_t counter_nr;
+	uint16_t signal_nr;
+	const char *const *signals;
+};
+
+struct nouveau_perfmon_backend {
+	int nr_domains;
+	const struct nouveau_perfmon_domain *domains;
+	int (*read)(void *priv, uint8_t domain, uint16_t signal, uint64_t *value);
+};
+
+/* Passing NULL restores the default backend */
+void nouveau_device_set_perfmon_backend(struct nouveau_device *,
+					const struct nouveau_perfmon_backend *,
+					void *priv);
+
+/* Records every submission on the device, with the contents of the memory
+ * it references, to a file that nouveau_capture_replay() can play back.
+ * Memory is recorded the first time it is referenced and again after the
+ * CPU wrote it, which is noticed when it is mapped for writing.
+ * NOUVEAU_CAPTURE_SNAPSHOT records it on every submission instead.
+ */
+#define NOUVEAU_CAPTURE_SNAPSHOT 0x00000001
+
+int nouveau_device_capture_begin(struct nouveau_device *, const char *path,
+				 uint32_t flags);
+void nouveau_device_capture_end(struct nouveau_device *);
+
+struct nouveau_capture_stats {
+	uint64_t submits;
+	uint64_t dwords;
+	uint64_t cpu_ns;	/* spent recording and kicking submissions */
+	uint64_t total_ns;	/* until the last submission completed */
+};
+
+/* Waits for each submission to complete before the next one */
+#define NOUVEAU_REPLAY_SYNC 0x00000001
+
+/* Replays a capture on its own channel.  The pages of captured GPU
+ * memory are mapped again at the same addresses, the device may have
+ * other memory mapped around them but the replay fails with -EBUSY if
+ * any of them is taken.
+ */
+int nouveau_capture_replay(struct nouveau_device *, const char *path,
+			   uint32_t flags, struct nouveau_capture_stats *);
+
+/* Records bo creation and destruction, validation, kickoffs, fence waits
+ * and cache flushes into a per-thread ring of binary events while enabled.
+ * nouveau_trace_export() writes the events still in the rings as Chrome
+ * trace JSON, which chrome://tracing and Perfetto can load.
+ */
+void nouveau_trace_enable(bool enable);
+void nouveau_trace_reset(void);
+int nouveau_trace_export(const char *path);
+
 int nouveau_getparam(struct nouveau_device *, uint64_t param, uint64_t *value);
 int nouveau_setparam(struct nouveau_device *, uint64_t param, uint64_t value);
 
@@ -120,6 +225,21 @@ union nouveau_bo_config {
 #define NOUVEAU_BO_CONTIG  0x40000000
 #define NOUVEAU_BO_NOSNOOP 0x20000000
 #define NOUVEAU_BO_COHERENT 0x10000000
+#define NOUVEAU_BO_NOZERO  0x08000000
+/* CPU mappings of the bo are cached, see nouveau_bo_flush_range().
+ *
+ * All bos live in the same unified memory.  Placement flags choose how the
+ * CPU and GPU map a new bo:
+ *  - NOUVEAU_BO_VRAM without NOUVEAU_BO_GART: GPU-only.  Bos at least as
+ *    large as the GPU's big page are aligned to and mapped with big pages.
+ *    CPU mappings are write-combined and NOUVEAU_BO_CACHED is ignored.
+ *  - NOUVEAU_BO_GART: small GPU pages and a write-combined CPU mapping,
+ *    suited to uploads
+ *  - NOUVEAU_BO_GART | NOUVEAU_BO_CACHED: cached CPU mapping, suited to
+ *    readback, unless NOUVEAU_BO_NOSNOOP is given as well
+ *  - NOUVEAU_BO_COHERENT: bypasses the GPU caches
+ */
+#define NOUVEAU_BO_CACHED  0x04000000
 
 struct nouveau_bo {
 	struct nouveau_device *device;
@@ -143,6 +263,25 @@ void nouveau_bo_ref(struct nouveau_bo *, struct nouveau_bo **);
 int nouveau_bo_map(struct nouveau_bo *, uint32_t access,
 		   struct nouveau_client *);
 void nouveau_bo_unmap(struct nouveau_bo *);
+/* Bos created with NOUVEAU_BO_CACHED need explicit cache maintenance.
+ * CPU writes through nouveau_bo_map(NOUVEAU_BO_WR), or to the range given
+ * to nouveau_bo_map_range(), are cleaned from the CPU caches when a
+ * pushbuf referencing the bo is kicked.  Until nouveau_bo_unmap(), the
+ * mapped range is cleaned again at every such kick, since the CPU may have
+ * written to it since.  nouveau_bo_flush_range() cleans a range right
+ * away.  After waiting for GPU writes, call nouveau_bo_invalidate_range()
+ * before reading them on the CPU.  These are no-ops for uncached bos.
+ *
+ * nouveau_bo_wait() and nouveau_bo_map() of a bo referenced by commands
+ * another thread is still recording ask that thread's pushbuf to submit
+ * them at its next nouveau_pushbuf_space() or kick, and fail with -EBUSY,
+ * or -EAGAIN with NOUVEAU_BO_NOBLOCK, until it has.
+ */
+int nouveau_bo_map_range(struct nouveau_bo *, uint64_t offset, uint64_t size,
+			 uint32_t access, struct nouveau_client *);
+int nouveau_bo_flush_range(struct nouveau_bo *, uint64_t offset, uint64_t size);
+int nouveau_bo_invalidate_range(struct nouveau_bo *, uint64_t offset,
+				uint64_t size);
 int nouveau_bo_wait(struct nouveau_bo *, uint32_t access,
 		    struct nouveau_client *);
 int nouveau_bo_prime_handle_ref(struct nouveau_device *, int prime_fd,
@@ -150,6 +289,53 @@ int nouveau_bo_prime_handle_ref(struct nouveau_device *, int prime_fd,
 int nouveau_bo_set_prime(struct nouveau_bo *, int *prime_fd);
 int nouveau_bo_get_syncpoint(struct nouveau_bo *, unsigned int *);
 
+/* A point on a GPU channel's syncpoint timeline.  Fences with an id of
+ * NOUVEAU_FENCE_NONE are treated as already signaled.
+ */
+#define NOUVEAU_FENCE_NONE 0xffffffff
+
+struct nouveau_fence {
+	uint32_t id;
+	uint32_t value;
+};
+
+/* Orders fences on the same syncpoint, fences on different syncpoints are
+ * ordered by syncpoint id.
+ */
+int nouveau_fence_cmp(const struct nouveau_fence *,
+		      const struct nouveau_fence *);
+/* Fails with -EINVAL if a and b are on different syncpoints */
+int nouveau_fence_merge(const struct nouveau_fence *a,
+			const struct nouveau_fence *b,
+			struct nouveau_fence *out);
+bool nouveau_fence_signaled(const struct nouveau_fence *);
+/* A negative timeout waits forever, returns -ETIMEDOUT on expiry and the
+ * negated Result if the wait itself fails.
+ */
+int nouveau_fence_wait(const struct nouveau_fence *, int64_t timeout_ns);
+/* Waits for all or any of the fences, *index receives the first fence
+ * found signaled when waiting for any of them.  An empty set is -EINVAL.
+ * Waiting for any of the fences of several syncpoints blocks on them in
+ * turn, and can notice a signal up to 100us late.
+ */
+int nouveau_fence_wait_many(const struct nouveau_fence *, int nr,
+			    bool wait_all, int64_t timeout_ns, int *index);
+int nouveau_bo_get_fence(struct nouveau_bo *, struct nouveau_fence *);
+
+/* Copies and fills run asynchronously on a GPFIFO channel owned by the
+ * device, through the copy engine class rather than a dedicated copy
+ * engine, so they share the GPU's scheduling with other channels.  They
+ * run after any conflicting submitted GPU access to the bos has finished;
+ * bos still referenced by an immediate pushbuf that hasn't been kicked
+ * give -EBUSY, kick those first.  The optional fence signals completion.
+ * Fills need the offset and size to be multiples of four.
+ */
+int nouveau_bo_copy(struct nouveau_bo *dst, uint64_t dst_offset,
+		    struct nouveau_bo *src, uint64_t src_offset, uint64_t size,
+		    struct nouveau_fence *);
+int nouveau_bo_fill(struct nouveau_bo *, uint64_t offset, uint64_t size,
+		    uint32_t value, struct nouveau_fence *);
+
 struct nouveau_list {
 	struct nouveau_list *prev;
 	struct nouveau_list *next;
@@ -204,10 +390,47 @@ struct nouveau_pushbuf_refn {
 	uint32_t flags;
 };
 
+/* Optional creation parameters, zeroed fields select the defaults */
+#define NOUVEAU_PUSHBUF_PRIORITY_LOW    50
+#define NOUVEAU_PUSHBUF_PRIORITY_MEDIUM 100
+#define NOUVEAU_PUSHBUF_PRIORITY_HIGH   150
+
+/* Records into a single ring of nr * size bytes instead of nr separate
+ * buffers, reusing space as soon as the GPU is done with it.  Only valid
+ * for immediate pushbufs.
+ */
+#define NOUVEAU_PUSHBUF_RING 0x00000001
+/* Skips the GPU cache invalidation in front of submissions that only read
+ * bos nobody wrote since the last one.  CPU writes are only seen when a bo
+ * is mapped for writing or allocated, so writes through a mapping kept
+ * across submissions must be announced with nouveau_pushbuf_invalidate().
+ * Without this flag the caches are invalidated before every submission.
+ */
+#define NOUVEAU_PUSHBUF_ELIDE_FLUSH 0x00000002
+/* Fills in idle_kicks and idle_ns of the stats, at the cost of a fence
+ * poll per submission.
+ */
+#define NOUVEAU_PUSHBUF_IDLE_STATS  0x00000004
+
+struct nouveau_pushbuf_attr {
+	uint32_t flags;
+	uint32_t max_buffers;	/* NOUVEAU_GEM_MAX_BUFFERS */
+	uint32_t max_pushes;	/* NOUVEAU_GEM_MAX_PUSH */
+	uint32_t priority;	/* NOUVEAU_PUSHBUF_PRIORITY_MEDIUM */
+	uint32_t timeslice_us;	/* left to the channel scheduler */
+};
+
 int nouveau_pushbuf_new(struct nouveau_client *, struct nouveau_object *chan,
 			int nr, uint32_t size, bool immediate,
 			struct nouveau_pushbuf **);
+int nouveau_pushbuf_new_attr(struct nouveau_client *,
+			     struct nouveau_object *chan, int nr,
+			     uint32_t size, bool immediate,
+			     const struct nouveau_pushbuf_attr *,
+			     struct nouveau_pushbuf **);
 void nouveau_pushbuf_del(struct nouveau_pushbuf **);
+int nouveau_pushbuf_set_priority(struct nouveau_pushbuf *, uint32_t priority);
+int nouveau_pushbuf_set_timeslice(struct nouveau_pushbuf *, uint32_t us);
 int nouveau_pushbuf_space(struct nouveau_pushbuf *, uint32_t dwords,
 			  uint32_t relocs, uint32_t pushes);
 void nouveau_pushbuf_data(struct nouveau_pushbuf *, struct nouveau_bo *,
@@ -224,9 +447,129 @@ void nouveau_pushbuf_reloc(struct nouveau_pushbuf *, struct nouveau_bo *,
 int nouveau_pushbuf_validate(struct nouveau_pushbuf *);
 uint32_t nouveau_pushbuf_refd(struct nouveau_pushbuf *, struct nouveau_bo *);
 int nouveau_pushbuf_kick(struct nouveau_pushbuf *, struct nouveau_object *chan);
+/* Discards what was recorded into a deferred pushbuf, which can then be
+ * recorded again.  Replays already kicked keep running, the command bos
+ * they read are only reused once they have finished.
+ */
+int nouveau_pushbuf_reset(struct nouveau_pushbuf *);
+/* With NOUVEAU_PUSHBUF_ELIDE_FLUSH, forces a GPU cache invalidation in
+ * front of the next submission, e.g. after memory was written through a
+ * persistent mapping or behind the library's back.
+ */
+void nouveau_pushbuf_invalidate(struct nouveau_pushbuf *);
+
+struct nouveau_pushbuf_stats {
+	/* Channel kickoffs, and the GPFIFO entries and dwords they carried */
+	uint64_t kicks;
+	uint64_t gpfifo_entries;
+	uint64_t dwords;
+	/* Submissions forced by the max_buffers or max_pushes limits */
+	uint64_t limit_flushes;
+	uint64_t flushes;
+	uint64_t flushes_elided;
+	uint64_t autokicks;
+	uint64_t coalesced_kicks;
+	/* Submissions made after the GPU had already drained the previous
+	 * one, and an upper bound of the time it spent waiting for them.
+	 * Only counted with NOUVEAU_PUSHBUF_IDLE_STATS.
+	 */
+	uint64_t idle_kicks;
+	uint64_t idle_ns;
+	/* Times a ring mode pushbuf had to wait for the GPU to free space */
+	uint64_t ring_stalls;
+	/* Command bos allocated and reused once a deferred pushbuf has used
+	 * up its initial ones, and the most retired ones kept at once.  They
+	 * are retired by nouveau_pushbuf_reset().
+	 */
+	uint64_t cmd_bo_allocs;
+	uint64_t cmd_bo_reuses;
+	uint32_t cmd_bo_free_hwm;
+	/* Other pushbufs of the calling thread flushed so that this one is
+	 * ordered after them.  Referencing a bo held by a pushbuf another
+	 * thread is recording asks it to submit and fails with -EBUSY.
+	 */
+	uint64_t cross_flushes;
+};
+
+void nouveau_pushbuf_get_stats(struct nouveau_pushbuf *,
+			       struct nouveau_pushbuf_stats *);
+
+/* Thresholds at which an immediate pushbuf is kicked on its own, checked
+ * whenever nouveau_pushbuf_space() is called; zero disables a threshold.
+ * nouveau_pushbuf_kick_lazy() calls with less than min_dwords queued are
+ * held back until max_delay_us after recording started, and submitted by
+ * the next nouveau_pushbuf_space() call after that or a wait on a bo they
+ * reference.  nouveau_pushbuf_kick() and nouveau_pushbuf_kick_fence()
+ * always submit.
+ */
+struct nouveau_pushbuf_autokick {
+	uint32_t max_dwords;
+	uint32_t max_bos;
+	uint32_t max_age_us;
+	uint32_t min_dwords;
+	uint32_t max_delay_us;
+};
+
+/* Passing NULL disables the scheduler and submits any held back work */
+int nouveau_pushbuf_set_autokick(struct nouveau_pushbuf *,
+				 const struct nouveau_pushbuf_autokick *);
+/* Same as nouveau_pushbuf_kick(), unless the scheduler holds it back */
+int nouveau_pushbuf_kick_lazy(struct nouveau_pushbuf *,
+			      struct nouveau_object *chan);
+/* Makes the GPU wait for a fence from another pushbuf before executing the
+ * commands that follow.
+ */
+int nouveau_pushbuf_fence_wait(struct nouveau_pushbuf *,
+			       const struct nouveau_fence *);
+/* Bundles are immutable copies of the commands recorded into a deferred
+ * pushbuf, along with the bos they reference.  Submitting one adds it as
+ * a single push range and references its bos again on the pushbuf.
+ */
+struct nouveau_bundle;
+
+int nouveau_bundle_new(struct nouveau_pushbuf *rec, struct nouveau_bundle **);
+void nouveau_bundle_ref(struct nouveau_bundle *, struct nouveau_bundle **);
+int nouveau_pushbuf_bundle(struct nouveau_pushbuf *, struct nouveau_bundle *);
+
+/* Writes a 16 byte report to bo at offset once the GPU has finished the
+ * commands recorded before it: zero in the first eight bytes, then the
+ * 64-bit GPU time in nanoseconds, comparable with the value returned by
+ * nouveau_getparam(NOUVEAU_GETPARAM_PTIMER_TIME).  offset must be 16 byte
+ * aligned.
+ */
+int nouveau_pushbuf_timestamp(struct nouveau_pushbuf *, struct nouveau_bo *,
+			      uint32_t offset);
+
+/* A stream is a persistently mapped upload heap tied to an immediate
+ * pushbuf.  Allocations return a CPU pointer and the offset into
+ * nouveau_stream_bo(), and stay valid until the next kick of the pushbuf
+ * has been executed by the GPU; the heap is recycled as those kicks
+ * complete.  Allocating only waits if the whole heap is in flight.
+ */
+struct nouveau_stream;
+
+int nouveau_stream_new(struct nouveau_pushbuf *, uint64_t size,
+		       struct nouveau_stream **);
+void nouveau_stream_del(struct nouveau_stream **);
+struct nouveau_bo *nouveau_stream_bo(struct nouveau_stream *);
+int nouveau_stream_alloc(struct nouveau_stream *, uint32_t size, uint32_t align,
+			 void **map, uint64_t *offset);
+
+/* Like nouveau_pushbuf_kick(), also returns the fence of the last submission */
+int nouveau_pushbuf_kick_fence(struct nouveau_pushbuf *,
+			       struct nouveau_object *chan,
+			       struct nouveau_fence *);
 struct nouveau_bufctx *
 nouveau_pushbuf_bufctx(struct nouveau_pushbuf *, struct nouveau_bufctx *);
 
+/* Buffer objects of at least min_size bytes created after this call are
+ * cleared by the copy engine instead of by a CPU memset.  The clear is
+ * submitted on the channel of nouveau_bo_fill() before the bo is returned,
+ * and mapping the bo or referencing it on another pushbuf waits for it.
+ * Zero goes back to CPU clears.
+ */
+void nouveau_device_set_gpu_clear(struct nouveau_device *, uint64_t min_size);
+
 #define NOUVEAU_DEVICE_CLASS       0x80000000
 #define NOUVEAU_FIFO_CHANNEL_CLASS 0x80000001
 #define NOUVEAU_NOTIFIER_CLASS     0x80000002
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "private.h"
+
+#ifdef DEBUG
+#	define TRACE(x...) printf("nouveau: " x)
+#	define CALLED() TRACE("CALLED: %s\n", __PRETTY_FUNCTION__)
+#else
+#	define TRACE(x...)
+# define CALLED()
+#endif
+
+static void
+bo_cache_add_bucket(struct nouveau_device_priv *nvdev, uint64_t size)
+{
+	struct nouveau_bo_cache_bucket *bucket = &nvdev->cache[nvdev->nr_cache_buckets++];
+	DRMINITLISTHEAD(&bucket->head);
+	bucket->size = size;
+}
+
+void
+bo_cache_init(struct nouveau_device_priv *nvdev)
+{
+	uint64_t size;
+
+	DRMINITLISTHEAD(&nvdev->cache_lru);
+	nvdev->cache_max_bytes = BO_CACHE_DEFAULT_BYTES;
+	nvdev->cache_max_age = armNsToTicks(BO_CACHE_DEFAULT_AGE_MS * 1000000ULL);
+
+	// Page-sized buckets for small bos, then four buckets per power of two
+	bo_cache_add_bucket(nvdev, 0x1000);
+	bo_cache_add_bucket(nvdev, 0x2000);
+	bo_cache_add_bucket(nvdev, 0x3000);
+	for (size = 0x4000; size < BO_CACHE_MAX_SIZE; size *= 2) {
+		bo_cache_add_bucket(nvdev, size);
+		bo_cache_add_bucket(nvdev, size + size / 4);
+		bo_cache_add_bucket(nvdev, size + size / 2);
+		bo_cache_add_bucket(nvdev, size + size * 3 / 4);
+	}
+	bo_cache_add_bucket(nvdev, BO_CACHE_MAX_SIZE);
+}
+
+static struct nouveau_bo_cache_bucket *
+bo_cache_bucket(struct nouveau_device_priv *nvdev, uint64_t size)
+{
+	int i;
+
+	for (i = 0; i < nvdev->nr_cache_buckets; i++)
+		if (nvdev->cache[i].size >= size)
+			return &nvdev->cache[i];
+
+	return NULL;
+}
+
+static bool
+bo_cache_idle(struct nouveau_bo_priv *nvbo)
+{
+	return !bo_fence_wait(nvbo, NOUVEAU_BO_WR | NOUVEAU_BO_NOBLOCK);
+}
+
+static void
+bo_cache_unlink(struct nouveau_device_priv *nvdev, struct nouveau_bo_priv *nvbo)
+{
+	DRMLISTDEL(&nvbo->cache_head);
+	DRMLISTDEL(&nvbo->lru_head);
+	nvdev->cache_bytes -= nvbo->base.size;
+	nvdev->cache_count--;
+}
+
+/* Moves bos that are over the age or size limits onto the given list,
+ * so that they can be destroyed without holding the bo lock.
+ */
+static void
+bo_cache_evict(struct nouveau_device_priv *nvdev, drmMMListHead *victims)
+{
+	uint64_t now = armGetSystemTick();
+	struct nouveau_bo_priv *nvbo, *tmp;
+
+	DRMLISTFOREACHENTRYSAFE(nvbo, tmp, &nvdev->cache_lru, lru_head) {
+		if (nvdev->cache_bytes <= nvdev->cache_max_bytes &&
+		    now - nvbo->free_time < nvdev->cache_max_age)
+			break;
+
+		bo_cache_unlink(nvdev, nvbo);
+		DRMLISTADDTAIL(&nvbo->cache_head, victims);
+		nvdev->cache_evictions++;
+	}
+}
+
+static void
+bo_cache_destroy(drmMMListHead *victims)
+{
+	struct nouveau_bo_priv *nvbo, *tmp;
+
+	DRMLISTFOREACHENTRYSAFE(nvbo, tmp, victims, cache_head)
+		bo_destroy(nvbo);
+}
+
+struct nouveau_bo_priv *
+bo_cache_get(struct nouveau_device *dev, uint64_t *size, uint32_t align,
+             uint32_t flags, NvKind kind)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	struct nouveau_bo_cache_bucket *bucket;
+	struct nouveau_bo_priv *nvbo, *found = NULL;
+	drmMMListHead victims;
+	uint32_t big = nvdev->addr_space.page_size;
+
+	if (!nvdev->cache_max_bytes)
+		return NULL;
+
+	bucket = bo_cache_bucket(nvdev, *size);
+	if (!bucket)
+		return NULL;
+
+	// Round up the allocation so that it can be recycled into this bucket
+	*size = bucket->size;
+
+	DRMINITLISTHEAD(&victims);
+	mutexLock(&nvdev->bo_lock);
+
+	// Bos mapped with big pages are only recycled as such
+	DRMLISTFOREACHENTRY(nvbo, &bucket->head, cache_head) {
+		if (nvbo->kind != kind ||
+		    (nvbo->base.flags & BO_ATTR_MASK) != (flags & BO_ATTR_MASK) ||
+		    nvbo->align < align || (nvbo->align >= big) != (align >= big) ||
+		    (nvbo->base.offset & (align - 1)))
+			continue;
+		if (!bo_cache_idle(nvbo))
+			continue;
+		found = nvbo;
+		break;
+	}
+
+	if (found) {
+		bo_cache_unlink(nvdev, found);
+		nvdev->cache_hits++;
+	} else
+		nvdev->cache_misses++;
+
+	bo_cache_evict(nvdev, &victims);
+	mutexUnlock(&nvdev->bo_lock);
+
+	bo_cache_destroy(&victims);
+	return found;
+}
+
+bool
+bo_cache_put(struct nouveau_bo_priv *nvbo)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(nvbo->base.device);
+	struct nouveau_bo_cache_bucket *bucket;
+	drmMMListHead victims;
+
+	// Only bos backed by their own memory can be recycled
+	if (!nvdev->cache_max_bytes || nvbo->slab || !nvbo->map_addr)
+		return false;
+
+	bucket = bo_cache_bucket(nvdev, nvbo->base.size);
+	if (!bucket || bucket->size != nvbo->base.size ||
+	    nvbo->base.size > nvdev->cache_max_bytes)
+		return false;
+
+	DRMINITLISTHEAD(&victims);
+	mutexLock(&nvdev->bo_lock);
+
+	nvbo->free_time = armGetSystemTick();
+	DRMLISTADDTAIL(&nvbo->cache_head, &bucket->head);
+	DRMLISTADDTAIL(&nvbo->lru_head, &nvdev->cache_lru);
+	nvdev->cache_bytes += nvbo->base.size;
+	nvdev->cache_count++;
+
+	bo_cache_evict(nvdev, &victims);
+	mutexUnlock(&nvdev->bo_lock);
+
+	bo_cache_destroy(&victims);
+	return true;
+}
+
+void
+bo_cache_fini(struct nouveau_device *dev)
+{
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+
+	nvdev->cache_max_bytes = 0;
+	nouveau_device_trim_bo_cache(dev);
+}
+
+void
+nouveau_device_set_bo_cache(struct nouveau_device *dev, uint64_t max_bytes,
+			    uint32_t max_age_ms)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+
+	mutexLock(&nvdev->bo_lock);
+	nvdev->cache_max_bytes = max_bytes;
+	nvdev->cache_max_age = armNsToTicks(max_age_ms * 1000000ULL);
+	mutexUnlock(&nvdev->bo_lock);
+
+	nouveau_device_trim_bo_cache(dev);
+}
+
+void
+nouveau_device_trim_bo_cache(struct nouveau_device *dev)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	drmMMListHead victims;
+
+	DRMINITLISTHEAD(&victims);
+	mutexLock(&nvdev->bo_lock);
+	bo_cache_evict(nvdev, &victims);
+	mutexUnlock(&nvdev->bo_lock);
+
+	bo_cache_destroy(&victims);
+}
+
+void
+nouveau_device_get_bo_cache_stats(struct nouveau_device *dev,
+				  struct nouveau_bo_cache_stats *stats)
+{
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+
+	mutexLock(&nvdev->bo_lock);
+	stats->hits = nvdev->cache_hits;
+	stats->misses = nvdev->cache_misses;
+	stats->evictions = nvdev->cache_evictions;
+	stats->bytes = nvdev->cache_bytes;
+	stats->count = nvdev->cache_count;
+	mutexUnlock(&nvdev->bo_lock);
+}
@@ -10,68 +10,158 @@
 # define CALLED()
 #endif
 
-static inline unsigned bo_map_hash(struct nouveau_bo *bo)
+static inline uint32_t bo_map_hash(uint32_t handle)
 {
-	return bo->handle % BO_MAP_NUM_BUCKETS;
+	// murmur3 finalizer, handles are small sequential integers
+	handle ^= handle >> 16;
+	handle *= 0x85ebca6b;
+	handle ^= handle >> 13;
+	handle *= 0xc2b2ae35;
+	handle ^= handle >> 16;
+	return handle;
 }
 
-static inline struct nouveau_client_bo_map_entry *bo_map_lookup(struct nouveau_client_bo_map *bomap, struct nouveau_bo *bo)
+/* The top bits of the hash pick the shard, the bottom ones the slot */
+static inline struct nouveau_client_bo_map *bo_map_shard(struct nouveau_client *client, uint32_t hash)
+{
+	return &nouveau_client(client)->bomap[hash >> (32 - BO_MAP_SHARD_BITS)];
+}
+
+static inline struct nouveau_client_bo_map_entry *bo_map_lookup(struct nouveau_client_bo_map *bomap, struct nouveau_bo *bo, uint32_t hash)
 {
 	struct nouveau_client_bo_map_entry *ent;
-	for (ent = bomap->buckets[bo_map_hash(bo)]; ent; ent = ent->next)
+	uint32_t i;
+
+	if (!bomap->count)
+		return NULL;
+
+	for (i = hash & bomap->mask;; i = (i + 1) & bomap->mask) {
+		ent = &bomap->entries[i];
 		if (ent->bo_handle == bo->handle)
+			return ent;
+		if (!ent->bo_handle)
+			return NULL;
+	}
+}
+
+static int bo_map_resize(struct nouveau_client_bo_map *bomap, uint32_t size)
+{
+	struct nouveau_client_bo_map_entry *old = bomap->entries;
+	struct nouveau_client_bo_map_entry *entries;
+	uint32_t old_size = old ? bomap->mask + 1 : 0;
+	uint32_t i, j;
+
+	entries = calloc(size, sizeof(*entries));
+	if (!entries)
+		return -1;
+
+	// Reinsert all live entries into the new table
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].bo_handle)
+			continue;
+		for (j = bo_map_hash(old[i].bo_handle) & (size - 1);
+		     entries[j].bo_handle; j = (j + 1) & (size - 1));
+		entries[j] = old[i];
+	}
+
+	free(old);
+	bomap->entries = entries;
+	bomap->mask = size - 1;
+	return 0;
+}
+
+static void bo_map_remove(struct nouveau_client_bo_map *bomap, struct nouveau_client_bo_map_entry *ent)
+{
+	struct nouveau_client_bo_map_entry *entries = bomap->entries;
+	uint32_t i = ent - entries, j = i, k;
+
+	// Backward-shift deletion, so that lookups never need tombstones
+	for (;;) {
+		j = (j + 1) & bomap->mask;
+		if (!entries[j].bo_handle)
 			break;
-	return ent;
+		k = bo_map_hash(entries[j].bo_handle) & bomap->mask;
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && (k <= i && k > j))) {
+			entries[i] = entries[j];
+			i = j;
+		}
+	}
+	entries[i].bo_handle = 0;
+	entries[i].kref = NULL;
+	entries[i].push = NULL;
+
+	if (--bomap->count < (bomap->mask + 1) / 8 && bomap->mask + 1 > BO_MAP_MIN_SIZE)
+		bo_map_resize(bomap, (bomap->mask + 1) / 2);
+}
+
+/* Releases the per-bo slot, the pointers are cleared before ownership is
+ * given up so that no other client can observe them.
+ */
+static inline void bo_slot_release(struct nouveau_bo_priv *nvbo)
+{
+	nvbo->kref = NULL;
+	nvbo->kref_push = NULL;
+	__sync_synchronize();
+	nvbo->kref_client = NULL;
 }
 
 void
 cli_map_free(struct nouveau_client *client)
 {
-	struct nouveau_client_bo_map *bomap = &nouveau_client(client)->bomap;
-	unsigned i;
-
-	// Free all buckets
-	for (i = 0; i < BO_MAP_NUM_BUCKETS+1; i ++) {
-		struct nouveau_client_bo_map_entry *ent, *next;
-		for (ent = bomap->buckets[i]; ent; ent = next) {
-			next = ent->next;
-			free(ent);
-		}
+	struct nouveau_client_priv *pcli = nouveau_client(client);
+	int i;
+
+	for (i = 0; i < BO_MAP_SHARDS; i++) {
+		free(pcli->bomap[i].entries);
+		pcli->bomap[i].entries = NULL;
+		pcli->bomap[i].mask = 0;
+		pcli->bomap[i].count = 0;
 	}
 }
 
 struct drm_nouveau_gem_pushbuf_bo *
-cli_kref_get(struct nouveau_client *client, struct nouveau_bo *bo)
+cli_kref_get(struct nouveau_client *client, struct nouveau_bo *bo,
+	     struct nouveau_pushbuf *push)
 {
-	struct nouveau_client_bo_map *bomap = &nouveau_client(client)->bomap;
-	struct nouveau_client_bo_map_entry *ent = bo_map_lookup(bomap, bo);
+	uint32_t hash = bo_map_hash(bo->handle);
+	struct nouveau_client_bo_map *bomap = bo_map_shard(client, hash);
+	struct nouveau_client_bo_map_entry *ent;
 	struct drm_nouveau_gem_pushbuf_bo *kref = NULL;
-	if (ent)
-		kref = ent->kref;
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+
+	mutexLock(&bomap->lock);
+	if (nvbo->kref_client == client) {
+		if (nvbo->kref_push == push)
+			kref = nvbo->kref;
+	} else {
+		ent = bo_map_lookup(bomap, bo, hash);
+		if (ent && ent->push == push)
+			kref = ent->kref;
+	}
+	mutexUnlock(&bomap->lock);
 	return kref;
 }
 
 struct nouveau_pushbuf *
 cli_push_get(struct nouveau_client *client, struct nouveau_bo *bo)
 {
-	struct nouveau_client_bo_map *bomap = &nouveau_client(client)->bomap;
-	struct nouveau_client_bo_map_entry *ent = bo_map_lookup(bomap, bo);
+	uint32_t hash = bo_map_hash(bo->handle);
+	struct nouveau_client_bo_map *bomap = bo_map_shard(client, hash);
+	struct nouveau_client_bo_map_entry *ent;
 	struct nouveau_pushbuf *push = NULL;
-	if (ent)
-		push = ent->push;
-	return push;
-}
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
 
-static struct nouveau_client_bo_map_entry *bo_map_get_free(struct nouveau_client_bo_map *bomap)
-{
-	// Try to find an entry first in the bucket of free entries,
-	// and if said bucket is empty then allocate a new entry
-	struct nouveau_client_bo_map_entry *ent = bomap->buckets[BO_MAP_NUM_BUCKETS];
-	if (ent)
-		bomap->buckets[BO_MAP_NUM_BUCKETS] = ent->next;
-	else
-		ent = malloc(sizeof(*ent));
-	return ent;
+	mutexLock(&bomap->lock);
+	if (nvbo->kref_client == client) {
+		push = nvbo->kref_push;
+	} else {
+		ent = bo_map_lookup(bomap, bo, hash);
+		if (ent)
+			push = ent->push;
+	}
+	mutexUnlock(&bomap->lock);
+	return push;
 }
 
 void
@@ -79,32 +169,62 @@ cli_kref_set(struct nouveau_client *client, struct nouveau_bo *bo,
              struct drm_nouveau_gem_pushbuf_bo *kref,
              struct nouveau_pushbuf *push)
 {
-	struct nouveau_client_bo_map *bomap = &nouveau_client(client)->bomap;
-	struct nouveau_client_bo_map_entry *ent = bo_map_lookup(bomap, bo);
+	uint32_t hash = bo_map_hash(bo->handle);
+	struct nouveau_client_bo_map *bomap = bo_map_shard(client, hash);
+	struct nouveau_client_bo_map_entry *ent;
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+	uint32_t size, i;
 
 	TRACE("setting 0x%x <-- {%p,%p}\n", bo->handle, kref, push);
 
+	mutexLock(&bomap->lock);
+
+	// The per-bo slot is used unless another client already owns it
+	if (nvbo->kref_client != client && (kref || push) &&
+	    __sync_bool_compare_and_swap(&nvbo->kref_client, NULL, client)) {
+		// Drop any entry made while the slot was owned by someone else
+		ent = bo_map_lookup(bomap, bo, hash);
+		if (ent)
+			bo_map_remove(bomap, ent);
+	}
+
+	if (nvbo->kref_client == client) {
+		if (!kref && !push) {
+			bo_slot_release(nvbo);
+		} else {
+			// pushbuf_kref() checks kref_push on both sides of
+			// its unlocked read of kref
+			nvbo->kref_push = NULL;
+			__sync_synchronize();
+			nvbo->kref = kref;
+			__sync_synchronize();
+			nvbo->kref_push = push;
+		}
+		mutexUnlock(&bomap->lock);
+		return;
+	}
+
+	ent = bo_map_lookup(bomap, bo, hash);
 	if (!ent) {
 		// Do nothing if the user wanted to free the entry anyway
 		if (!kref && !push)
-			return;
+			goto out;
 
-		// Try to get a free entry for this bo
-		ent = bo_map_get_free(bomap);
-		if (!ent) {
+		// Keep the load factor at or below one half
+		size = bomap->entries ? bomap->mask + 1 : 0;
+		if ((bomap->count + 1) * 2 > size &&
+		    bo_map_resize(bomap, size ? size * 2 : BO_MAP_MIN_SIZE)) {
 			// Shouldn't we panic here?
 			TRACE("panic: out of memory\n");
-			return;
+			goto out;
 		}
 
-		// Add entry to bucket list
-		unsigned hash = bo_map_hash(bo);
-		ent->next = bomap->buckets[hash];
-		if (ent->next)
-			ent->next->prev_next = &ent->next;
-		ent->prev_next = &bomap->buckets[hash];
+		// Claim the first free slot along the probe sequence
+		for (i = hash & bomap->mask;
+		     bomap->entries[i].bo_handle; i = (i + 1) & bomap->mask);
+		ent = &bomap->entries[i];
 		ent->bo_handle = bo->handle;
-		bomap->buckets[hash] = ent;
+		bomap->count++;
 	}
 
 	if (kref || push) {
@@ -113,11 +233,33 @@ cli_kref_set(struct nouveau_client *client, struct nouveau_bo *bo,
 		ent->push = push;
 	}
 	else {
-		// Unlink the entry, and put it in the bucket of free entries
-		*ent->prev_next = ent->next;
-		if (ent->next)
-			ent->next->prev_next = ent->prev_next;
-		ent->next = bomap->buckets[BO_MAP_NUM_BUCKETS];
-		bomap->buckets[BO_MAP_NUM_BUCKETS] = ent;
+		// Remove the entry from the table
+		bo_map_remove(bomap, ent);
+	}
+
+out:
+	mutexUnlock(&bomap->lock);
+}
+
+void
+cli_kref_clear(struct nouveau_client *client, struct nouveau_bo *bo,
+               struct nouveau_pushbuf *push)
+{
+	uint32_t hash = bo_map_hash(bo->handle);
+	struct nouveau_client_bo_map *bomap = bo_map_shard(client, hash);
+	struct nouveau_client_bo_map_entry *ent;
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+
+	TRACE("clearing 0x%x on %p\n", bo->handle, push);
+
+	mutexLock(&bomap->lock);
+	if (nvbo->kref_client == client) {
+		if (nvbo->kref_push == push)
+			bo_slot_release(nvbo);
+	} else {
+		ent = bo_map_lookup(bomap, bo, hash);
+		if (ent && ent->push == push)
+			bo_map_remove(bomap, ent);
 	}
+	mutexUnlock(&bomap->lock);
 }
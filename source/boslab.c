@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <malloc.h>
+#include "private.h"
+
+#ifdef DEBUG
+#	define TRACE(x...) printf("nouveau: " x)
+#	define CALLED() TRACE("CALLED: %s\n", __PRETTY_FUNCTION__)
+#else
+#	define TRACE(x...)
+# define CALLED()
+#endif
+
+int
+bo_slab_class(uint32_t align, uint64_t size, NvKind kind)
+{
+	int shift = BO_SLAB_MIN_SHIFT;
+
+	if (size > (1 << BO_SLAB_MAX_SHIFT))
+		return -1;
+	if (kind != NvKind_Pitch && kind != NvKind_Generic_16BX2)
+		return -1;
+
+	while ((1ULL << shift) < size)
+		shift++;
+
+	if (kind == NvKind_Generic_16BX2 && (1U << shift) < BO_SLAB_GOB_SIZE)
+		shift = ffs(BO_SLAB_GOB_SIZE) - 1;
+
+	// Slots are only naturally aligned up to the page size of the slab
+	if (align > (1U << shift) || align > 0x1000)
+		return -1;
+
+	return shift - BO_SLAB_MIN_SHIFT;
+}
+
+/* Gives the slab the lowest id not taken by another live slab */
+static int
+bo_slab_id_get(struct nouveau_device_priv *nvdev, struct nouveau_bo_slab *slab)
+{
+	struct nouveau_bo_slab **ids;
+	uint32_t i, nr;
+
+	for (i = 0; i < nvdev->nr_slab_ids; i++) {
+		if (!nvdev->slab_ids[i])
+			goto out;
+	}
+
+	if (nvdev->nr_slab_ids == BO_SLAB_MAX_IDS)
+		return -ENOMEM;
+
+	nr = nvdev->nr_slab_ids ? nvdev->nr_slab_ids * 2 : 16;
+	if (nr > BO_SLAB_MAX_IDS)
+		nr = BO_SLAB_MAX_IDS;
+	if (!(ids = realloc(nvdev->slab_ids, nr * sizeof(*ids))))
+		return -ENOMEM;
+	memset(ids + nvdev->nr_slab_ids, 0, (nr - nvdev->nr_slab_ids) * sizeof(*ids));
+	nvdev->slab_ids = ids;
+	nvdev->nr_slab_ids = nr;
+
+out:
+	nvdev->slab_ids[i] = slab;
+	slab->id = i;
+	return 0;
+}
+
+static struct nouveau_bo_slab *
+bo_slab_new(struct nouveau_device_priv *nvdev, int cls, uint32_t flags, NvKind kind)
+{
+	struct nouveau_bo_slab *slab;
+	unsigned i;
+	Result rc;
+
+	if (!(slab = calloc(1, sizeof(*slab))))
+		return NULL;
+
+	if (bo_slab_id_get(nvdev, slab)) {
+		free(slab);
+		return NULL;
+	}
+
+	slab->mem = memalign(0x1000, BO_SLAB_SIZE);
+	if (!slab->mem) {
+		nvdev->slab_ids[slab->id] = NULL;
+		free(slab);
+		return NULL;
+	}
+
+	rc = nvMapCreate(&slab->map, slab->mem, BO_SLAB_SIZE, 0x1000, kind,
+			 !!(flags & NOUVEAU_BO_CACHED));
+	if (R_FAILED(rc)) {
+		TRACE("Failed to create nvmap object for slab (%x)\n", rc);
+		nvdev->slab_ids[slab->id] = NULL;
+		free(slab->mem);
+		free(slab);
+		return NULL;
+	}
+
+	rc = nvAddressSpaceMap(&nvdev->addr_space, nvMapGetHandle(&slab->map),
+	                       !(flags & NOUVEAU_BO_COHERENT), kind, &slab->offset);
+	if (R_FAILED(rc)) {
+		TRACE("Failed to map slab to address space (%x)\n", rc);
+		nvdev->slab_ids[slab->id] = NULL;
+		nvMapClose(&slab->map);
+		free(slab->mem);
+		free(slab);
+		return NULL;
+	}
+
+	slab->kind = kind;
+	slab->flags = flags & BO_ATTR_MASK;
+	slab->slot_size = 1 << (cls + BO_SLAB_MIN_SHIFT);
+	slab->nr_slots = BO_SLAB_SIZE / slab->slot_size;
+	slab->nr_free = slab->nr_slots;
+	for (i = 0; i < slab->nr_slots; i++)
+		slab->free[i / 32] |= 1 << (i % 32);
+
+	TRACE("New slab for class %d (kind 0x%x) at 0x%llx\n", cls, kind,
+	      (unsigned long long)slab->offset);
+	return slab;
+}
+
+static void
+bo_slab_del(struct nouveau_device_priv *nvdev, struct nouveau_bo_slab *slab)
+{
+	nvdev->slab_ids[slab->id] = NULL;
+	nvAddressSpaceUnmap(&nvdev->addr_space, slab->offset);
+	nvMapClose(&slab->map);
+	free(slab->mem);
+	free(slab);
+}
+
+int
+bo_slab_alloc(struct nouveau_device *dev, int cls, uint32_t flags, NvKind kind,
+              struct nouveau_bo_priv *nvbo)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	drmMMListHead *list = &nvdev->slabs[cls];
+	struct nouveau_bo_slab *slab = NULL;
+	drmMMListHead *item;
+	unsigned i;
+	int slot;
+
+	mutexLock(&nvdev->bo_lock);
+
+	// Partially used slabs are kept at the front of the list
+	DRMLISTFOREACH(item, list) {
+		struct nouveau_bo_slab *tmp = DRMLISTENTRY(struct nouveau_bo_slab, item, head);
+		if (!tmp->nr_free)
+			break;
+		if (tmp->kind == kind && tmp->flags == (flags & BO_ATTR_MASK)) {
+			slab = tmp;
+			break;
+		}
+	}
+
+	if (!slab) {
+		slab = bo_slab_new(nvdev, cls, flags, kind);
+		if (!slab) {
+			mutexUnlock(&nvdev->bo_lock);
+			return -ENOMEM;
+		}
+		DRMLISTADD(&slab->head, list);
+	}
+
+	for (i = 0; !slab->free[i]; i++);
+	slot = i * 32 + ffs(slab->free[i]) - 1;
+	slab->free[i] &= ~(1 << (slot % 32));
+
+	if (!--slab->nr_free) {
+		DRMLISTDEL(&slab->head);
+		DRMLISTADDTAIL(&slab->head, list);
+	}
+
+	nvbo->slab = slab;
+	nvbo->map_addr = (char *)slab->mem + slot * slab->slot_size;
+	nvbo->base.offset = slab->offset + slot * slab->slot_size;
+	nvbo->base.size = slab->slot_size;
+	nvbo->base.handle = BO_SLAB_HANDLE_BIT | (slab->id << BO_SLAB_SLOT_BITS) | slot;
+
+	mutexUnlock(&nvdev->bo_lock);
+	return 0;
+}
+
+void
+bo_slab_free(struct nouveau_bo_priv *nvbo)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(nvbo->base.device);
+	struct nouveau_bo_slab *slab = nvbo->slab;
+	unsigned slot = ((char *)nvbo->map_addr - (char *)slab->mem) / slab->slot_size;
+	int cls = ffs(slab->slot_size) - 1 - BO_SLAB_MIN_SHIFT;
+	drmMMListHead *item;
+
+	mutexLock(&nvdev->bo_lock);
+
+	slab->free[slot / 32] |= 1 << (slot % 32);
+	if (!slab->nr_free++) {
+		DRMLISTDEL(&slab->head);
+		DRMLISTADD(&slab->head, &nvdev->slabs[cls]);
+	}
+
+	// Keep a single empty slab around per class to avoid thrashing
+	if (slab->nr_free == slab->nr_slots) {
+		DRMLISTFOREACH(item, &nvdev->slabs[cls]) {
+			struct nouveau_bo_slab *tmp = DRMLISTENTRY(struct nouveau_bo_slab, item, head);
+			if (tmp != slab && tmp->nr_free == tmp->nr_slots) {
+				DRMLISTDEL(&slab->head);
+				bo_slab_del(nvdev, slab);
+				break;
+			}
+		}
+	}
+
+	mutexUnlock(&nvdev->bo_lock);
+	nvbo->slab = NULL;
+}
+
+void
+bo_slab_fini(struct nouveau_device *dev)
+{
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	struct nouveau_bo_slab *slab, *tmp;
+	int cls;
+
+	for (cls = 0; cls < BO_SLAB_NUM_CLASSES; cls++) {
+		DRMLISTFOREACHENTRYSAFE(slab, tmp, &nvdev->slabs[cls], head) {
+			DRMLISTDEL(&slab->head);
+			bo_slab_del(nvdev, slab);
+		}
+	}
+	free(nvdev->slab_ids);
+}
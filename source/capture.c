@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include "private.h"
+
+#ifdef DEBUG
+#	define TRACE(x...) printf("nouveau: " x)
+#	define CALLED() TRACE("CALLED: %s\n", __PRETTY_FUNCTION__)
+#else
+#	define TRACE(x...)
+# define CALLED()
+#endif
+
+/* A capture is a header followed by records.  Region records describe
+ * GPU memory referenced by submissions, with its contents the first time
+ * it is seen and again after the CPU wrote it (or every time with
+ * NOUVEAU_CAPTURE_SNAPSHOT), submit records hold the command data of a
+ * submission and the fence it signalled.  Slab bos are recorded as their
+ * whole slab so regions never share pages.  Regions of bos freed during
+ * the capture may overlap those of later ones.
+ */
+#define CAPTURE_MAGIC "NVCAPTR"
+#define CAPTURE_VERSION 1
+
+enum {
+	CAPTURE_REC_REGION = 1,
+	CAPTURE_REC_SUBMIT = 2,
+};
+
+#define CAPTURE_SUBMIT_FLUSH 0x00000001
+
+/* Regions are mapped again with small pages, bos are at least aligned to them */
+#define REPLAY_PAGE 0x1000
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+};
+
+struct capture_rec {
+	uint32_t type;
+	uint32_t pad;
+	uint64_t size;
+};
+
+struct capture_region {
+	uint64_t iova;
+	uint64_t size;
+	uint32_t kind;
+	uint32_t has_data;
+};
+
+struct capture_submit {
+	uint64_t time_ns;
+	uint32_t fence_id;
+	uint32_t fence_value;
+	uint32_t flags;
+	uint32_t nr_push;
+};
+
+int
+nouveau_device_capture_begin(struct nouveau_device *dev, const char *path,
+			     uint32_t flags)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	struct capture_header hdr = { CAPTURE_MAGIC, CAPTURE_VERSION, flags };
+	FILE *file;
+
+	mutexLock(&nvdev->capture_lock);
+	if (nvdev->capture) {
+		mutexUnlock(&nvdev->capture_lock);
+		return -EBUSY;
+	}
+
+	file = fopen(path, "wb");
+	if (!file) {
+		mutexUnlock(&nvdev->capture_lock);
+		return -errno;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
+		fclose(file);
+		mutexUnlock(&nvdev->capture_lock);
+		return -EIO;
+	}
+
+	// Bump the session id so every region gets recorded again
+	nvdev->capture_id++;
+	nvdev->capture_flags = flags;
+	nvdev->capture = file;
+	mutexUnlock(&nvdev->capture_lock);
+	return 0;
+}
+
+void
+nouveau_device_capture_end(struct nouveau_device *dev)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+
+	mutexLock(&nvdev->capture_lock);
+	if (nvdev->capture) {
+		fclose(nvdev->capture);
+		nvdev->capture = NULL;
+	}
+	mutexUnlock(&nvdev->capture_lock);
+}
+
+static void
+capture_write_region(FILE *file, uint64_t iova, uint64_t size, NvKind kind,
+		     const void *data)
+{
+	struct capture_region reg = { iova, size, kind, data != NULL };
+	struct capture_rec rec = { CAPTURE_REC_REGION, 0, sizeof(reg) + (data ? size : 0) };
+
+	fwrite(&rec, sizeof(rec), 1, file);
+	fwrite(&reg, sizeof(reg), 1, file);
+	if (data)
+		fwrite(data, size, 1, file);
+}
+
+void
+capture_refs(struct nouveau_device *dev, struct drm_nouveau_gem_pushbuf_bo *kref,
+	     int nr)
+{
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	bool snapshot;
+	int i;
+
+	mutexLock(&nvdev->capture_lock);
+	if (!nvdev->capture) {
+		mutexUnlock(&nvdev->capture_lock);
+		return;
+	}
+
+	snapshot = nvdev->capture_flags & NOUVEAU_CAPTURE_SNAPSHOT;
+	for (i = 0; i < nr; i++, kref++) {
+		struct nouveau_bo_priv *nvbo = nouveau_bo(kref->bo);
+		struct nouveau_bo_slab *slab = nvbo->slab;
+
+		if (slab) {
+			if (slab->capture_id == nvdev->capture_id && !snapshot &&
+			    slab->capture_seq == slab->cpu_write_seq)
+				continue;
+			slab->capture_id = nvdev->capture_id;
+			slab->capture_seq = slab->cpu_write_seq;
+			capture_write_region(nvdev->capture, slab->offset, BO_SLAB_SIZE,
+					     slab->kind, slab->mem);
+		} else {
+			if (nvbo->capture_id == nvdev->capture_id && !snapshot &&
+			    nvbo->capture_seq == nvbo->cpu_write_seq)
+				continue;
+			nvbo->capture_id = nvdev->capture_id;
+			nvbo->capture_seq = nvbo->cpu_write_seq;
+			capture_write_region(nvdev->capture, nvbo->base.offset, nvbo->base.size,
+					     nvbo->kind, nvbo->map_addr);
+		}
+	}
+
+	mutexUnlock(&nvdev->capture_lock);
+}
+
+void
+capture_submit(struct nouveau_device *dev, struct drm_nouveau_gem_pushbuf_bo *buffer,
+	       struct drm_nouveau_gem_pushbuf_push *kpsh, int nr_push,
+	       bool flush, NvFence *fence)
+{
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	struct capture_submit sub;
+	struct capture_rec rec = { CAPTURE_REC_SUBMIT, 0, sizeof(sub) };
+	int i;
+
+	mutexLock(&nvdev->capture_lock);
+	if (!nvdev->capture) {
+		mutexUnlock(&nvdev->capture_lock);
+		return;
+	}
+
+	sub.time_ns = armTicksToNs(armGetSystemTick());
+	sub.fence_id = fence->id;
+	sub.fence_value = fence->value;
+	sub.flags = flush ? CAPTURE_SUBMIT_FLUSH : 0;
+	sub.nr_push = nr_push;
+	for (i = 0; i < nr_push; i++)
+		rec.size += sizeof(uint32_t) + kpsh[i].length;
+
+	fwrite(&rec, sizeof(rec), 1, nvdev->capture);
+	fwrite(&sub, sizeof(sub), 1, nvdev->capture);
+	for (i = 0; i < nr_push; i++) {
+		struct nouveau_bo_priv *nvbo = nouveau_bo(buffer[kpsh[i].bo_index].bo);
+		uint32_t length = kpsh[i].length;
+
+		fwrite(&length, sizeof(length), 1, nvdev->capture);
+		fwrite((char *)nvbo->map_addr + kpsh[i].offset, length, 1, nvdev->capture);
+	}
+
+	mutexUnlock(&nvdev->capture_lock);
+}
+
+struct replay_region {
+	uint64_t iova;
+	uint64_t size;
+	void *mem;
+	NvMap map;
+};
+
+struct replay_span {
+	uint64_t start;
+	uint64_t end;
+};
+
+struct replay {
+	struct nouveau_device_priv *nvdev;
+	FILE *file;
+	struct replay_region *regions;
+	int nr_regions;
+	int max_regions;
+	struct replay_span *spans;
+	int nr_spans;
+	int max_spans;
+	int nr_reserved;
+	uint64_t max_push;
+	struct nouveau_fence fence;
+};
+
+static int
+replay_read(struct replay *rp, void *data, uint64_t size)
+{
+	if (size && fread(data, size, 1, rp->file) != 1)
+		return -EIO;
+	return 0;
+}
+
+static int
+replay_span_add(struct replay *rp, uint64_t start, uint64_t end)
+{
+	struct replay_span *span;
+
+	if (rp->nr_spans == rp->max_spans) {
+		int max = rp->max_spans ? rp->max_spans * 2 : 64;
+		span = realloc(rp->spans, max * sizeof(*span));
+		if (!span)
+			return -ENOMEM;
+		rp->spans = span;
+		rp->max_spans = max;
+	}
+
+	rp->spans[rp->nr_spans++] = (struct replay_span){ start, end };
+	return 0;
+}
+
+static int
+replay_span_cmp(const void *a, const void *b)
+{
+	const struct replay_span *x = a, *y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Sorts the pages used by regions and merges them into disjoint spans */
+static void
+replay_span_merge(struct replay *rp)
+{
+	int i, nr = 0;
+
+	qsort(rp->spans, rp->nr_spans, sizeof(*rp->spans), replay_span_cmp);
+	for (i = 0; i < rp->nr_spans; i++) {
+		if (nr && rp->spans[i].start <= rp->spans[nr - 1].end) {
+			if (rp->spans[i].end > rp->spans[nr - 1].end)
+				rp->spans[nr - 1].end = rp->spans[i].end;
+		} else
+			rp->spans[nr++] = rp->spans[i];
+	}
+	rp->nr_spans = nr;
+}
+
+/* Finds the GPU memory and the largest command range used */
+static int
+replay_scan(struct replay *rp)
+{
+	struct capture_rec rec;
+	struct capture_region reg;
+	struct capture_submit sub;
+	uint32_t length, i;
+	long pos = ftell(rp->file);
+	int ret;
+
+	while (fread(&rec, sizeof(rec), 1, rp->file) == 1) {
+		if (rec.type == CAPTURE_REC_REGION) {
+			if ((ret = replay_read(rp, &reg, sizeof(reg))))
+				return ret;
+			ret = replay_span_add(rp, reg.iova & ~(REPLAY_PAGE - 1),
+					      (reg.iova + reg.size + REPLAY_PAGE - 1) &
+					      ~(REPLAY_PAGE - 1));
+			if (ret)
+				return ret;
+			if (fseek(rp->file, rec.size - sizeof(reg), SEEK_CUR))
+				return -EIO;
+		} else if (rec.type == CAPTURE_REC_SUBMIT) {
+			if ((ret = replay_read(rp, &sub, sizeof(sub))))
+				return ret;
+			for (i = 0; i < sub.nr_push; i++) {
+				if ((ret = replay_read(rp, &length, sizeof(length))))
+					return ret;
+				if (length > rp->max_push)
+					rp->max_push = length;
+				if (fseek(rp->file, length, SEEK_CUR))
+					return -EIO;
+			}
+		} else if (fseek(rp->file, rec.size, SEEK_CUR))
+			return -EIO;
+	}
+
+	replay_span_merge(rp);
+	return fseek(rp->file, pos, SEEK_SET) ? -EIO : 0;
+}
+
+/* Reserves the captured addresses, leaving alone whatever the device has
+ * mapped in between them.
+ */
+static int
+replay_reserve(struct replay *rp)
+{
+	struct replay_span *span;
+
+	for (; rp->nr_reserved < rp->nr_spans; rp->nr_reserved++) {
+		span = &rp->spans[rp->nr_reserved];
+		if (R_FAILED(nvAddressSpaceAllocFixed(&rp->nvdev->addr_space, false,
+						      span->end - span->start, span->start))) {
+			TRACE("Failed to reserve 0x%llx-0x%llx for replay\n",
+			      (unsigned long long)span->start, (unsigned long long)span->end);
+			return -EBUSY;
+		}
+	}
+
+	return 0;
+}
+
+static void
+replay_region_put(struct replay *rp, struct replay_region *region)
+{
+	nvAddressSpaceUnmap(&rp->nvdev->addr_space, region->iova);
+	nvMapClose(&region->map);
+	free(region->mem);
+	*region = rp->regions[--rp->nr_regions];
+}
+
+static struct replay_region *
+replay_region_get(struct replay *rp, struct capture_region *reg)
+{
+	struct replay_region *region;
+	int i;
+
+	for (i = 0; i < rp->nr_regions; i++)
+		if (rp->regions[i].iova == reg->iova && rp->regions[i].size == reg->size)
+			return &rp->regions[i];
+
+	// The bos of older regions at these addresses have been freed since,
+	// drop them once the GPU is done with them
+	for (i = 0; i < rp->nr_regions; i++) {
+		region = &rp->regions[i];
+		if (region->iova < reg->iova + reg->size &&
+		    reg->iova < region->iova + region->size) {
+			nouveau_fence_wait(&rp->fence, -1);
+			replay_region_put(rp, region);
+			i--;
+		}
+	}
+
+	if (rp->nr_regions == rp->max_regions) {
+		int max = rp->max_regions ? rp->max_regions * 2 : 64;
+		region = realloc(rp->regions, max * sizeof(*region));
+		if (!region)
+			return NULL;
+		rp->regions = region;
+		rp->max_regions = max;
+	}
+
+	region = &rp->regions[rp->nr_regions];
+	region->iova = reg->iova;
+	region->size = reg->size;
+	region->mem = memalign(REPLAY_PAGE, (reg->size + REPLAY_PAGE - 1) & ~(REPLAY_PAGE - 1));
+	if (!region->mem)
+		return NULL;
+
+	if (R_FAILED(nvMapCreate(&region->map, region->mem,
+				 (reg->size + REPLAY_PAGE - 1) & ~(REPLAY_PAGE - 1),
+				 REPLAY_PAGE, reg->kind, false))) {
+		free(region->mem);
+		return NULL;
+	}
+
+	if (R_FAILED(nvAddressSpaceMapFixed(&rp->nvdev->addr_space, nvMapGetHandle(&region->map),
+					    true, reg->kind, reg->iova))) {
+		TRACE("Failed to map replay region at 0x%llx\n", (unsigned long long)reg->iova);
+		nvMapClose(&region->map);
+		free(region->mem);
+		return NULL;
+	}
+
+	rp->nr_regions++;
+	return region;
+}
+
+static int
+replay_region(struct replay *rp, struct capture_rec *rec)
+{
+	struct capture_region reg;
+	struct replay_region *region;
+	int ret;
+
+	if ((ret = replay_read(rp, &reg, sizeof(reg))))
+		return ret;
+
+	region = replay_region_get(rp, &reg);
+	if (!region)
+		return -ENOMEM;
+
+	if (!reg.has_data)
+		return 0;
+
+	// Snapshots replace contents the GPU may still be using
+	nouveau_fence_wait(&rp->fence, -1);
+	return replay_read(rp, region->mem, reg.size);
+}
+
+static int
+replay_submit(struct replay *rp, struct nouveau_pushbuf *push,
+	      struct nouveau_capture_stats *stats, uint32_t flags)
+{
+	struct capture_submit sub;
+	uint64_t start = armGetSystemTick();
+	uint32_t length, i;
+	int ret;
+
+	if ((ret = replay_read(rp, &sub, sizeof(sub))))
+		return ret;
+
+	for (i = 0; i < sub.nr_push; i++) {
+		if ((ret = replay_read(rp, &length, sizeof(length))))
+			return ret;
+		if ((ret = nouveau_pushbuf_space(push, length / 4, 0, 0)))
+			return ret;
+		if ((ret = replay_read(rp, push->cur, length)))
+			return ret;
+		push->cur += length / 4;
+		stats->dwords += length / 4;
+	}
+
+	if (sub.flags & CAPTURE_SUBMIT_FLUSH)
+		nouveau_pushbuf_invalidate(push);
+
+	ret = nouveau_pushbuf_kick_fence(push, push->channel, &rp->fence);
+	if (ret)
+		return ret;
+
+	stats->cpu_ns += armTicksToNs(armGetSystemTick() - start);
+	stats->submits++;
+
+	if (flags & NOUVEAU_REPLAY_SYNC)
+		nouveau_fence_wait(&rp->fence, -1);
+	return 0;
+}
+
+int
+nouveau_capture_replay(struct nouveau_device *dev, const char *path,
+		       uint32_t flags, struct nouveau_capture_stats *stats)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	struct replay rp = { .nvdev = nvdev, .fence = { NOUVEAU_FENCE_NONE, 0 } };
+	struct nouveau_client *client = NULL;
+	struct nouveau_object *chan = NULL;
+	struct nouveau_pushbuf *push = NULL;
+	struct capture_header hdr;
+	struct capture_rec rec;
+	uint64_t start;
+	int ret, i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	rp.file = fopen(path, "rb");
+	if (!rp.file)
+		return -errno;
+
+	if (fread(&hdr, sizeof(hdr), 1, rp.file) != 1 ||
+	    memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != CAPTURE_VERSION) {
+		fclose(rp.file);
+		return -EINVAL;
+	}
+
+	ret = replay_scan(&rp);
+	if (ret)
+		goto out;
+
+	// The captured addresses have to be free in this address space
+	ret = replay_reserve(&rp);
+	if (ret)
+		goto out;
+
+	ret = nouveau_client_new(dev, &client);
+	if (!ret)
+		ret = nouveau_object_new(&dev->object, 0, NOUVEAU_FIFO_CHANNEL_CLASS,
+					 NULL, 0, &chan);
+	if (!ret)
+		ret = nouveau_pushbuf_new(client, chan, 2, (rp.max_push + 0x10FFF) & ~0xFFF,
+					  true, &push);
+	if (ret)
+		goto out;
+
+	start = armGetSystemTick();
+	while (!ret && fread(&rec, sizeof(rec), 1, rp.file) == 1) {
+		if (rec.type == CAPTURE_REC_REGION)
+			ret = replay_region(&rp, &rec);
+		else if (rec.type == CAPTURE_REC_SUBMIT)
+			ret = replay_submit(&rp, push, stats, flags);
+		else if (fseek(rp.file, rec.size, SEEK_CUR))
+			ret = -EIO;
+	}
+
+	nouveau_fence_wait(&rp.fence, -1);
+	stats->total_ns = armTicksToNs(armGetSystemTick() - start);
+
+out:
+	nouveau_fence_wait(&rp.fence, -1);
+	nouveau_pushbuf_del(&push);
+	nouveau_object_del(&chan);
+	nouveau_client_del(&client);
+	while (rp.nr_regions)
+		replay_region_put(&rp, &rp.regions[0]);
+	free(rp.regions);
+	for (i = 0; i < rp.nr_reserved; i++)
+		nvAddressSpaceFree(&nvdev->addr_space, rp.spans[i].start,
+				   rp.spans[i].end - rp.spans[i].start);
+	free(rp.spans);
+	fclose(rp.file);
+	return ret;
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "private.h"
+
+#ifdef DEBUG
+#	define TRACE(x...) printf("nouveau: " x)
+#	define CALLED() TRACE("CALLED: %s\n", __PRETTY_FUNCTION__)
+#else
+#	define TRACE(x...)
+# define CALLED()
+#endif
+
+#define COPY_PUSHBUF_SIZE 0x8000
+
+/* Must be called with the copy lock held */
+static int
+bo_copy_init(struct nouveau_device_priv *nvdev)
+{
+	int ret;
+
+	if (nvdev->copy_push)
+		return 0;
+
+	ret = nouveau_client_new(&nvdev->base, &nvdev->copy_client);
+	if (ret)
+		return ret;
+
+	ret = nouveau_object_new(&nvdev->base.object, 0, NOUVEAU_FIFO_CHANNEL_CLASS,
+				 NULL, 0, &nvdev->copy_chan);
+	if (ret)
+		goto fail;
+
+	ret = nouveau_pushbuf_new(nvdev->copy_client, nvdev->copy_chan, 1,
+				  COPY_PUSHBUF_SIZE, true, &nvdev->copy_push);
+	if (ret)
+		goto fail;
+
+	return 0;
+
+fail:
+	TRACE("Failed to create the copy channel (%d)\n", ret);
+	nouveau_object_del(&nvdev->copy_chan);
+	nouveau_client_del(&nvdev->copy_client);
+	return ret;
+}
+
+void
+bo_copy_fini(struct nouveau_device *dev)
+{
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+
+	nouveau_pushbuf_del(&nvdev->copy_push);
+	nouveau_object_del(&nvdev->copy_chan);
+	nouveau_client_del(&nvdev->copy_client);
+}
+
+/* Bos only carry the fences of submitted work, commands still recorded on
+ * an immediate pushbuf would end up ordered after the copy.
+ */
+static inline int
+bo_copy_check(struct nouveau_bo *bo)
+{
+	return atomic_read(&nouveau_bo(bo)->pending_refs) ? -EBUSY : 0;
+}
+
+static int
+bo_copy_kick(struct nouveau_pushbuf *push, struct nouveau_fence *fence)
+{
+	struct nouveau_fence tmp;
+	return nouveau_pushbuf_kick_fence(push, push->channel, fence ? fence : &tmp);
+}
+
+int
+nouveau_bo_copy(struct nouveau_bo *dst, uint64_t dst_offset,
+		struct nouveau_bo *src, uint64_t src_offset, uint64_t size,
+		struct nouveau_fence *fence)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dst->device);
+	struct nouveau_pushbuf *push;
+	int ret;
+
+	if (dst_offset > dst->size || size > dst->size - dst_offset ||
+	    src_offset > src->size || size > src->size - src_offset)
+		return -EINVAL;
+	if (bo_copy_check(src) || bo_copy_check(dst))
+		return -EBUSY;
+
+	mutexLock(&nvdev->copy_lock);
+
+	ret = bo_copy_init(nvdev);
+	if (ret)
+		goto out;
+	push = nvdev->copy_push;
+
+	ret = pushbuf_wait_bo(push, src, false);
+	if (!ret)
+		ret = pushbuf_wait_bo(push, dst, true);
+	if (!ret)
+		ret = pushbuf_copy(push, dst, dst_offset, src, src_offset, size);
+	if (!ret)
+		ret = bo_copy_kick(push, fence);
+
+out:
+	mutexUnlock(&nvdev->copy_lock);
+	return ret;
+}
+
+int
+nouveau_bo_fill(struct nouveau_bo *bo, uint64_t offset, uint64_t size,
+		uint32_t value, struct nouveau_fence *fence)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(bo->device);
+	struct nouveau_pushbuf *push;
+	int ret;
+
+	if (offset > bo->size || size > bo->size - offset)
+		return -EINVAL;
+	if (bo_copy_check(bo))
+		return -EBUSY;
+
+	mutexLock(&nvdev->copy_lock);
+
+	ret = bo_copy_init(nvdev);
+	if (ret)
+		goto out;
+	push = nvdev->copy_push;
+
+	ret = pushbuf_wait_bo(push, bo, true);
+	if (!ret)
+		ret = pushbuf_fill(push, bo, offset, size, value);
+	if (!ret)
+		ret = bo_copy_kick(push, fence);
+
+out:
+	mutexUnlock(&nvdev->copy_lock);
+	return ret;
+}
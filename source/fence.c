@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "private.h"
+
+#ifdef DEBUG
+#	define TRACE(x...) printf("nouveau: " x)
+#	define CALLED() TRACE("CALLED: %s\n", __PRETTY_FUNCTION__)
+#else
+#	define TRACE(x...)
+# define CALLED()
+#endif
+
+/* Longest single nvFenceWait when waiting for any of several syncpoints,
+ * which bounds how late a signal is noticed.
+ */
+#define FENCE_WAIT_SLICE_US 100
+
+/* Fences merged per syncpoint on the stack, larger sets are allocated */
+#define FENCE_MERGE_STACK 16
+
+static inline bool
+fence_none(const struct nouveau_fence *fence)
+{
+	return fence->id == NOUVEAU_FENCE_NONE;
+}
+
+static inline s32
+fence_timeout_us(int64_t timeout_ns)
+{
+	if (timeout_ns < 0)
+		return -1;
+	if (timeout_ns / 1000 > INT32_MAX)
+		return INT32_MAX;
+	return timeout_ns / 1000;
+}
+
+static inline int64_t
+fence_remaining_ns(uint64_t deadline)
+{
+	uint64_t now = armGetSystemTick();
+	return now < deadline ? (int64_t)armTicksToNs(deadline - now) : 0;
+}
+
+static int
+fence_wait_us(const struct nouveau_fence *fence, s32 timeout_us)
+{
+	NvFence nvfence = { fence->id, fence->value };
+	Result rc;
+
+	if (fence_none(fence))
+		return 0;
+
+	TRACE("waiting on fence {%d,%u} for %dus\n", (int)fence->id, fence->value, (int)timeout_us);
+	rc = nvFenceWait(&nvfence, timeout_us);
+	if (rc == MAKERESULT(Module_LibnxNvidia, LibnxNvidiaError_Timeout))
+		return -ETIMEDOUT;
+	if (R_FAILED(rc))
+		return -rc;
+	return 0;
+}
+
+int
+nouveau_fence_cmp(const struct nouveau_fence *a, const struct nouveau_fence *b)
+{
+	if (a->id != b->id)
+		return a->id < b->id ? -1 : 1;
+	if (a->value == b->value)
+		return 0;
+	return (s32)(a->value - b->value) < 0 ? -1 : 1;
+}
+
+int
+nouveau_fence_merge(const struct nouveau_fence *a, const struct nouveau_fence *b,
+		    struct nouveau_fence *out)
+{
+	if (fence_none(a)) {
+		*out = *b;
+		return 0;
+	}
+	if (fence_none(b)) {
+		*out = *a;
+		return 0;
+	}
+	if (a->id != b->id)
+		return -EINVAL;
+
+	*out = nouveau_fence_cmp(a, b) >= 0 ? *a : *b;
+	return 0;
+}
+
+bool
+nouveau_fence_signaled(const struct nouveau_fence *fence)
+{
+	return fence_wait_us(fence, 0) == 0;
+}
+
+int
+nouveau_fence_wait(const struct nouveau_fence *fence, int64_t timeout_ns)
+{
+	CALLED();
+	return fence_wait_us(fence, fence_timeout_us(timeout_ns));
+}
+
+/* Polls all fences, then blocks on each in turn for a bounded slice */
+static int
+fence_wait_any(const struct nouveau_fence *fences, const int *idx, int nr,
+	       int64_t timeout_ns, int *index)
+{
+	uint64_t deadline = 0;
+	int i, next = 0, ret;
+	s32 slice;
+
+	// Fences on a single syncpoint can be waited for exactly
+	if (nr == 1) {
+		ret = fence_wait_us(&fences[0], fence_timeout_us(timeout_ns));
+		if (!ret && index)
+			*index = idx[0];
+		return ret;
+	}
+
+	if (timeout_ns > 0)
+		deadline = armGetSystemTick() + armNsToTicks(timeout_ns);
+
+	for (;;) {
+		for (i = 0; i < nr; i++) {
+			ret = fence_wait_us(&fences[i], 0);
+			if (ret != -ETIMEDOUT)
+				goto done;
+		}
+
+		if (!timeout_ns)
+			return -ETIMEDOUT;
+
+		slice = FENCE_WAIT_SLICE_US;
+		if (timeout_ns > 0) {
+			int64_t remaining = fence_remaining_ns(deadline);
+			if (!remaining)
+				return -ETIMEDOUT;
+			if (fence_timeout_us(remaining) < slice)
+				slice = fence_timeout_us(remaining);
+		}
+
+		i = next;
+		next = (next + 1) % nr;
+		ret = fence_wait_us(&fences[i], slice);
+		if (ret != -ETIMEDOUT)
+			goto done;
+	}
+
+done:
+	if (!ret && index)
+		*index = idx[i];
+	return ret;
+}
+
+/* Fences on the same syncpoint signal in order, so only the last one of
+ * each syncpoint needs waiting for when waiting for all of them, and the
+ * first one when waiting for any.  Fences on the same syncpoint are merged
+ * first, with idx[] keeping their index in the caller's array.
+ */
+int
+nouveau_fence_wait_many(const struct nouveau_fence *fences, int nr,
+			bool wait_all, int64_t timeout_ns, int *index)
+{
+	CALLED();
+	struct nouveau_fence stack[FENCE_MERGE_STACK], *merged = stack;
+	int stack_idx[FENCE_MERGE_STACK], *idx = stack_idx;
+	uint64_t deadline = 0;
+	int nr_merged = 0, i, j, ret = 0;
+
+	if (!fences || nr <= 0)
+		return -EINVAL;
+
+	if (nr > FENCE_MERGE_STACK) {
+		merged = malloc(nr * sizeof(*merged));
+		idx = malloc(nr * sizeof(*idx));
+		if (!merged || !idx) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (fence_none(&fences[i])) {
+			if (wait_all)
+				continue;
+			if (index)
+				*index = i;
+			goto out;
+		}
+
+		for (j = 0; j < nr_merged; j++) {
+			if (merged[j].id == fences[i].id)
+				break;
+		}
+		if (j == nr_merged) {
+			merged[nr_merged] = fences[i];
+			idx[nr_merged++] = i;
+		} else if ((nouveau_fence_cmp(&fences[i], &merged[j]) > 0) == wait_all) {
+			merged[j] = fences[i];
+			idx[j] = i;
+		}
+	}
+
+	if (!wait_all) {
+		ret = fence_wait_any(merged, idx, nr_merged, timeout_ns, index);
+		goto out;
+	}
+
+	if (timeout_ns > 0)
+		deadline = armGetSystemTick() + armNsToTicks(timeout_ns);
+
+	for (i = 0; i < nr_merged && !ret; i++) {
+		if (timeout_ns > 0)
+			timeout_ns = fence_remaining_ns(deadline);
+		ret = fence_wait_us(&merged[i], fence_timeout_us(timeout_ns));
+	}
+
+out:
+	if (merged != stack) {
+		free(merged);
+		free(idx);
+	}
+	return ret;
+}
@@ -52,14 +52,14 @@
 # define CALLED()
 #endif
 
-/* Unused
-int
-nouveau_object_mthd(struct nouveau_object *obj,
-		    uint32_t mthd, void *data, uint32_t size)
-{
-	return 0;
-}
-*/
+/* Not wrapped by libnx, returns the GPU time in nanoseconds */
+struct nvgpu_gpu_get_gpu_time_args {
+	uint64_t gpu_timestamp;
+	uint64_t reserved;
+};
+
+#define NVGPU_GPU_IOCTL_GET_GPU_TIME \
+	_NV_IOWR(0x47, 0x1C, struct nvgpu_gpu_get_gpu_time_args)
 
 /* Unused
 void
@@ -111,6 +111,21 @@ nouveau_object_new(struct nouveau_object *parent, uint64_t handle,
 		obj->data = fifo;
 		obj->length = sizeof(*fifo);
 	}
+	else if (oclass == NVIF_CLASS_PERFMON || oclass == NVIF_CLASS_PERFDOM)
+	{
+		int ret;
+
+		obj->parent = parent;
+		obj->oclass = oclass;
+		if (oclass == NVIF_CLASS_PERFMON)
+			ret = perfmon_new(obj);
+		else
+			ret = perfdom_new(obj, data, length);
+		if (ret) {
+			free(obj);
+			return ret;
+		}
+	}
 
 	obj->parent = parent;
 	obj->oclass = oclass;
@@ -130,6 +145,10 @@ nouveau_object_del(struct nouveau_object **pobj)
 	if (!obj)
 		return;
 
+	if (obj->oclass == NVIF_CLASS_PERFMON)
+		perfmon_del(obj);
+	else if (obj->oclass == NVIF_CLASS_PERFDOM)
+		perfdom_del(obj);
 	if (obj->data)
 		free(obj->data);
 	free(obj);
@@ -167,11 +186,16 @@ nouveau_device_new(struct nouveau_object *parent, int32_t oclass,
 	struct nouveau_drm *drm = nouveau_drm(parent);
 	struct nouveau_device_priv *nvdev;
 	Result rc;
+	int i;
 	CALLED();
 
 	if (!(nvdev = calloc(1, sizeof(*nvdev))))
 		return -ENOMEM;
 	*pdev = &nvdev->base;
+	for (i = 0; i < BO_SLAB_NUM_CLASSES; i++)
+		DRMINITLISTHEAD(&nvdev->slabs[i]);
+	DRMINITLISTHEAD(&nvdev->perfdoms);
+	bo_cache_init(nvdev);
 	nvdev->base.object.parent = &drm->client;
 	nvdev->base.object.handle = ~0ULL;
 	nvdev->base.object.oclass = NOUVEAU_DEVICE_CLASS;
@@ -221,6 +245,12 @@ nouveau_device_del(struct nouveau_device **pdev)
 	struct nouveau_device_priv *nvdev = nouveau_device(*pdev);
 
 	if (nvdev) {
+		nouveau_device_capture_end(&nvdev->base);
+		bo_copy_fini(&nvdev->base);
+		bo_cache_fini(&nvdev->base);
+		bo_slab_fini(&nvdev->base);
+		if (nvdev->has_ctrl_gpu)
+			nvClose(nvdev->ctrl_gpu_fd);
 		nvAddressSpaceClose(&nvdev->addr_space);
 		nvGpuExit();
 		nvMapExit();
@@ -232,20 +262,74 @@ nouveau_device_del(struct nouveau_device **pdev)
 	}
 }
 
+static int
+device_gpu_time(struct nouveau_device *dev, uint64_t *value)
+{
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	struct nvgpu_gpu_get_gpu_time_args args = { 0 };
+	Result rc = 0;
+
+	// libnx keeps its own nvhost-ctrl-gpu handle private
+	mutexLock(&nvdev->lock);
+	if (!nvdev->has_ctrl_gpu) {
+		rc = nvOpen(&nvdev->ctrl_gpu_fd, "/dev/nvhost-ctrl-gpu");
+		nvdev->has_ctrl_gpu = R_SUCCEEDED(rc);
+	}
+	mutexUnlock(&nvdev->lock);
+	if (R_FAILED(rc)) {
+		TRACE("Failed to open nvhost-ctrl-gpu (%x)\n", rc);
+		return -rc;
+	}
+
+	rc = nvIoctl(nvdev->ctrl_gpu_fd, NVGPU_GPU_IOCTL_GET_GPU_TIME, &args);
+	if (R_FAILED(rc)) {
+		TRACE("Failed to get the GPU time (%x)\n", rc);
+		return -rc;
+	}
+
+	*value = args.gpu_timestamp;
+	return 0;
+}
+
 int
 nouveau_getparam(struct nouveau_device *dev, uint64_t param, uint64_t *value)
 {
-	/* NOUVEAU_GETPARAM_PTIMER_TIME = NVGPU_GPU_IOCTL_GET_GPU_TIME */
 	int ret = 0;
 	if (param == NOUVEAU_GETPARAM_GRAPH_UNITS)
 		*value = (16 << 8) | 4;
 	else if (param == NOUVEAU_GETPARAM_PCI_DEVICE)
 		*value = 0; // dummy
+	else if (param == NOUVEAU_GETPARAM_PTIMER_TIME)
+		ret = device_gpu_time(dev, value);
 	else
 		ret = -EINVAL;
 	return ret;
 }
 
+void
+nouveau_device_set_gpu_clear(struct nouveau_device *dev, uint64_t min_size)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+
+	nvdev->clear_min_size = min_size;
+}
+
+void
+nouveau_device_get_stats(struct nouveau_device *dev,
+			 struct nouveau_device_stats *stats)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+
+	stats->bo_allocs = __atomic_load_n(&nvdev->stats.bo_allocs, __ATOMIC_RELAXED);
+	stats->bo_frees = __atomic_load_n(&nvdev->stats.bo_frees, __ATOMIC_RELAXED);
+	stats->bo_bytes = __atomic_load_n(&nvdev->stats.bo_bytes, __ATOMIC_RELAXED);
+	stats->bo_bytes_total = __atomic_load_n(&nvdev->stats.bo_bytes_total, __ATOMIC_RELAXED);
+	stats->fence_waits = __atomic_load_n(&nvdev->stats.fence_waits, __ATOMIC_RELAXED);
+	stats->fence_wait_ns = __atomic_load_n(&nvdev->stats.fence_wait_ns, __ATOMIC_RELAXED);
+}
+
 /* Unused
 int
 nouveau_setparam(struct nouveau_device *dev, uint64_t param, uint64_t value)
@@ -306,45 +390,229 @@ nouveau_client_del(struct nouveau_client **pclient)
 		mutexLock(&nvdev->lock);
 		nvdev->client[id / 32] &= ~(1 << (id % 32));
 		mutexUnlock(&nvdev->lock);
+		cli_krec_pool_free(&pcli->base);
 		cli_map_free(&pcli->base);
 		free(pcli);
 	}
 }
 
+static inline bool
+bo_fence_none(NvFence *fence)
+{
+	return (s32)fence->id < 0;
+}
+
 static int
-nouveau_bo_fence_wait(struct nouveau_bo *bo, uint32_t access)
+bo_fence_wait_one(struct nouveau_bo_priv *nvbo, NvFence *fence, uint32_t access)
 {
-	CALLED();
-	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
-	int ret = 0;
+	struct nouveau_device_priv *nvdev = nouveau_device(nvbo->base.device);
+	uint64_t start;
+
+	if (bo_fence_none(fence))
+		return 0;
+
+	TRACE("waiting on fence {%d,%u}\n", (int)fence->id, fence->value);
+	Result res = nvFenceWait(fence, 0);
+	if (R_FAILED(res) && !(access & NOUVEAU_BO_NOBLOCK)) {
+		trace_event(TRACE_FENCE_WAIT, TRACE_BEGIN, fence->id, fence->value);
+		start = armGetSystemTick();
+		res = nvFenceWait(fence, -1);
+		trace_event(TRACE_FENCE_WAIT, TRACE_END, 0, 0);
+		__sync_add_and_fetch(&nvdev->stats.fence_waits, 1);
+		__sync_add_and_fetch(&nvdev->stats.fence_wait_ns,
+				     armTicksToNs(armGetSystemTick() - start));
+	}
+	if (R_FAILED(res))
+		return -EAGAIN;
+
+	// Reset the fence since we're done with it.
+	fence->id = UINT32_MAX;
+	fence->value = 0;
+	return 0;
+}
+
+void
+bo_fence_reset(struct nouveau_bo_priv *nvbo)
+{
+	int i;
+
+	nvbo->fence.id = UINT32_MAX;
+	for (i = 0; i < BO_MAX_WRITERS; i++)
+		nvbo->wr_fence[i].id = UINT32_MAX;
+	for (i = 0; i < BO_MAX_READERS; i++)
+		nvbo->rd_fence[i].id = UINT32_MAX;
+}
 
-	if ((s32)nvbo->fence.id >= 0) {
-		TRACE("waiting on fence {%d,%u}\n", (int)nvbo->fence.id, nvbo->fence.value);
-		Result res = nvFenceWait(&nvbo->fence, (access & NOUVEAU_BO_NOBLOCK) ? 0 : -1);
-		if (R_FAILED(res))
-			ret = -EAGAIN;
-		else {
-			// Reset the fence since we're done with it.
-			nvbo->fence.id = -1;
-			nvbo->fence.value = 0;
-
-			// TODO: Check for NOUVEAU_BO_WR - maybe we're supposed to flush cache?
+static inline bool
+bo_fence_equal(NvFence *a, NvFence *b)
+{
+	return a->id == b->id && a->value == b->value;
+}
+
+/* Returns the fences a GPU or CPU access has to wait for: the writers for
+ * a read, the readers as well for a write.  Must be called with the fence
+ * lock held, fences must have room for BO_MAX_FENCES.
+ */
+static int
+bo_fence_conflicts(struct nouveau_bo_priv *nvbo, bool write, NvFence *fences)
+{
+	int nr = 0, i;
+
+	for (i = 0; i < BO_MAX_WRITERS && !bo_fence_none(&nvbo->wr_fence[i]); i++)
+		fences[nr++] = nvbo->wr_fence[i];
+	for (i = 0; write && i < BO_MAX_READERS && !bo_fence_none(&nvbo->rd_fence[i]); i++)
+		fences[nr++] = nvbo->rd_fence[i];
+	return nr;
+}
+
+int
+bo_fence_get(struct nouveau_bo_priv *nvbo, bool write, NvFence *fences)
+{
+	int nr;
+
+	mutexLock(&nvbo->fence_lock);
+	nr = bo_fence_conflicts(nvbo, write, fences);
+	mutexUnlock(&nvbo->fence_lock);
+	return nr;
+}
+
+/* Forgets a fence that has been waited for, unless it was replaced */
+static void
+bo_fence_forget(NvFence *set, int max, NvFence *fence)
+{
+	int i;
+
+	for (i = 0; i < max; i++) {
+		if (bo_fence_equal(&set[i], fence)) {
+			memmove(&set[i], &set[i + 1], (max - i - 1) * sizeof(*set));
+			set[max - 1].id = UINT32_MAX;
+			return;
 		}
 	}
+}
+
+/* Waits for the GPU accesses that conflict with a CPU access: reads only
+ * have to wait for the writers, writes for all readers as well.  The
+ * fences are waited on unlocked, and only forgotten if no submission has
+ * replaced them in the meantime.
+ */
+int
+bo_fence_wait(struct nouveau_bo_priv *nvbo, uint32_t access)
+{
+	CALLED();
+	NvFence fences[BO_MAX_FENCES], fence, tmp;
+	int ret = 0, nr, done, i;
+
+	mutexLock(&nvbo->fence_lock);
+	fence = nvbo->fence;
+	nr = bo_fence_conflicts(nvbo, access & NOUVEAU_BO_WR, fences);
+	mutexUnlock(&nvbo->fence_lock);
+
+	for (done = 0; done < nr; done++) {
+		tmp = fences[done];
+		ret = bo_fence_wait_one(nvbo, &tmp, access);
+		if (ret)
+			break;
+	}
+
+	mutexLock(&nvbo->fence_lock);
+	for (i = 0; i < done; i++) {
+		bo_fence_forget(nvbo->wr_fence, BO_MAX_WRITERS, &fences[i]);
+		bo_fence_forget(nvbo->rd_fence, BO_MAX_READERS, &fences[i]);
+	}
+	if (!ret && (access & NOUVEAU_BO_WR) &&
+	    bo_fence_equal(&nvbo->fence, &fence)) {
+		nvbo->fence.id = UINT32_MAX;
+		nvbo->fence.value = 0;
+	}
+	mutexUnlock(&nvbo->fence_lock);
 
-	if (ret == 0)
-		nvbo->access = 0;
 	return ret;
 }
 
-static void
-nouveau_bo_del(struct nouveau_bo *bo)
+/* Adds a fence to a set of the fences of different syncpoints, kept in
+ * submission order.  Fences of the same syncpoint retire in order, so the
+ * new one replaces any of its syncpoint.  If the set is full of pending
+ * fences, *evict receives the oldest one, which has to be waited for
+ * before trying again.
+ */
+static bool
+bo_fence_set_add(NvFence *set, int max, NvFence *fence, NvFence *evict)
+{
+	int i, nr = 0;
+
+	for (i = 0; i < max; i++) {
+		if (!bo_fence_none(&set[i]) && set[i].id != fence->id)
+			set[nr++] = set[i];
+	}
+
+	if (nr == max) {
+		for (i = 0, nr = 0; i < max; i++) {
+			if (R_FAILED(nvFenceWait(&set[i], 0)))
+				set[nr++] = set[i];
+		}
+	}
+
+	if (nr == max) {
+		*evict = set[0];
+		return false;
+	}
+
+	set[nr++] = *fence;
+	for (i = nr; i < max; i++)
+		set[i].id = UINT32_MAX;
+	return true;
+}
+
+void
+bo_fence_update(struct nouveau_bo_priv *nvbo, NvFence *fence, bool write)
+{
+	NvFence evict, tmp;
+	int i, nr;
+
+	for (;;) {
+		mutexLock(&nvbo->fence_lock);
+		if (write && bo_fence_set_add(nvbo->wr_fence, BO_MAX_WRITERS, fence, &evict)) {
+			// Earlier readers on the same channel retire before this write
+			for (i = 0, nr = 0; i < BO_MAX_READERS; i++) {
+				if (nvbo->rd_fence[i].id != fence->id)
+					nvbo->rd_fence[nr++] = nvbo->rd_fence[i];
+			}
+			for (; nr < BO_MAX_READERS; nr++)
+				nvbo->rd_fence[nr].id = UINT32_MAX;
+			break;
+		}
+		if (!write && bo_fence_set_add(nvbo->rd_fence, BO_MAX_READERS, fence, &evict))
+			break;
+		mutexUnlock(&nvbo->fence_lock);
+
+		// Out of slots, retire the oldest access without the lock held
+		tmp = evict;
+		bo_fence_wait_one(nvbo, &tmp, 0);
+		mutexLock(&nvbo->fence_lock);
+		bo_fence_forget(write ? nvbo->wr_fence : nvbo->rd_fence,
+				write ? BO_MAX_WRITERS : BO_MAX_READERS, &evict);
+		mutexUnlock(&nvbo->fence_lock);
+	}
+
+	nvbo->fence = *fence;
+	mutexUnlock(&nvbo->fence_lock);
+}
+
+void
+bo_destroy(struct nouveau_bo_priv *nvbo)
 {
 	CALLED();
-	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+	struct nouveau_bo *bo = &nvbo->base;
 	struct nouveau_device_priv *nvdev = nouveau_device(bo->device);
 
-	nouveau_bo_fence_wait(bo, 0);
+	bo_fence_wait(nvbo, NOUVEAU_BO_WR);
+	if (nvbo->slab) {
+		bo_slab_free(nvbo);
+		free(nvbo);
+		return;
+	}
+
 	nvAddressSpaceUnmap(&nvdev->addr_space, bo->offset);
 	nvMapClose(&nvbo->map);
 	if (nvbo->map_addr)
@@ -352,28 +620,91 @@ nouveau_bo_del(struct nouveau_bo *bo)
 	free(nvbo);
 }
 
+static inline void
+bo_account_alloc(struct nouveau_device_priv *nvdev, struct nouveau_bo *bo)
+{
+	trace_event(TRACE_BO_NEW, TRACE_INSTANT, bo->handle, bo->size);
+	__sync_add_and_fetch(&nvdev->stats.bo_allocs, 1);
+	__sync_add_and_fetch(&nvdev->stats.bo_bytes, bo->size);
+	__sync_add_and_fetch(&nvdev->stats.bo_bytes_total, bo->size);
+}
+
+static void
+nouveau_bo_del(struct nouveau_bo *bo)
+{
+	CALLED();
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+	struct nouveau_device_priv *nvdev = nouveau_device(bo->device);
+
+	trace_event(TRACE_BO_DESTROY, TRACE_INSTANT, bo->handle, bo->size);
+	__sync_add_and_fetch(&nvdev->stats.bo_frees, 1);
+	__sync_sub_and_fetch(&nvdev->stats.bo_bytes, bo->size);
+
+	if (!bo_cache_put(nvbo))
+		bo_destroy(nvbo);
+}
+
+/* gpu_clear is false for the library's own command bos, which are created
+ * while recording into the copy channel and must not be cleared through it.
+ */
 int
-nouveau_bo_new(struct nouveau_device *dev, uint32_t flags, uint32_t align,
-	       uint64_t size, union nouveau_bo_config *config,
-	       struct nouveau_bo **pbo)
+bo_new(struct nouveau_device *dev, uint32_t flags, uint32_t align,
+       uint64_t size, union nouveau_bo_config *config, bool gpu_clear,
+       struct nouveau_bo **pbo)
 {
 	CALLED();
 	struct nouveau_device_priv *nvdev = nouveau_device(dev);
 
-	struct nouveau_bo_priv *nvbo = calloc(1, sizeof(*nvbo));
-	struct nouveau_bo *bo = &nvbo->base;
+	struct nouveau_bo_priv *nvbo;
+	struct nouveau_bo *bo;
 	Result rc;
+	int cls, ret;
+
+	NvKind kind = NvKind_Pitch;
+	if (config)
+		kind = (NvKind)config->nvc0.memtype;
+
+	flags = bo_placement(flags);
+
+	cls = bo_slab_class(align, size, kind);
+	if (cls >= 0) {
+		if (!(nvbo = calloc(1, sizeof(*nvbo))))
+			return -ENOMEM;
+		bo = &nvbo->base;
+
+		TRACE("Suballocating BO of size %ld, align %d, flags 0x%x and kind 0x%x\n", size, align, flags, kind);
+		ret = bo_slab_alloc(dev, cls, flags, kind, nvbo);
+		if (ret) {
+			free(nvbo);
+			return ret;
+		}
+		goto out;
+	}
 
 	if (align < 0x1000)
 		align = 0x1000;
 	size = (size + 0xFFF) &~ 0xFFF;
 
-	if (!nvbo)
-		return -ENOMEM;
+	// GPU-only bos as large as a big page are aligned to one, so that the
+	// GPU maps them with big pages and fewer TLB misses.  Bos the CPU
+	// maps keep small pages and don't waste address space on padding.
+	if (!(flags & NOUVEAU_BO_GART) && size >= nvdev->addr_space.page_size &&
+	    align < nvdev->addr_space.page_size)
+		align = nvdev->addr_space.page_size;
+
+	nvbo = bo_cache_get(dev, &size, align, flags, kind);
+	if (nvbo) {
+		TRACE("Recycling BO of size %ld, align %d, flags 0x%x and kind 0x%x\n", size, align, flags, kind);
+		bo = &nvbo->base;
+		bo->map = NULL;
+		nvbo->wr_map_start = 0;
+		nvbo->wr_map_end = 0;
+		goto out;
+	}
 
-	NvKind kind = NvKind_Pitch;
-	if (config)
-		kind = (NvKind)config->nvc0.memtype;
+	if (!(nvbo = calloc(1, sizeof(*nvbo))))
+		return -ENOMEM;
+	bo = &nvbo->base;
 
 	TRACE("Allocating BO of size %ld, align %d, flags 0x%x and kind 0x%x\n", size, align, flags, kind);
 	void* mem = memalign(0x1000, size);
@@ -384,7 +715,7 @@ nouveau_bo_new(struct nouveau_device *dev, uint32_t flags, uint32_t align,
 		return -ENOMEM;
 	}
 
-	rc = nvMapCreate(&nvbo->map, mem, size, align, kind, false);
+	rc = nvMapCreate(&nvbo->map, mem, size, align, kind, !!(flags & NOUVEAU_BO_CACHED));
 	if (R_FAILED(rc))
 	{
 		TRACE("Failed to create nvmap object (%x)\n", rc);
@@ -403,21 +734,52 @@ nouveau_bo_new(struct nouveau_device *dev, uint32_t flags, uint32_t align,
 		return -rc;
 	}
 
-	atomic_set(&nvbo->refcnt, 1);
-	bo->device = dev;
 	bo->handle = nvMapGetHandle(&nvbo->map);
 	bo->size = size;
-	bo->flags = flags;
 	nvbo->map_addr = mem;
-	nvbo->fence.id = UINT32_MAX;
-	memset(nvbo->map_addr, 0, bo->size);
+	nvbo->align = align;
+
+out:
+	atomic_set(&nvbo->refcnt, 1);
+	bo->device = dev;
+	bo->flags = flags;
+	nvbo->kind = kind;
+	bo_fence_reset(nvbo);
+	bo_mark_written(nvbo, true);
+
+	// Write back anything left in the CPU caches for this memory, it
+	// could otherwise land on top of what the GPU writes
+	if (flags & NOUVEAU_BO_CACHED)
+		armDCacheFlush(nvbo->map_addr, bo->size);
+
+	if (!(flags & NOUVEAU_BO_NOZERO)) {
+		// The fill is submitted right away and its fence becomes the
+		// bo's writer, which maps and other channels then wait for
+		if (!gpu_clear || !nvdev->clear_min_size ||
+		    bo->size < nvdev->clear_min_size ||
+		    nouveau_bo_fill(bo, 0, bo->size, 0, NULL)) {
+			memset(nvbo->map_addr, 0, bo->size);
+			bo_mark_dirty(nvbo, 0, bo->size);
+		}
+	}
 
 	if (config)
 		bo->config = *config;
+	else
+		memset(&bo->config, 0, sizeof(bo->config));
+	bo_account_alloc(nvdev, bo);
 	*pbo = bo;
 	return 0;
 }
 
+int
+nouveau_bo_new(struct nouveau_device *dev, uint32_t flags, uint32_t align,
+	       uint64_t size, union nouveau_bo_config *config,
+	       struct nouveau_bo **pbo)
+{
+	return bo_new(dev, flags, align, size, config, true, pbo);
+}
+
 /* Unused
 static int
 nouveau_bo_wrap_locked(struct nouveau_device *dev, uint32_t handle,
@@ -475,7 +837,9 @@ nouveau_bo_name_ref(struct nouveau_device *dev, uint32_t name,
 	bo->handle = handle;
 	bo->size = nvMapGetSize(&nvbo->map);
 	bo->flags = NOUVEAU_BO_GART;
-	nvbo->fence.id = UINT32_MAX;
+	bo_fence_reset(nvbo);
+	bo_mark_written(nvbo, true);
+	bo_account_alloc(nvdev, bo);
 	*pbo = bo;
 
 	bo->config.nvc0.memtype = kind;
@@ -489,6 +853,10 @@ nouveau_bo_name_get(struct nouveau_bo *bo, uint32_t *name)
 	CALLED();
 	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
 
+	// Suballocated bos share their nvmap object with other bos
+	if (nvbo->slab)
+		return -EINVAL;
+
 	*name = nvMapGetId(&nvbo->map);
 	return 0;
 }
@@ -528,11 +896,30 @@ nouveau_bo_get_syncpoint(struct nouveau_bo *bo, unsigned int *out_threshold)
 {
 	CALLED();
 	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+	NvFence fence;
+
+	mutexLock(&nvbo->fence_lock);
+	fence = nvbo->fence;
+	mutexUnlock(&nvbo->fence_lock);
 
 	if (out_threshold)
-		*out_threshold = nvbo->fence.value;
+		*out_threshold = fence.value;
 
-	return nvbo->fence.id;
+	return fence.id;
+}
+
+int
+nouveau_bo_get_fence(struct nouveau_bo *bo, struct nouveau_fence *fence)
+{
+	CALLED();
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+
+	// Submissions update the pair under the lock
+	mutexLock(&nvbo->fence_lock);
+	fence->id = nvbo->fence.id;
+	fence->value = nvbo->fence.value;
+	mutexUnlock(&nvbo->fence_lock);
+	return 0;
 }
 
 int
@@ -547,18 +934,32 @@ nouveau_bo_wait(struct nouveau_bo *bo, uint32_t access,
 		return 0;
 
 	push = cli_push_get(client, bo);
-	if (push && push->channel)
-		nouveau_pushbuf_kick(push, push->channel);
+	if (push && push->channel) {
+		int ret = pushbuf_flush_bo(push, bo, access);
+		if (ret)
+			return ret;
+	}
 
-	if (!(nvbo->access & NOUVEAU_BO_WR) && !(access & NOUVEAU_BO_WR))
-		return 0;
+	return bo_fence_wait(nvbo, access);
+}
 
-	return nouveau_bo_fence_wait(bo, access);
+void
+bo_mark_written(struct nouveau_bo_priv *nvbo, bool cpu)
+{
+	struct nouveau_device_priv *nvdev = nouveau_device(nvbo->base.device);
+	nvbo->write_seq = __sync_add_and_fetch(&nvdev->write_seq, 1);
+	if (cpu) {
+		nvbo->cpu_write_seq = nvbo->write_seq;
+		if (nvbo->slab)
+			nvbo->slab->cpu_write_seq = nvbo->write_seq;
+	}
 }
 
+/* Maps a bo without marking it as written by the CPU, for memory the
+ * library fills with commands that never go through the texture caches.
+ */
 int
-nouveau_bo_map(struct nouveau_bo *bo, uint32_t access,
-	       struct nouveau_client *client)
+bo_map(struct nouveau_bo *bo, uint32_t access, struct nouveau_client *client)
 {
 	CALLED();
 	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
@@ -566,9 +967,138 @@ nouveau_bo_map(struct nouveau_bo *bo, uint32_t access,
 	return nouveau_bo_wait(bo, access, client);
 }
 
+int
+nouveau_bo_map(struct nouveau_bo *bo, uint32_t access,
+	       struct nouveau_client *client)
+{
+	CALLED();
+	return nouveau_bo_map_range(bo, 0, bo->size, access, client);
+}
+
+static void
+bo_mark_wr_mapped(struct nouveau_bo_priv *nvbo, uint64_t offset, uint64_t size)
+{
+	if (!(nvbo->base.flags & NOUVEAU_BO_CACHED) || !size)
+		return;
+
+	mutexLock(&nvbo->fence_lock);
+	if (!nvbo->wr_map_end || offset < nvbo->wr_map_start)
+		nvbo->wr_map_start = offset;
+	if (offset + size > nvbo->wr_map_end)
+		nvbo->wr_map_end = offset + size;
+	mutexUnlock(&nvbo->fence_lock);
+}
+
+int
+nouveau_bo_map_range(struct nouveau_bo *bo, uint64_t offset, uint64_t size,
+		     uint32_t access, struct nouveau_client *client)
+{
+	CALLED();
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+	int ret;
+
+	if (offset > bo->size || size > bo->size - offset)
+		return -EINVAL;
+
+	ret = bo_map(bo, access, client);
+	if (!ret && (access & NOUVEAU_BO_WR)) {
+		bo_mark_written(nvbo, true);
+		bo_mark_dirty(nvbo, offset, size);
+		bo_mark_wr_mapped(nvbo, offset, size);
+	}
+	return ret;
+}
+
+void
+bo_mark_dirty(struct nouveau_bo_priv *nvbo, uint64_t offset, uint64_t size)
+{
+	if (!(nvbo->base.flags & NOUVEAU_BO_CACHED) || !size)
+		return;
+
+	mutexLock(&nvbo->fence_lock);
+	if (!nvbo->dirty_end || offset < nvbo->dirty_start)
+		nvbo->dirty_start = offset;
+	if (offset + size > nvbo->dirty_end)
+		nvbo->dirty_end = offset + size;
+	mutexUnlock(&nvbo->fence_lock);
+}
+
+/* Cleans the range written through the CPU mapping before the GPU reads it.
+ * A range still mapped for writing stays dirty for the next submission.
+ */
+void
+bo_flush_dirty(struct nouveau_bo_priv *nvbo)
+{
+	uint64_t start, end;
+
+	if (!nvbo->dirty_end)
+		return;
+
+	mutexLock(&nvbo->fence_lock);
+	start = nvbo->dirty_start;
+	end = nvbo->dirty_end;
+	nvbo->dirty_start = nvbo->wr_map_start;
+	nvbo->dirty_end = nvbo->wr_map_end;
+	mutexUnlock(&nvbo->fence_lock);
+
+	if (end)
+		armDCacheClean((char *)nvbo->map_addr + start, end - start);
+}
+
+int
+nouveau_bo_flush_range(struct nouveau_bo *bo, uint64_t offset, uint64_t size)
+{
+	CALLED();
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+
+	if (offset > bo->size || size > bo->size - offset)
+		return -EINVAL;
+	if (!(bo->flags & NOUVEAU_BO_CACHED) || !size)
+		return 0;
+
+	armDCacheClean((char *)nvbo->map_addr + offset, size);
+
+	// Forget the dirty range if this covered it and nothing can write
+	// to it through a mapping anymore
+	mutexLock(&nvbo->fence_lock);
+	if (nvbo->dirty_end && !nvbo->wr_map_end && offset <= nvbo->dirty_start &&
+	    offset + size >= nvbo->dirty_end) {
+		nvbo->dirty_start = 0;
+		nvbo->dirty_end = 0;
+	}
+	mutexUnlock(&nvbo->fence_lock);
+	return 0;
+}
+
+/* Userspace can't drop cache lines without writing them back, so this
+ * cleans and invalidates; lines the CPU hasn't written are just dropped.
+ */
+int
+nouveau_bo_invalidate_range(struct nouveau_bo *bo, uint64_t offset,
+			    uint64_t size)
+{
+	CALLED();
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+
+	if (offset > bo->size || size > bo->size - offset)
+		return -EINVAL;
+	if (!(bo->flags & NOUVEAU_BO_CACHED) || !size)
+		return 0;
+
+	armDCacheFlush((char *)nvbo->map_addr + offset, size);
+	return 0;
+}
+
+/* Writes made through the mapping are still cleaned at the next kick */
 void
 nouveau_bo_unmap(struct nouveau_bo *bo)
 {
 	CALLED();
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
+
+	mutexLock(&nvbo->fence_lock);
+	nvbo->wr_map_start = 0;
+	nvbo->wr_map_end = 0;
+	mutexUnlock(&nvbo->fence_lock);
 	bo->map = NULL;
 }
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "private.h"
+
+#include "nvif/class.h"
+#include "nvif/if0002.h"
+#include "nvif/if0003.h"
+
+#ifdef DEBUG
+#	define TRACE(x...) printf("nouveau: " x)
+#	define CALLED() TRACE("CALLED: %s\n", __PRETTY_FUNCTION__)
+#else
+#	define TRACE(x...)
+# define CALLED()
+#endif
+
+/* Perfmon objects enumerate the counter domains and signals of a backend
+ * through the nvif perfmon queries, perfdom objects sample up to four
+ * signals of one domain.  Hardware counters aren't exposed to us, so the
+ * default backend reports the library's own device counters.
+ */
+
+static const char *const perfmon_sw_signals[] = {
+	"bo_allocs",
+	"bo_frees",
+	"bo_kbytes",
+	"fence_waits",
+	"fence_wait_us",
+};
+
+static const struct nouveau_perfmon_domain perfmon_sw_domains[] = {
+	{ "nouveau", 4, sizeof(perfmon_sw_signals) / sizeof(perfmon_sw_signals[0]),
+	  perfmon_sw_signals },
+};
+
+static int
+perfmon_sw_read(void *priv, uint8_t domain, uint16_t signal, uint64_t *value)
+{
+	struct nouveau_device_stats stats;
+
+	nouveau_device_get_stats(priv, &stats);
+	switch (signal) {
+	case 0: *value = stats.bo_allocs; break;
+	case 1: *value = stats.bo_frees; break;
+	case 2: *value = stats.bo_bytes_total >> 10; break;
+	case 3: *value = stats.fence_waits; break;
+	case 4: *value = stats.fence_wait_ns / 1000; break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static const struct nouveau_perfmon_backend perfmon_sw = {
+	.nr_domains = sizeof(perfmon_sw_domains) / sizeof(perfmon_sw_domains[0]),
+	.domains = perfmon_sw_domains,
+	.read = perfmon_sw_read,
+};
+
+/* Perfdoms hold a reference on their perfmon, which outlives its object
+ * until the last of them is deleted.
+ */
+struct perfmon {
+	atomic_t refcnt;
+	struct nouveau_device *dev;
+	const struct nouveau_perfmon_backend *backend;
+	void *priv;
+};
+
+struct perfdom {
+	drmMMListHead head;
+	struct perfmon *perfmon;
+	uint8_t domain;
+	uint8_t mode;
+	int nr_ctr;
+	uint16_t signal[4];
+	uint64_t base[4];
+	uint32_t ctr[4];
+	uint64_t base_tick;
+	uint32_t clk;
+};
+
+void
+nouveau_device_set_perfmon_backend(struct nouveau_device *dev,
+				   const struct nouveau_perfmon_backend *backend,
+				   void *priv)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+
+	mutexLock(&nvdev->perfmon_lock);
+	nvdev->perfmon = backend;
+	nvdev->perfmon_priv = priv;
+	mutexUnlock(&nvdev->perfmon_lock);
+}
+
+int
+perfmon_new(struct nouveau_object *obj)
+{
+	struct nouveau_object *parent = obj->parent;
+	struct nouveau_device_priv *nvdev;
+	struct perfmon *perfmon;
+
+	if (!parent || parent->oclass != NOUVEAU_DEVICE_CLASS)
+		return -EINVAL;
+	nvdev = nouveau_device((struct nouveau_device *)parent);
+
+	perfmon = calloc(1, sizeof(*perfmon));
+	if (!perfmon)
+		return -ENOMEM;
+	atomic_set(&perfmon->refcnt, 1);
+
+	// Objects keep the backend they were created with
+	mutexLock(&nvdev->perfmon_lock);
+	perfmon->dev = &nvdev->base;
+	perfmon->backend = nvdev->perfmon;
+	perfmon->priv = nvdev->perfmon_priv;
+	mutexUnlock(&nvdev->perfmon_lock);
+
+	if (!perfmon->backend) {
+		perfmon->backend = &perfmon_sw;
+		perfmon->priv = &nvdev->base;
+	}
+
+	obj->data = perfmon;
+	obj->length = sizeof(*perfmon);
+	return 0;
+}
+
+static void
+perfmon_unref(struct perfmon *perfmon)
+{
+	if (atomic_dec_and_test(&perfmon->refcnt))
+		free(perfmon);
+}
+
+void
+perfmon_del(struct nouveau_object *obj)
+{
+	perfmon_unref(obj->data);
+	obj->data = NULL;
+}
+
+/* The queries iterate the way the kernel's do: an iter of zero starts, each
+ * call returns the entry before iter and the next iter, all ones ends.
+ */
+static int
+perfmon_query_domain(struct perfmon *perfmon, struct nvif_perfmon_query_domain_v0 *args)
+{
+	const struct nouveau_perfmon_backend *backend = perfmon->backend;
+	const struct nouveau_perfmon_domain *dom;
+	int di = (args->iter & 0xff) - 1;
+
+	if (args->version != 0 || di >= backend->nr_domains)
+		return -EINVAL;
+
+	if (di >= 0) {
+		dom = &backend->domains[di];
+		args->id = di;
+		args->counter_nr = dom->counter_nr;
+		args->signal_nr = dom->signal_nr;
+		strncpy(args->name, dom->name, sizeof(args->name) - 1);
+		args->name[sizeof(args->name) - 1] = '\0';
+	}
+
+	if (++di < backend->nr_domains) {
+		args->iter = ++di;
+		return 0;
+	}
+
+	args->iter = 0xff;
+	return 0;
+}
+
+static int
+perfmon_query_signal(struct perfmon *perfmon, struct nvif_perfmon_query_signal_v0 *args)
+{
+	const struct nouveau_perfmon_backend *backend = perfmon->backend;
+	const struct nouveau_perfmon_domain *dom;
+	int si = (args->iter & 0xffff) - 1;
+
+	if (args->version != 0 || args->domain >= backend->nr_domains)
+		return -EINVAL;
+
+	dom = &backend->domains[args->domain];
+	if (si >= dom->signal_nr)
+		return -EINVAL;
+
+	if (si >= 0) {
+		args->signal = si;
+		args->source_nr = 0;
+		strncpy(args->name, dom->signals[si], sizeof(args->name) - 1);
+		args->name[sizeof(args->name) - 1] = '\0';
+	}
+
+	if (++si < dom->signal_nr) {
+		args->iter = ++si;
+		return 0;
+	}
+
+	args->iter = 0xffff;
+	return 0;
+}
+
+static int
+perfmon_query_source(struct perfmon *perfmon, struct nvif_perfmon_query_source_v0 *args)
+{
+	const struct nouveau_perfmon_backend *backend = perfmon->backend;
+
+	if (args->version != 0 || args->domain >= backend->nr_domains ||
+	    args->signal >= backend->domains[args->domain].signal_nr)
+		return -EINVAL;
+
+	// Signals have no sources to select
+	args->iter = 0xff;
+	return 0;
+}
+
+static int
+perfmon_mthd(struct nouveau_object *obj, uint32_t mthd, void *data, uint32_t size)
+{
+	struct perfmon *perfmon = obj->data;
+
+	switch (mthd) {
+	case NVIF_PERFMON_V0_QUERY_DOMAIN:
+		if (size != sizeof(struct nvif_perfmon_query_domain_v0))
+			return -EINVAL;
+		return perfmon_query_domain(perfmon, data);
+	case NVIF_PERFMON_V0_QUERY_SIGNAL:
+		if (size != sizeof(struct nvif_perfmon_query_signal_v0))
+			return -EINVAL;
+		return perfmon_query_signal(perfmon, data);
+	case NVIF_PERFMON_V0_QUERY_SOURCE:
+		if (size != sizeof(struct nvif_perfmon_query_source_v0))
+			return -EINVAL;
+		return perfmon_query_source(perfmon, data);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Counters count from INIT to the first SAMPLE, then between SAMPLEs, and
+ * READ returns the last such interval; clk is its length in microseconds.
+ */
+static int
+perfdom_read_all(struct perfdom *dom, uint64_t *value)
+{
+	struct perfmon *perfmon = dom->perfmon;
+	int ret, i;
+
+	for (i = 0; i < dom->nr_ctr; i++) {
+		ret = perfmon->backend->read(perfmon->priv, dom->domain,
+					     dom->signal[i], &value[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int
+perfdom_init(struct perfdom *dom)
+{
+	dom->base_tick = armGetSystemTick();
+	memset(dom->ctr, 0, sizeof(dom->ctr));
+	dom->clk = 0;
+	return perfdom_read_all(dom, dom->base);
+}
+
+static int
+perfdom_sample(struct perfdom *dom)
+{
+	uint64_t value[4], now = armGetSystemTick();
+	int ret, i;
+
+	ret = perfdom_read_all(dom, value);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < dom->nr_ctr; i++) {
+		dom->ctr[i] = value[i] - dom->base[i];
+		dom->base[i] = value[i];
+	}
+
+	dom->clk = armTicksToNs(now - dom->base_tick) / 1000;
+	dom->base_tick = now;
+	return 0;
+}
+
+int
+perfdom_new(struct nouveau_object *obj, void *data, uint32_t length)
+{
+	struct nouveau_object *parent = obj->parent;
+	struct nvif_perfdom_v0 *args = data;
+	const struct nouveau_perfmon_domain *domain;
+	struct nouveau_device_priv *nvdev;
+	struct perfmon *perfmon;
+	struct perfdom *dom;
+	int ret, i;
+
+	if (!parent || parent->oclass != NVIF_CLASS_PERFMON ||
+	    length != sizeof(*args) || args->version != 0)
+		return -EINVAL;
+
+	perfmon = parent->data;
+	if (args->domain >= perfmon->backend->nr_domains)
+		return -EINVAL;
+	domain = &perfmon->backend->domains[args->domain];
+
+	dom = calloc(1, sizeof(*dom));
+	if (!dom)
+		return -ENOMEM;
+
+	atomic_inc(&perfmon->refcnt);
+	dom->perfmon = perfmon;
+	dom->domain = args->domain;
+	dom->mode = args->mode;
+
+	// Only the first signal of each counter is used, there is no logic op
+	for (i = 0; i < 4 && i < domain->counter_nr; i++) {
+		if (args->ctr[i].signal[0] >= domain->signal_nr) {
+			perfmon_unref(perfmon);
+			free(dom);
+			return -EINVAL;
+		}
+		dom->signal[dom->nr_ctr++] = args->ctr[i].signal[0];
+	}
+
+	ret = perfdom_init(dom);
+	if (ret) {
+		perfmon_unref(perfmon);
+		free(dom);
+		return ret;
+	}
+
+	nvdev = nouveau_device(perfmon->dev);
+	mutexLock(&nvdev->perfmon_lock);
+	if (dom->mode == NOUVEAU_PERFDOM_MODE_KICK) {
+		DRMLISTADDTAIL(&dom->head, &nvdev->perfdoms);
+		nvdev->nr_perfdoms++;
+	} else
+		DRMINITLISTHEAD(&dom->head);
+	mutexUnlock(&nvdev->perfmon_lock);
+
+	obj->data = dom;
+	obj->length = sizeof(*dom);
+	return 0;
+}
+
+void
+perfdom_del(struct nouveau_object *obj)
+{
+	struct perfdom *dom = obj->data;
+	struct nouveau_device_priv *nvdev = nouveau_device(dom->perfmon->dev);
+
+	mutexLock(&nvdev->perfmon_lock);
+	if (dom->mode == NOUVEAU_PERFDOM_MODE_KICK) {
+		DRMLISTDEL(&dom->head);
+		nvdev->nr_perfdoms--;
+	}
+	mutexUnlock(&nvdev->perfmon_lock);
+
+	perfmon_unref(dom->perfmon);
+}
+
+static int
+perfdom_mthd(struct nouveau_object *obj, uint32_t mthd, void *data, uint32_t size)
+{
+	struct perfdom *dom = obj->data;
+	struct nouveau_device_priv *nvdev = nouveau_device(dom->perfmon->dev);
+	struct nvif_perfdom_read_v0 *args = data;
+	int ret = 0, i;
+
+	// Kick sampled domains are updated from the submitting threads
+	mutexLock(&nvdev->perfmon_lock);
+	switch (mthd) {
+	case NVIF_PERFDOM_V0_INIT:
+		ret = perfdom_init(dom);
+		break;
+	case NVIF_PERFDOM_V0_SAMPLE:
+		ret = perfdom_sample(dom);
+		break;
+	case NVIF_PERFDOM_V0_READ:
+		if (size != sizeof(*args) || args->version != 0) {
+			ret = -EINVAL;
+			break;
+		}
+		for (i = 0; i < 4; i++)
+			args->ctr[i] = dom->ctr[i];
+		args->clk = dom->clk;
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+	mutexUnlock(&nvdev->perfmon_lock);
+
+	return ret;
+}
+
+/* Samples the domains created with NOUVEAU_PERFDOM_MODE_KICK */
+void
+perfmon_kick(struct nouveau_device *dev)
+{
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	struct perfdom *dom;
+
+	mutexLock(&nvdev->perfmon_lock);
+	DRMLISTFOREACHENTRY(dom, &nvdev->perfdoms, head)
+		perfdom_sample(dom);
+	mutexUnlock(&nvdev->perfmon_lock);
+}
+
+int
+nouveau_object_mthd(struct nouveau_object *obj,
+		    uint32_t mthd, void *data, uint32_t size)
+{
+	CALLED();
+
+	switch (obj->oclass) {
+	case NVIF_CLASS_PERFMON:
+		return perfmon_mthd(obj, mthd, data, size);
+	case NVIF_CLASS_PERFDOM:
+		return perfdom_mthd(obj, mthd, data, size);
+	default:
+		return -ENODEV;
+	}
+}
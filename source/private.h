@@ -1,30 +1,49 @@
 #ifndef __NOUVEAU_LIBDRM_PRIVATE_H__
 #define __NOUVEAU_LIBDRM_PRIVATE_H__
 
+#include <stdio.h>
+
 #include "libdrm_atomics.h"
+#include "libdrm_lists.h"
 #include "nouveau_drm.h"
 
 #include "nouveau.h"
 
 #include <switch.h>
 
-#define BO_MAP_NUM_BUCKETS 31
+/* Open-addressed, linearly probed table of the bos a client has referenced
+ * on its pushbufs.  The table size is a power of two that grows and shrinks
+ * with the number of live entries, and a bo handle of zero marks a free slot.
+ * A client's map is split into shards with their own locks, so that
+ * threads recording into different pushbufs rarely contend.
+ */
+#define BO_MAP_MIN_SIZE 16
+#define BO_MAP_SHARD_BITS 4
+#define BO_MAP_SHARDS (1 << BO_MAP_SHARD_BITS)
 
 struct nouveau_client_bo_map_entry {
-	struct nouveau_client_bo_map_entry *next;
-	struct nouveau_client_bo_map_entry **prev_next;
+	uint32_t bo_handle;
 	struct drm_nouveau_gem_pushbuf_bo *kref;
 	struct nouveau_pushbuf *push;
-	uint32_t bo_handle;
 };
 
 struct nouveau_client_bo_map {
-	struct nouveau_client_bo_map_entry *buckets[BO_MAP_NUM_BUCKETS+1];
+	Mutex lock;
+	struct nouveau_client_bo_map_entry *entries;
+	uint32_t mask;
+	uint32_t count;
 };
 
+#define KREC_POOL_MAX 8
+
+struct nouveau_pushbuf_krec;
+
 struct nouveau_client_priv {
 	struct nouveau_client base;
-	struct nouveau_client_bo_map bomap;
+	struct nouveau_client_bo_map bomap[BO_MAP_SHARDS];
+	Mutex krec_lock;
+	struct nouveau_pushbuf_krec *krec_pool;
+	int nr_krec_pool;
 };
 
 static inline struct nouveau_client_priv *
@@ -36,8 +55,13 @@ nouveau_client(struct nouveau_client *client)
 void
 cli_map_free(struct nouveau_client *);
 
+void
+cli_krec_pool_free(struct nouveau_client *);
+
+/* Returns the kref of a bo on the given pushbuf of the client, if any */
 struct drm_nouveau_gem_pushbuf_bo *
-cli_kref_get(struct nouveau_client *, struct nouveau_bo *bo);
+cli_kref_get(struct nouveau_client *, struct nouveau_bo *bo,
+	     struct nouveau_pushbuf *push);
 
 struct nouveau_pushbuf *
 cli_push_get(struct nouveau_client *, struct nouveau_bo *bo);
@@ -47,14 +71,141 @@ cli_kref_set(struct nouveau_client *, struct nouveau_bo *bo,
              struct drm_nouveau_gem_pushbuf_bo *kref,
              struct nouveau_pushbuf *push);
 
+/* Forgets a bo's kref, unless another pushbuf has referenced it since */
+void
+cli_kref_clear(struct nouveau_client *, struct nouveau_bo *bo,
+               struct nouveau_pushbuf *push);
+
+/* Small bos are carved out of larger shared nvmap objects ("slabs"), one
+ * slab per size class, NvKind and coherency.  Slots are power-of-two sized
+ * between 1 << BO_SLAB_MIN_SHIFT and 1 << BO_SLAB_MAX_SHIFT bytes.  Only
+ * pitch and generic kinds are suballocated: compressible kinds need their
+ * own compression tags and block-linear ones their own big pages.  Generic
+ * kinds can still be used block-linear, so their slots are at least a GOB.
+ */
+#define BO_SLAB_SIZE        0x20000
+#define BO_SLAB_MIN_SHIFT   8
+#define BO_SLAB_MAX_SHIFT   14
+#define BO_SLAB_NUM_CLASSES (BO_SLAB_MAX_SHIFT - BO_SLAB_MIN_SHIFT + 1)
+#define BO_SLAB_MAX_SLOTS   (BO_SLAB_SIZE >> BO_SLAB_MIN_SHIFT)
+#define BO_SLAB_GOB_SIZE    0x200
+
+/* Suballocated bos don't own an nvmap handle, so they are given handles
+ * from a separate namespace in order to keep bo->handle unique: the id of
+ * their slab, unique among the live slabs of the device, and their slot.
+ */
+#define BO_SLAB_HANDLE_BIT  0x80000000
+#define BO_SLAB_SLOT_BITS   9
+#define BO_SLAB_MAX_IDS     (BO_SLAB_HANDLE_BIT >> BO_SLAB_SLOT_BITS)
+
+/* Memory attributes that slabs and the bo cache key on, besides the kind */
+#define BO_ATTR_MASK (NOUVEAU_BO_COHERENT | NOUVEAU_BO_CACHED)
+
+/* Resolves the placement flags of a new bo into its memory attributes:
+ * bos without NOUVEAU_BO_GART are GPU-only and never CPU-cached, and
+ * NOUVEAU_BO_NOSNOOP asks for a write-combined CPU mapping even when
+ * NOUVEAU_BO_CACHED is given.  NOUVEAU_BO_COHERENT bos bypass the GPU caches.
+ */
+static inline uint32_t
+bo_placement(uint32_t flags)
+{
+	if (!(flags & NOUVEAU_BO_GART) || (flags & NOUVEAU_BO_NOSNOOP))
+		flags &= ~NOUVEAU_BO_CACHED;
+	return flags;
+}
+
+struct nouveau_bo_slab {
+	drmMMListHead head;
+	NvMap map;
+	void *mem;
+	uint64_t offset;
+	NvKind kind;
+	uint32_t id;
+	uint32_t capture_id;
+	uint64_t capture_seq;
+	uint64_t cpu_write_seq;
+	uint32_t flags;
+	uint32_t slot_size;
+	uint32_t nr_slots;
+	uint32_t nr_free;
+	uint32_t free[BO_SLAB_MAX_SLOTS / 32];
+};
+
+/* Idle bos are recycled through a device-level cache, bucketed by size in
+ * the same way as the desktop libdrm bo caches.
+ */
+#define BO_CACHE_MAX_SIZE       (64 << 20)
+#define BO_CACHE_NUM_BUCKETS    56
+#define BO_CACHE_DEFAULT_BYTES  (16 << 20)
+#define BO_CACHE_DEFAULT_AGE_MS 1000
+
+struct nouveau_bo_cache_bucket {
+	drmMMListHead head;
+	uint64_t size;
+};
+
+#define BO_MAX_WRITERS 4
+#define BO_MAX_READERS 4
+#define BO_MAX_FENCES (BO_MAX_WRITERS + BO_MAX_READERS)
+
 struct nouveau_bo_priv {
 	struct nouveau_bo base;
 	atomic_t refcnt;
 	void* map_addr;
 	uint32_t name;
-	uint32_t access;
 	NvMap map;
+	NvKind kind;
+
+	/* fence is the latest submission referencing the bo.  Writers and
+	 * readers are tracked per syncpoint, as fences on the same channel
+	 * retire in order, oldest first and with unused slots at the end.
+	 * All of them are protected by fence_lock.
+	 */
+	Mutex fence_lock;
 	NvFence fence;
+	NvFence wr_fence[BO_MAX_WRITERS];
+	NvFence rd_fence[BO_MAX_READERS];
+
+	/* References from immediate pushbufs that haven't been submitted yet */
+	atomic_t pending_refs;
+
+	/* Device write sequence number of the last GPU or CPU write, used
+	 * to decide whether a reader needs the GPU caches invalidated, and
+	 * of the last CPU write, used to decide whether a capture needs the
+	 * contents recorded again.
+	 */
+	uint64_t write_seq;
+	uint64_t cpu_write_seq;
+
+	/* Range written by the CPU through a cached mapping and not cleaned
+	 * from the CPU caches yet, empty if dirty_end is zero.
+	 */
+	uint64_t dirty_start;
+	uint64_t dirty_end;
+	/* Range mapped for writing, which stays dirty until it is unmapped
+	 * because the CPU may write through the mapping at any time.
+	 */
+	uint64_t wr_map_start;
+	uint64_t wr_map_end;
+	uint32_t capture_id;
+	uint64_t capture_seq;
+	struct nouveau_bo_slab *slab;
+	drmMMListHead cache_head;
+	drmMMListHead lru_head;
+	uint64_t free_time;
+	/* Alignment the bo was created with, big-page aligned bos are
+	 * mapped with big pages
+	 */
+	uint32_t align;
+
+	/* The first client to reference a bo on a pushbuf keeps its kref
+	 * here instead of in its bo map, kref_gen is the generation of the
+	 * krec it was taken from.
+	 */
+	struct nouveau_client *kref_client;
+	struct nouveau_pushbuf *kref_push;
+	struct drm_nouveau_gem_pushbuf_bo *kref;
+	uint32_t kref_gen;
 };
 
 static inline struct nouveau_bo_priv *
@@ -69,6 +220,42 @@ struct nouveau_device_priv {
 	int nr_client;
 	Mutex lock;
 	NvAddressSpace addr_space;
+	Mutex bo_lock;
+	drmMMListHead slabs[BO_SLAB_NUM_CLASSES];
+	struct nouveau_bo_slab **slab_ids;
+	uint32_t nr_slab_ids;
+	struct nouveau_bo_cache_bucket cache[BO_CACHE_NUM_BUCKETS];
+	int nr_cache_buckets;
+	drmMMListHead cache_lru;
+	uint64_t cache_max_bytes;
+	uint64_t cache_max_age;
+	uint64_t cache_bytes;
+	uint32_t cache_count;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_evictions;
+	uint64_t clear_min_size;
+	uint64_t write_seq;
+	struct nouveau_device_stats stats;
+	u32 ctrl_gpu_fd;
+	bool has_ctrl_gpu;
+
+	Mutex perfmon_lock;
+	const struct nouveau_perfmon_backend *perfmon;
+	void *perfmon_priv;
+	drmMMListHead perfdoms;
+	int nr_perfdoms;
+
+	/* Lazily created channel for nouveau_bo_copy and nouveau_bo_fill */
+	Mutex copy_lock;
+	struct nouveau_client *copy_client;
+	struct nouveau_object *copy_chan;
+	struct nouveau_pushbuf *copy_push;
+
+	Mutex capture_lock;
+	FILE *capture;
+	uint32_t capture_flags;
+	uint32_t capture_id;
 };
 
 static inline struct nouveau_device_priv *
@@ -77,4 +264,183 @@ nouveau_device(struct nouveau_device *dev)
 	return (struct nouveau_device_priv *)dev;
 }
 
+int
+bo_slab_class(uint32_t align, uint64_t size, NvKind kind);
+
+int
+bo_slab_alloc(struct nouveau_device *, int cls, uint32_t flags, NvKind kind,
+              struct nouveau_bo_priv *nvbo);
+
+void
+bo_slab_free(struct nouveau_bo_priv *nvbo);
+
+void
+bo_slab_fini(struct nouveau_device *);
+
+int
+bo_new(struct nouveau_device *, uint32_t flags, uint32_t align, uint64_t size,
+       union nouveau_bo_config *, bool gpu_clear, struct nouveau_bo **);
+
+void
+bo_destroy(struct nouveau_bo_priv *nvbo);
+
+void
+bo_fence_reset(struct nouveau_bo_priv *);
+
+int
+bo_fence_wait(struct nouveau_bo_priv *, uint32_t access);
+
+/* Copies the fences an access has to wait for into fences, which must have
+ * room for BO_MAX_FENCES, and returns their number.
+ */
+int
+bo_fence_get(struct nouveau_bo_priv *, bool write, NvFence *fences);
+
+void
+bo_fence_update(struct nouveau_bo_priv *, NvFence *, bool write);
+
+void
+bo_mark_written(struct nouveau_bo_priv *, bool cpu);
+
+void
+bo_mark_dirty(struct nouveau_bo_priv *, uint64_t offset, uint64_t size);
+
+void
+bo_flush_dirty(struct nouveau_bo_priv *);
+
+int
+bo_map(struct nouveau_bo *, uint32_t access, struct nouveau_client *);
+
+void
+bo_copy_fini(struct nouveau_device *);
+
+void
+bo_cache_init(struct nouveau_device_priv *);
+
+struct nouveau_bo_priv *
+bo_cache_get(struct nouveau_device *, uint64_t *size, uint32_t align,
+             uint32_t flags, NvKind kind);
+
+bool
+bo_cache_put(struct nouveau_bo_priv *nvbo);
+
+void
+bo_cache_fini(struct nouveau_device *);
+
+#define RING_MAX_SEGS 64
+
+struct nouveau_ring_seg {
+	uint64_t end;
+	NvFence fence;
+};
+
+struct nouveau_ring {
+	uint64_t size;
+	uint64_t head;
+	uint64_t tail;
+	struct nouveau_ring_seg seg[RING_MAX_SEGS];
+	unsigned first_seg;
+	unsigned nr_seg;
+	uint64_t stalls;
+};
+
+void
+ring_init(struct nouveau_ring *, uint64_t size);
+
+/* Returns the ring offset of the allocation, blocking on fences until
+ * there is room, or -ENOSPC if only unsubmitted space is left.
+ */
+int64_t
+ring_alloc(struct nouveau_ring *, uint64_t size, uint32_t align);
+
+/* Fences the space up to the virtual position end */
+void
+ring_stamp(struct nouveau_ring *, uint64_t end, NvFence *);
+
+void
+ring_reclaim(struct nouveau_ring *);
+
+/* Event types and phases of the binary trace, the phases map onto the
+ * instant, begin and end events of the Chrome trace format.
+ */
+enum {
+	TRACE_BO_NEW,
+	TRACE_BO_DESTROY,
+	TRACE_VALIDATE,
+	TRACE_KICKOFF,
+	TRACE_FENCE_WAIT,
+	TRACE_FLUSH,
+};
+
+enum {
+	TRACE_INSTANT,
+	TRACE_BEGIN,
+	TRACE_END,
+};
+
+extern volatile bool trace_enabled;
+
+void
+trace_record(uint32_t type, uint32_t phase, uint32_t arg0, uint64_t arg1);
+
+static inline void
+trace_event(uint32_t type, uint32_t phase, uint32_t arg0, uint64_t arg1)
+{
+	if (__builtin_expect(trace_enabled, 0))
+		trace_record(type, phase, arg0, arg1);
+}
+
+struct nouveau_stream {
+	drmMMListHead head;
+	struct nouveau_pushbuf *push;
+	struct nouveau_bo *bo;
+	struct nouveau_ring ring;
+};
+
+void
+pushbuf_stream_attach(struct nouveau_pushbuf *, struct nouveau_stream *);
+
+void
+pushbuf_stream_detach(struct nouveau_pushbuf *, struct nouveau_stream *);
+
+void
+capture_refs(struct nouveau_device *, struct drm_nouveau_gem_pushbuf_bo *, int nr);
+
+void
+capture_submit(struct nouveau_device *, struct drm_nouveau_gem_pushbuf_bo *buffer,
+	       struct drm_nouveau_gem_pushbuf_push *, int nr_push,
+	       bool flush, NvFence *);
+
+int
+perfmon_new(struct nouveau_object *);
+
+void
+perfmon_del(struct nouveau_object *);
+
+int
+perfdom_new(struct nouveau_object *, void *data, uint32_t length);
+
+void
+perfdom_del(struct nouveau_object *);
+
+void
+perfmon_kick(struct nouveau_device *);
+
+int
+pushbuf_kick(struct nouveau_pushbuf *, struct nouveau_object *chan, bool force);
+
+int
+pushbuf_flush_bo(struct nouveau_pushbuf *, struct nouveau_bo *, uint32_t access);
+
+int
+pushbuf_wait_bo(struct nouveau_pushbuf *, struct nouveau_bo *, bool write);
+
+int
+pushbuf_copy(struct nouveau_pushbuf *, struct nouveau_bo *dst, uint64_t doff,
+	     struct nouveau_bo *src, uint64_t soff, uint64_t size);
+
+int
+pushbuf_fill(struct nouveau_pushbuf *, struct nouveau_bo *,
+             uint64_t offset, uint64_t size, uint32_t value);
+
 #endif
@@ -35,6 +35,8 @@
 #include "nouveau.h"
 #include "private.h"
 
+#include "nvif/class.h"
+
 #include <switch.h>
 
 #ifdef DEBUG
@@ -45,12 +47,49 @@
 # define CALLED()
 #endif
 
+/* Not wrapped by libnx, takes the timeslice in microseconds */
+#define NVGPU_IOCTL_CHANNEL_SET_TIMESLICE _NV_IOW(0x48, 0x1D, u32)
+
+#define NVB06F_SEMAPHOREA                 0x0010
+#define NVB06F_SEMAPHORED_OPERATION_RELEASE 0x00000002
+#define NVB06F_SEMAPHORED_RELEASE_WFI_EN  0x00000000
+#define NVB06F_SEMAPHORED_RELEASE_SIZE_16BYTE 0x00000000
+#define NVB06F_SYNCPOINTA                 0x0070
+#define NVB06F_SYNCPOINTB                 0x0074
+#define NVB06F_SYNCPOINTB_WAIT_SWITCH_EN  0x00000010
+
+/* Other channels a submission can wait for, merged per syncpoint */
+#define PUSHBUF_MAX_DEPS 8
+
+/* The second page of the built-in cmdbuf is a ring of syncpoint waits */
+#define BUILTIN_CMDBUF_SIZE 0x2000
+#define BUILTIN_DEP_OFFSET  0x1000
+
+/* Retired overflow command bos kept for reuse by a deferred pushbuf */
+#define CMD_BO_FREE_MAX 16
+
+/* Minimum number of windows a command ring is split into */
+#define RING_WINDOWS 16
+
+/* Initial capacity of a krec, grown on demand up to the pushbuf limits */
+#define KREC_MIN_BUFFERS 32
+#define KREC_MIN_PUSH 16
+
 struct nouveau_pushbuf_krec {
 	struct nouveau_pushbuf_krec *next;
-	struct drm_nouveau_gem_pushbuf_bo buffer[NOUVEAU_GEM_MAX_BUFFERS];
-	struct drm_nouveau_gem_pushbuf_push push[NOUVEAU_GEM_MAX_PUSH];
+	struct drm_nouveau_gem_pushbuf_bo *buffer;
+	struct drm_nouveau_gem_pushbuf_push *push;
 	int nr_buffer;
 	int nr_push;
+	int max_buffer;
+	int max_push;
+	uint32_t gen;
+};
+
+struct pushbuf_bo_list {
+	struct nouveau_bo **bo;
+	int nr;
+	int max;
 };
 
 struct nouveau_pushbuf_priv {
@@ -61,6 +100,39 @@ struct nouveau_pushbuf_priv {
 	struct nouveau_bo *bo;
 	struct nouveau_bo *bo_zcullctx, *bo_builtin_cmdbuf;
 	NvGpuChannel gpu_channel;
+	NvFence fence;
+	int max_buffer;
+	int max_push;
+	uint64_t flush_seq;
+	bool flush_pending;
+	bool elide_flush;
+	struct nouveau_pushbuf_stats stats;
+	struct nouveau_pushbuf_autokick autokick;
+	bool autokick_enabled;
+	bool kick_pending;
+	bool in_flush;
+	bool idle_stats;
+	uint32_t queued_dwords;
+	uint64_t record_start;
+	uint64_t last_submit;
+	bool ring_mode;
+	struct nouveau_ring ring;
+	uint64_t ring_window;
+	uint32_t *ring_start;
+	struct pushbuf_bo_list cmd_used;
+	struct pushbuf_bo_list cmd_free;
+
+	/* owner is the thread last recording into the pushbuf, other threads
+	 * ask it to submit through flush_request.  Submissions are serialised
+	 * with those requests by submit_lock.
+	 */
+	void *owner;
+	Mutex submit_lock;
+	volatile uint32_t flush_request;
+	NvFence deps[PUSHBUF_MAX_DEPS];
+	int nr_deps;
+	struct nouveau_ring dep_ring;
+	drmMMListHead streams;
 	u32 fence_num_cmds;
 	u32 flush_num_cmds;
 	uint32_t type;
@@ -80,6 +152,263 @@ nouveau_pushbuf(struct nouveau_pushbuf *push)
 static int pushbuf_validate(struct nouveau_pushbuf *, bool);
 static int pushbuf_flush(struct nouveau_pushbuf *);
 
+static inline uint32_t
+pushbuf_queued_dwords(struct nouveau_pushbuf *push)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	return nvpb->queued_dwords + (push->cur - nvpb->bgn);
+}
+
+static inline uint64_t
+pushbuf_record_age_us(struct nouveau_pushbuf *push)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+
+	if (!nvpb->record_start)
+		return 0;
+	return armTicksToNs(armGetSystemTick() - nvpb->record_start) / 1000;
+}
+
+static int
+pushbuf_bo_list_add(struct pushbuf_bo_list *list, struct nouveau_bo *bo)
+{
+	struct nouveau_bo **tmp;
+
+	if (list->nr == list->max) {
+		int max = list->max ? list->max * 2 : 8;
+		if (!(tmp = realloc(list->bo, max * sizeof(*tmp))))
+			return -ENOMEM;
+		list->bo = tmp;
+		list->max = max;
+	}
+
+	list->bo[list->nr++] = bo;
+	return 0;
+}
+
+static void
+pushbuf_bo_list_free(struct pushbuf_bo_list *list)
+{
+	while (list->nr--)
+		nouveau_bo_ref(NULL, &list->bo[list->nr]);
+	free(list->bo);
+}
+
+/* Returns an overflow command bo, reusing a retired one the GPU is done
+ * with if possible.
+ */
+static int
+pushbuf_cmd_bo_get(struct nouveau_pushbuf *push, struct nouveau_bo **pbo)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct pushbuf_bo_list *list = &nvpb->cmd_free;
+	struct nouveau_bo *bo = NULL;
+	int ret, i;
+
+	// Oldest first, they are the most likely to be idle
+	for (i = 0; i < list->nr; i++) {
+		if (!bo_fence_wait(nouveau_bo(list->bo[i]), NOUVEAU_BO_WR | NOUVEAU_BO_NOBLOCK)) {
+			bo = list->bo[i];
+			memmove(&list->bo[i], &list->bo[i + 1], (list->nr - i - 1) * sizeof(*list->bo));
+			list->nr--;
+			nvpb->stats.cmd_bo_reuses++;
+			break;
+		}
+	}
+
+	if (!bo) {
+		ret = bo_new(push->client->device, nvpb->type, 0,
+			     nvpb->bos[0]->size, NULL, false, &bo);
+		if (ret)
+			return ret;
+		nvpb->stats.cmd_bo_allocs++;
+	}
+
+	ret = pushbuf_bo_list_add(&nvpb->cmd_used, bo);
+	if (ret) {
+		nouveau_bo_ref(NULL, &bo);
+		return ret;
+	}
+
+	nouveau_bo_ref(bo, pbo);
+	return 0;
+}
+
+/* Moves the overflow command bos that are no longer recorded into onto
+ * the free list, once the recording referencing them has been reset.
+ */
+static void
+pushbuf_cmd_bo_retire(struct nouveau_pushbuf *push)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct pushbuf_bo_list *used = &nvpb->cmd_used;
+	struct pushbuf_bo_list *list = &nvpb->cmd_free;
+	int i, nr = 0;
+
+	for (i = 0; i < used->nr; i++) {
+		struct nouveau_bo *bo = used->bo[i];
+
+		if (bo == nvpb->bo) {
+			used->bo[nr++] = bo;
+			continue;
+		}
+
+		if (list->nr >= CMD_BO_FREE_MAX || pushbuf_bo_list_add(list, bo))
+			nouveau_bo_ref(NULL, &bo);
+	}
+	used->nr = nr;
+
+	if (list->nr > nvpb->stats.cmd_bo_free_hwm)
+		nvpb->stats.cmd_bo_free_hwm = list->nr;
+}
+
+/* Virtual ring position of the command being recorded */
+static inline uint64_t
+pushbuf_ring_pos(struct nouveau_pushbuf *push)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	return nvpb->ring_window + (push->cur - nvpb->ring_start) * 4;
+}
+
+static bool
+pushbuf_autokick_due(struct nouveau_pushbuf *push)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct nouveau_pushbuf_autokick *ak = &nvpb->autokick;
+	uint32_t dwords = pushbuf_queued_dwords(push);
+	uint64_t age = pushbuf_record_age_us(push);
+
+	if (!dwords)
+		return false;
+	if (ak->max_dwords && dwords >= ak->max_dwords)
+		return true;
+	if (ak->max_bos && nvpb->krec->nr_buffer >= ak->max_bos)
+		return true;
+	if (ak->max_age_us && age >= ak->max_age_us)
+		return true;
+	return nvpb->kick_pending && age >= ak->max_delay_us;
+}
+
+static struct nouveau_pushbuf_krec *
+krec_new(struct nouveau_client *client)
+{
+	struct nouveau_client_priv *pcli = nouveau_client(client);
+	struct nouveau_pushbuf_krec *krec;
+
+	mutexLock(&pcli->krec_lock);
+	if ((krec = pcli->krec_pool)) {
+		pcli->krec_pool = krec->next;
+		pcli->nr_krec_pool--;
+		mutexUnlock(&pcli->krec_lock);
+		krec->next = NULL;
+		return krec;
+	}
+	mutexUnlock(&pcli->krec_lock);
+
+	return calloc(1, sizeof(*krec));
+}
+
+static void
+krec_del(struct nouveau_client *client, struct nouveau_pushbuf_krec *krec)
+{
+	struct nouveau_client_priv *pcli = nouveau_client(client);
+
+	krec->nr_buffer = 0;
+	krec->nr_push = 0;
+	krec->gen++;
+
+	mutexLock(&pcli->krec_lock);
+	if (pcli->nr_krec_pool < KREC_POOL_MAX) {
+		krec->next = pcli->krec_pool;
+		pcli->krec_pool = krec;
+		pcli->nr_krec_pool++;
+		mutexUnlock(&pcli->krec_lock);
+		return;
+	}
+	mutexUnlock(&pcli->krec_lock);
+
+	free(krec->buffer);
+	free(krec->push);
+	free(krec);
+}
+
+void
+cli_krec_pool_free(struct nouveau_client *client)
+{
+	struct nouveau_client_priv *pcli = nouveau_client(client);
+	struct nouveau_pushbuf_krec *krec;
+
+	while ((krec = pcli->krec_pool)) {
+		pcli->krec_pool = krec->next;
+		free(krec->buffer);
+		free(krec->push);
+		free(krec);
+	}
+	pcli->nr_krec_pool = 0;
+}
+
+static int
+krec_grow_buffer(struct nouveau_pushbuf *push, int nr)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct nouveau_pushbuf_krec *krec = nvpb->krec;
+	struct drm_nouveau_gem_pushbuf_bo *buffer;
+	int max = krec->max_buffer ? krec->max_buffer : KREC_MIN_BUFFERS;
+	int i;
+
+	// Pooled krecs may be larger than this pushbuf's limit
+	if (nr > nvpb->max_buffer)
+		return -ENOSPC;
+	if (nr <= krec->max_buffer)
+		return 0;
+
+	while (max < nr)
+		max *= 2;
+	if (max > nvpb->max_buffer)
+		max = nvpb->max_buffer;
+
+	buffer = realloc(krec->buffer, max * sizeof(*buffer));
+	if (!buffer)
+		return -ENOMEM;
+
+	// The client bo map points into the array, update it if it moved
+	if (buffer != krec->buffer) {
+		for (i = 0; i < krec->nr_buffer; i++)
+			cli_kref_set(push->client, buffer[i].bo, &buffer[i], push);
+	}
+
+	krec->buffer = buffer;
+	krec->max_buffer = max;
+	return 0;
+}
+
+static int
+krec_grow_push(struct nouveau_pushbuf *push, int nr)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct nouveau_pushbuf_krec *krec = nvpb->krec;
+	struct drm_nouveau_gem_pushbuf_push *kpsh;
+	int max = krec->max_push ? krec->max_push : KREC_MIN_PUSH;
+
+	if (nr > nvpb->max_push)
+		return -ENOSPC;
+	if (nr <= krec->max_push)
+		return 0;
+
+	while (max < nr)
+		max *= 2;
+	if (max > nvpb->max_push)
+		max = nvpb->max_push;
+
+	kpsh = realloc(krec->push, max * sizeof(*kpsh));
+	if (!kpsh)
+		return -ENOMEM;
+
+	krec->push = kpsh;
+	krec->max_push = max;
+	return 0;
+}
+
 static bool
 pushbuf_kref_fits(struct nouveau_pushbuf *push, struct nouveau_bo *bo,
 		  uint32_t *domains)
@@ -90,7 +419,98 @@ pushbuf_kref_fits(struct nouveau_pushbuf *push, struct nouveau_bo *bo,
 	return true;
 }
 
-static struct drm_nouveau_gem_pushbuf_bo *
+static __thread char pushbuf_thread;
+
+static inline void *
+pushbuf_self(void)
+{
+	return &pushbuf_thread;
+}
+
+/* Makes the next submission wait for a fence of another channel */
+static bool
+pushbuf_add_dep(struct nouveau_pushbuf *push, NvFence *fence)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	int i;
+
+	if ((s32)fence->id < 0 ||
+	    fence->id == nvGpuChannelGetSyncpointId(&nvpb->gpu_channel))
+		return true;
+
+	for (i = 0; i < nvpb->nr_deps; i++) {
+		if (nvpb->deps[i].id == fence->id) {
+			if ((s32)(fence->value - nvpb->deps[i].value) > 0)
+				nvpb->deps[i].value = fence->value;
+			return true;
+		}
+	}
+
+	// Deferred pushbufs can't be flushed early, wait for one on the CPU
+	if (nvpb->nr_deps == PUSHBUF_MAX_DEPS) {
+		if (push->channel)
+			return false;
+		nvFenceWait(&nvpb->deps[0], -1);
+		nvpb->deps[0] = *fence;
+		return true;
+	}
+
+	nvpb->deps[nvpb->nr_deps++] = *fence;
+	return true;
+}
+
+/* Orders the commands about to reference bo on push after the ones already
+ * recorded on fpush.  A pushbuf recorded by the calling thread is flushed
+ * right away, after which bo carries the fence of that submission.  One
+ * recorded by another thread can't be submitted from here, and waiting for
+ * a fence it hasn't issued yet could stall the GPU for as long as that
+ * thread keeps recording.  It is asked to submit at its next
+ * nouveau_pushbuf_space() or kick instead, and -EBUSY is returned.
+ */
+static int
+pushbuf_order_after(struct nouveau_pushbuf *push, struct nouveau_pushbuf *fpush,
+		    struct nouveau_bo *bo)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct nouveau_pushbuf_priv *fnvpb = nouveau_pushbuf(fpush);
+	int ret = 0;
+
+	if (fnvpb->owner == pushbuf_self()) {
+		nvpb->stats.cross_flushes++;
+		return pushbuf_flush(fpush);
+	}
+
+	mutexLock(&fnvpb->submit_lock);
+	if (cli_push_get(push->client, bo) == fpush) {
+		if (fpush->channel)
+			fnvpb->flush_request = 1;
+		ret = -EBUSY;
+	}
+	mutexUnlock(&fnvpb->submit_lock);
+
+	return ret;
+}
+
+/* Makes the next submission of push wait for the accesses of other
+ * channels to bo that conflict with the given one.  Bos only carry the
+ * fences of submitted work, so this never waits for commands that are
+ * still being recorded.
+ */
+static void
+pushbuf_order_channels(struct nouveau_pushbuf *push, struct nouveau_bo *bo,
+		       bool write)
+{
+	NvFence fences[BO_MAX_FENCES];
+	int nr, i;
+
+	nr = bo_fence_get(nouveau_bo(bo), write, fences);
+	for (i = 0; i < nr; i++) {
+		if (!pushbuf_add_dep(push, &fences[i]))
+			nvFenceWait(&fences[i], -1);
+	}
+}
+
+static int
 pushbuf_kref(struct nouveau_pushbuf *push, struct nouveau_bo *bo,
 	     uint32_t flags)
 {
@@ -98,31 +518,53 @@ pushbuf_kref(struct nouveau_pushbuf *push, struct nouveau_bo *bo,
 
 	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
 	struct nouveau_pushbuf_krec *krec = nvpb->krec;
+	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
 	struct nouveau_pushbuf *fpush;
 	struct drm_nouveau_gem_pushbuf_bo *kref;
 	uint32_t domains, domains_wr, domains_rd;
+	int ret;
 
 	domains = NOUVEAU_GEM_DOMAIN_GART;
 
 	domains_wr = domains * !!(flags & NOUVEAU_BO_WR);
 	domains_rd = domains * !!(flags & NOUVEAU_BO_RD);
 
+	/* fast path: the bo is already on this pushbuf's current krec */
+	if (nvbo->kref_push == push && nvbo->kref_client == push->client &&
+	    nvbo->kref_gen == krec->gen) {
+		kref = nvbo->kref;
+		__sync_synchronize();
+		if (nvbo->kref_push == push &&
+		    (!domains_wr || kref->write_domains)) {
+			kref->write_domains |= domains_wr;
+			kref->read_domains  |= domains_rd;
+			return 0;
+		}
+	}
+
 	/* if buffer is referenced on another pushbuf that is owned by the
 	 * same client, we need to flush the other pushbuf first to ensure
 	 * the correct ordering of commands
 	 */
 	fpush = cli_push_get(push->client, bo);
-	if (fpush && fpush != push)
-		pushbuf_flush(fpush);
+	if (fpush && fpush != push) {
+		ret = pushbuf_order_after(push, fpush, bo);
+		if (ret)
+			return ret;
+	}
 
-	kref = cli_kref_get(push->client, bo);
+	kref = cli_kref_get(push->client, bo, push);
+	if (!kref || (domains_wr && !kref->write_domains))
+		pushbuf_order_channels(push, bo, domains_wr);
 	if (kref) {
 		kref->write_domains |= domains_wr;
 		kref->read_domains  |= domains_rd;
 	} else {
-		if (krec->nr_buffer == NOUVEAU_GEM_MAX_BUFFERS ||
-		    !pushbuf_kref_fits(push, bo, &domains))
-			return NULL;
+		ret = krec_grow_buffer(push, krec->nr_buffer + 1);
+		if (ret)
+			return ret;
+		if (!pushbuf_kref_fits(push, bo, &domains))
+			return -ENOSPC;
 
 		kref = &krec->buffer[krec->nr_buffer++];
 		kref->bo = bo;
@@ -130,10 +572,14 @@ pushbuf_kref(struct nouveau_pushbuf *push, struct nouveau_bo *bo,
 		kref->write_domains = domains_wr;
 		kref->read_domains = domains_rd;
 		cli_kref_set(push->client, bo, kref, push);
-		atomic_inc(&nouveau_bo(bo)->refcnt);
+		if (nvbo->kref_client == push->client)
+			nvbo->kref_gen = krec->gen;
+		atomic_inc(&nvbo->refcnt);
+		if (push->channel)
+			atomic_inc(&nvbo->pending_refs);
 	}
 
-	return kref;
+	return 0;
 }
 
 #if 0
@@ -181,6 +627,67 @@ pushbuf_dump(struct nouveau_pushbuf_krec *krec, int krec_id, int chid)
 
 }
 
+/* The GPU caches only need to be invalidated if the krec reads a bo that
+ * was written, by the GPU or the CPU, since this channel last flushed them.
+ * Writes through mappings kept across submissions aren't seen, so this is
+ * only trusted when the pushbuf was created with NOUVEAU_PUSHBUF_ELIDE_FLUSH.
+ */
+static bool
+pushbuf_needs_flush(struct nouveau_pushbuf *push, struct nouveau_pushbuf_krec *krec)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct drm_nouveau_gem_pushbuf_bo *kref = krec->buffer;
+	int i;
+
+	if (!nvpb->elide_flush || nvpb->flush_pending)
+		return true;
+
+	for (i = 0; i < krec->nr_buffer; i++, kref++) {
+		if (kref->read_domains &&
+		    nouveau_bo(kref->bo)->write_seq > nvpb->flush_seq)
+			return true;
+	}
+
+	return false;
+}
+
+/* The waits for other channels run ahead of the commands of a submission,
+ * from a ring in the built-in cmdbuf that is fenced by the submission.
+ */
+static void
+pushbuf_emit_deps(struct nouveau_pushbuf *push)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	uint32_t *cmd;
+	int64_t off;
+	int i;
+
+	if (!nvpb->nr_deps)
+		return;
+
+	off = ring_alloc(&nvpb->dep_ring, nvpb->nr_deps * 16, 4);
+	if (off < 0) {
+		// Every submission stamps the ring, so this is not expected
+		for (i = 0; i < nvpb->nr_deps; i++)
+			nvFenceWait(&nvpb->deps[i], -1);
+		nvpb->nr_deps = 0;
+		return;
+	}
+
+	cmd = (uint32_t *)((char *)nvpb->bo_builtin_cmdbuf->map + BUILTIN_DEP_OFFSET + off);
+	for (i = 0; i < nvpb->nr_deps; i++) {
+		*cmd++ = (NVB06F_SYNCPOINTA >> 2) | (1 << 16) | (1 << 29);
+		*cmd++ = nvpb->deps[i].value;
+		*cmd++ = (NVB06F_SYNCPOINTB >> 2) | (1 << 16) | (1 << 29);
+		*cmd++ = (nvpb->deps[i].id << 8) | NVB06F_SYNCPOINTB_WAIT_SWITCH_EN;
+	}
+
+	nvGpuChannelAppendEntry(&nvpb->gpu_channel,
+		nvpb->bo_builtin_cmdbuf->offset + BUILTIN_DEP_OFFSET + off,
+		nvpb->nr_deps * 4, GPFIFO_ENTRY_NOT_MAIN, 0);
+	nvpb->nr_deps = 0;
+}
+
 static int
 pushbuf_submit(struct nouveau_pushbuf *push, struct nouveau_object *chan)
 {
@@ -189,16 +696,22 @@ pushbuf_submit(struct nouveau_pushbuf *push, struct nouveau_object *chan)
 	struct nouveau_pushbuf_krec *krec = nvpb->list;
 	struct drm_nouveau_gem_pushbuf_bo *kref;
 	struct drm_nouveau_gem_pushbuf_push *kpsh;
+	struct nouveau_device_priv *nvdev = nouveau_device(push->client->device);
 	struct nouveau_fifo *fifo = chan->data;
 	struct nouveau_bo *bo;
 	struct nouveau_bo_priv *nvbo;
+	struct nouveau_stream *stream;
 	int krec_id = 0;
 	int ret = 0, i;
+	uint32_t entries;
+	bool flush;
 	Result rc;
 
 	if (chan->oclass != NOUVEAU_FIFO_CHANNEL_CLASS)
 		return -EINVAL;
 
+	nvpb->flush_request = 0;
+
 	if (push->kick_notify)
 		push->kick_notify(push);
 
@@ -209,6 +722,36 @@ pushbuf_submit(struct nouveau_pushbuf *push, struct nouveau_object *chan)
 		//pushbuf_dump(krec, krec_id++, fifo->channel);
 #endif
 
+		pushbuf_emit_deps(push);
+
+		flush = pushbuf_needs_flush(push, krec);
+		if (flush) {
+			// Invalidate the GPU caches before work that reads data written since the last flush.
+			nvGpuChannelAppendEntry(&nvpb->gpu_channel,
+				nvpb->bo_builtin_cmdbuf->offset+4*nvpb->fence_num_cmds, nvpb->flush_num_cmds,
+				GPFIFO_ENTRY_NOT_MAIN, 0);
+
+			// Append a dummy NOP cmdlist with NO_PREFETCH set (used as a barrier), to make sure that all
+			// further submitted cmdlists see the effects of the previous cache flushing cmdlist.
+			nvGpuChannelAppendEntry(&nvpb->gpu_channel,
+				nvpb->bo_builtin_cmdbuf->offset+4*(nvpb->fence_num_cmds+nvpb->flush_num_cmds), 1,
+				GPFIFO_ENTRY_NOT_MAIN | GPFIFO_ENTRY_NO_PREFETCH, 0);
+
+			nvpb->flush_seq = nvdev->write_seq;
+			nvpb->flush_pending = false;
+			nvpb->stats.flushes++;
+			trace_event(TRACE_FLUSH, TRACE_INSTANT, fifo->channel, 0);
+		} else
+			nvpb->stats.flushes_elided++;
+
+		// Write back what the CPU wrote to cached bos since they were mapped
+		kref = krec->buffer;
+		for (i = 0; i < krec->nr_buffer; i++, kref++)
+			bo_flush_dirty(nouveau_bo(kref->bo));
+
+		if (nvdev->capture)
+			capture_refs(&nvdev->base, krec->buffer, krec->nr_buffer);
+
 		kpsh = krec->push;
 		for (i = 0; i < krec->nr_push; i++, kpsh++) {
 			kref = krec->buffer + kpsh->bo_index;
@@ -219,6 +762,7 @@ pushbuf_submit(struct nouveau_pushbuf *push, struct nouveau_object *chan)
 				bo->offset + kpsh->offset,
 				kpsh->length / 4,
 				GPFIFO_ENTRY_NOT_MAIN, 0);
+			nvpb->stats.dwords += kpsh->length / 4;
 		}
 
 		// Append the command list used to increase the fence syncpoint.
@@ -227,9 +771,23 @@ pushbuf_submit(struct nouveau_pushbuf *push, struct nouveau_object *chan)
 			nvpb->bo_builtin_cmdbuf->offset, nvpb->fence_num_cmds,
 			GPFIFO_ENTRY_NOT_MAIN | GPFIFO_ENTRY_NO_PREFETCH, 0);
 
+		// Account for the time the GPU may have sat idle waiting for us,
+		// which costs a fence poll per submission.
+		if (nvpb->idle_stats) {
+			uint64_t now = armGetSystemTick();
+			if ((s32)nvpb->fence.id >= 0 && R_SUCCEEDED(nvFenceWait(&nvpb->fence, 0))) {
+				nvpb->stats.idle_kicks++;
+				nvpb->stats.idle_ns += armTicksToNs(now - nvpb->last_submit);
+			}
+			nvpb->last_submit = now;
+		}
+
 		// Flush the GPU channel.
 		NvFence fence;
 		TRACE("Submitting %u entries to GPU channel\n", nvpb->gpu_channel.num_entries);
+		nvpb->stats.kicks++;
+		nvpb->stats.gpfifo_entries += nvpb->gpu_channel.num_entries;
+		entries = nvpb->gpu_channel.num_entries;
 		rc = nvGpuChannelKickoff(&nvpb->gpu_channel);
 		if (R_FAILED(rc)) {
 			TRACE("GPU channel rejected pushbuf: %x\n", rc);
@@ -239,29 +797,29 @@ pushbuf_submit(struct nouveau_pushbuf *push, struct nouveau_object *chan)
 
 		// Store the fence in all referenced bos.
 		nvGpuChannelGetFence(&nvpb->gpu_channel, &fence);
+		trace_event(TRACE_KICKOFF, TRACE_INSTANT, entries,
+			    ((uint64_t)fence.id << 32) | fence.value);
+		nvpb->fence = fence;
+		ring_stamp(&nvpb->dep_ring, nvpb->dep_ring.head, &fence);
+		DRMLISTFOREACHENTRY(stream, &nvpb->streams, head)
+			ring_stamp(&stream->ring, stream->ring.head, &fence);
+		if (nvpb->ring_mode)
+			ring_stamp(&nvpb->ring, pushbuf_ring_pos(push), &fence);
+		if (nvdev->capture)
+			capture_submit(&nvdev->base, krec->buffer, krec->push, krec->nr_push, flush, &fence);
 		TRACE("Received fence {%d,%u}\n", (int)fence.id, fence.value);
 		kref = krec->buffer;
 		for (i = 0; i < krec->nr_buffer; i++, kref++) {
 			bo = kref->bo;
 			nvbo = nouveau_bo(bo);
 
-			nvbo->fence = fence;
+			bo_fence_update(nvbo, &fence, !!kref->write_domains);
 			if (kref->write_domains)
-				nvbo->access |= NOUVEAU_BO_WR;
-			if (kref->read_domains)
-				nvbo->access |= NOUVEAU_BO_RD;
+				bo_mark_written(nvbo, false);
 		}
 
-		// Append the command list used to flush GPU caches, which will be used by the next pushbuf_submit.
-		nvGpuChannelAppendEntry(&nvpb->gpu_channel,
-			nvpb->bo_builtin_cmdbuf->offset+4*nvpb->fence_num_cmds, nvpb->flush_num_cmds,
-			GPFIFO_ENTRY_NOT_MAIN, 0);
-
-		// Append a dummy NOP cmdlist with NO_PREFETCH set (used as a barrier), to make sure that all
-		// further submitted cmdlists see the effects of the previous cache flushing cmdlist.
-		nvGpuChannelAppendEntry(&nvpb->gpu_channel,
-			nvpb->bo_builtin_cmdbuf->offset+4*(nvpb->fence_num_cmds+nvpb->flush_num_cmds), 1,
-			GPFIFO_ENTRY_NOT_MAIN | GPFIFO_ENTRY_NO_PREFETCH, 0);
+		if (nvdev->nr_perfdoms)
+			perfmon_kick(&nvdev->base);
 
 		krec = krec->next;
 	}
@@ -269,6 +827,14 @@ pushbuf_submit(struct nouveau_pushbuf *push, struct nouveau_object *chan)
 	return ret;
 }
 
+static void
+pushbuf_autokick_reset(struct nouveau_pushbuf_priv *nvpb)
+{
+	nvpb->queued_dwords = 0;
+	nvpb->record_start = 0;
+	nvpb->kick_pending = false;
+}
+
 static int
 pushbuf_flush(struct nouveau_pushbuf *push)
 {
@@ -280,19 +846,41 @@ pushbuf_flush(struct nouveau_pushbuf *push)
 	struct nouveau_bo *bo;
 	int ret = 0, i;
 
-	ret = pushbuf_submit(push, push->channel);
+	// Deferred pushbufs are replayed as a whole by each kick, chain a new
+	// krec to the recording instead of submitting it.
+	if (!push->channel) {
+		nouveau_pushbuf_data(push, NULL, 0, 0);
+		krec->next = krec_new(push->client);
+		if (!krec->next)
+			return -ENOMEM;
+		nvpb->krec = krec->next;
+	}
+
+	// kick_notify may record into the pushbuf, which must neither see the
+	// thresholds that led here nor try to submit again.
+	pushbuf_autokick_reset(nvpb);
+	nvpb->in_flush = true;
+	mutexLock(&nvpb->submit_lock);
+	if (push->channel)
+		ret = pushbuf_submit(push, push->channel);
 
 	kref = krec->buffer;
 	for (i = 0; i < krec->nr_buffer; i++, kref++) {
 		bo = kref->bo;
-		cli_kref_set(push->client, bo, NULL, NULL);
-		if (push->channel)
+		cli_kref_clear(push->client, bo, push);
+		if (push->channel) {
+			atomic_dec(&nouveau_bo(bo)->pending_refs, 1);
 			nouveau_bo_ref(NULL, &bo);
+		}
 	}
+	mutexUnlock(&nvpb->submit_lock);
+	nvpb->in_flush = false;
 
 	krec = nvpb->krec;
 	krec->nr_buffer = 0;
 	krec->nr_push = 0;
+	krec->gen++;
+	pushbuf_autokick_reset(nvpb);
 
 	DRMLISTFOREACHENTRYSAFE(bctx, btmp, &nvpb->bctx_list, head) {
 		DRMLISTJOIN(&bctx->current, &bctx->pending);
@@ -314,7 +902,9 @@ pushbuf_refn_fail(struct nouveau_pushbuf *push, int sref)
 	kref = krec->buffer + sref;
 	while (krec->nr_buffer-- > sref) {
 		struct nouveau_bo *bo = kref->bo;
-		cli_kref_set(push->client, bo, NULL, NULL);
+		cli_kref_clear(push->client, bo, push);
+		if (push->channel)
+			atomic_dec(&nouveau_bo(bo)->pending_refs, 1);
 		nouveau_bo_ref(NULL, &bo);
 		kref++;
 	}
@@ -329,22 +919,21 @@ pushbuf_refn(struct nouveau_pushbuf *push, bool retry,
 
 	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
 	struct nouveau_pushbuf_krec *krec = nvpb->krec;
-	struct drm_nouveau_gem_pushbuf_bo *kref;
 	int sref = krec->nr_buffer;
 	int ret = 0, i;
 
+	nvpb->owner = pushbuf_self();
 	for (i = 0; i < nr; i++) {
-		kref = pushbuf_kref(push, refs[i].bo, refs[i].flags);
-		if (!kref) {
-			ret = -ENOSPC;
+		ret = pushbuf_kref(push, refs[i].bo, refs[i].flags);
+		if (ret)
 			break;
-		}
 	}
 
 	if (ret) {
 		pushbuf_refn_fail(push, sref);
-		if (retry) {
+		if (retry && ret == -ENOSPC) {
 			pushbuf_flush(push);
+			nvpb->stats.limit_flushes++;
 			nouveau_pushbuf_space(push, 0, 0, 0);
 			return pushbuf_refn(push, false, refs, nr);
 		}
@@ -359,7 +948,6 @@ pushbuf_validate(struct nouveau_pushbuf *push, bool retry)
 	CALLED();
 	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
 	struct nouveau_pushbuf_krec *krec = nvpb->krec;
-	struct drm_nouveau_gem_pushbuf_bo *kref;
 	struct nouveau_bufctx *bctx = push->bufctx;
 	struct nouveau_bufref *bref;
 	int relocs = bctx ? bctx->relocs * 2: 0;
@@ -375,11 +963,9 @@ pushbuf_validate(struct nouveau_pushbuf *push, bool retry)
 	DRMLISTADD(&bctx->head, &nvpb->bctx_list);
 
 	DRMLISTFOREACHENTRY(bref, &bctx->pending, thead) {
-		kref = pushbuf_kref(push, bref->bo, bref->flags);
-		if (!kref) {
-			ret = -ENOSPC;
+		ret = pushbuf_kref(push, bref->bo, bref->flags);
+		if (ret)
 			break;
-		}
 	}
 
 	DRMLISTJOIN(&bctx->pending, &bctx->current);
@@ -387,8 +973,9 @@ pushbuf_validate(struct nouveau_pushbuf *push, bool retry)
 
 	if (ret) {
 		pushbuf_refn_fail(push, sref);
-		if (retry) {
+		if (retry && ret == -ENOSPC) {
 			pushbuf_flush(push);
+			nvpb->stats.limit_flushes++;
 			return pushbuf_validate(push, false);
 		}
 	}
@@ -422,64 +1009,360 @@ generate_flush_cmdlist(u32* buf_start)
 	return cmd - buf_start;
 }
 
+/* The copy engine is bound to the same subchannel Mesa uses for it */
+#define SUBC_COPY 4
+
+#define NVB0B5_LAUNCH_DMA             0x0300
+#define NVB0B5_OFFSET_IN_UPPER        0x0400
+#define NVB0B5_OFFSET_OUT_UPPER       0x0408
+#define NVB0B5_SET_REMAP_CONST_A      0x0700
+
+#define NVB0B5_LAUNCH_DMA_NON_PIPELINED   0x00000002
+#define NVB0B5_LAUNCH_DMA_FLUSH_ENABLE    0x00000004
+#define NVB0B5_LAUNCH_DMA_SRC_PITCH       0x00000080
+#define NVB0B5_LAUNCH_DMA_DST_PITCH       0x00000100
+#define NVB0B5_LAUNCH_DMA_MULTI_LINE      0x00000200
+#define NVB0B5_LAUNCH_DMA_REMAP_ENABLE    0x00000400
+
+#define NVB0B5_REMAP_DST_X_CONST_A        0x00000004
+#define NVB0B5_REMAP_COMPONENT_SIZE_FOUR  0x00030000
+
+#define FILL_LINE_SIZE 0x10000
+
+static inline void
+pushbuf_mthd(struct nouveau_pushbuf *push, int subc, uint32_t mthd, uint32_t size)
+{
+	*push->cur++ = (mthd >> 2) | (subc << 13) | (size << 16) | (1 << 29);
+}
+
+static void
+pushbuf_fill_lines(struct nouveau_pushbuf *push, uint64_t addr,
+		   uint32_t line_size, uint32_t lines)
+{
+	uint32_t launch = NVB0B5_LAUNCH_DMA_NON_PIPELINED |
+			  NVB0B5_LAUNCH_DMA_FLUSH_ENABLE |
+			  NVB0B5_LAUNCH_DMA_SRC_PITCH |
+			  NVB0B5_LAUNCH_DMA_DST_PITCH |
+			  NVB0B5_LAUNCH_DMA_REMAP_ENABLE;
+
+	if (lines > 1)
+		launch |= NVB0B5_LAUNCH_DMA_MULTI_LINE;
+
+	pushbuf_mthd(push, SUBC_COPY, NVB0B5_OFFSET_OUT_UPPER, 6);
+	*push->cur++ = addr >> 32;
+	*push->cur++ = addr;
+	*push->cur++ = 0;		/* PITCH_IN */
+	*push->cur++ = line_size;	/* PITCH_OUT */
+	*push->cur++ = line_size / 4;	/* LINE_LENGTH_IN, in remapped units */
+	*push->cur++ = lines;		/* LINE_COUNT */
+	pushbuf_mthd(push, SUBC_COPY, NVB0B5_LAUNCH_DMA, 1);
+	*push->cur++ = launch;
+}
+
 int
-nouveau_pushbuf_new(struct nouveau_client *client, struct nouveau_object *chan,
-		    int nr, uint32_t size, bool immediate,
-		    struct nouveau_pushbuf **ppush)
+pushbuf_fill(struct nouveau_pushbuf *push, struct nouveau_bo *bo,
+	     uint64_t offset, uint64_t size, uint32_t value)
 {
 	CALLED();
-	struct nouveau_device_priv *nvdev = nouveau_device(client->device);
-	struct nouveau_pushbuf_priv *nvpb;
-	struct nouveau_pushbuf *push;
+	struct nouveau_pushbuf_refn ref = { bo, NOUVEAU_BO_WR | NOUVEAU_BO_GART };
+	uint64_t addr = bo->offset + offset;
+	uint32_t lines = size / FILL_LINE_SIZE;
 	int ret;
 
-	nvpb = calloc(1, sizeof(*nvpb) + nr * sizeof(*nvpb->bos));
+	if ((offset | size) & 3)
+		return -EINVAL;
+
+	ret = nouveau_pushbuf_space(push, 24, 0, 0);
+	if (ret)
+		return ret;
+
+	ret = nouveau_pushbuf_refn(push, &ref, 1);
+	if (ret)
+		return ret;
+
+	pushbuf_mthd(push, SUBC_COPY, 0x0000, 1);
+	*push->cur++ = MAXWELL_DMA_COPY_A;
+
+	pushbuf_mthd(push, SUBC_COPY, NVB0B5_SET_REMAP_CONST_A, 3);
+	*push->cur++ = value;
+	*push->cur++ = 0;
+	*push->cur++ = NVB0B5_REMAP_DST_X_CONST_A | NVB0B5_REMAP_COMPONENT_SIZE_FOUR;
+
+	if (lines) {
+		pushbuf_fill_lines(push, addr, FILL_LINE_SIZE, lines);
+		addr += (uint64_t)lines * FILL_LINE_SIZE;
+		size -= (uint64_t)lines * FILL_LINE_SIZE;
+	}
+
+	if (size)
+		pushbuf_fill_lines(push, addr, size, 1);
+
+	return 0;
+}
+
+static void
+pushbuf_copy_lines(struct nouveau_pushbuf *push, uint64_t dst, uint64_t src,
+		   uint32_t line_size, uint32_t lines)
+{
+	uint32_t launch = NVB0B5_LAUNCH_DMA_NON_PIPELINED |
+			  NVB0B5_LAUNCH_DMA_FLUSH_ENABLE |
+			  NVB0B5_LAUNCH_DMA_SRC_PITCH |
+			  NVB0B5_LAUNCH_DMA_DST_PITCH;
+
+	if (lines > 1)
+		launch |= NVB0B5_LAUNCH_DMA_MULTI_LINE;
+
+	pushbuf_mthd(push, SUBC_COPY, NVB0B5_OFFSET_IN_UPPER, 8);
+	*push->cur++ = src >> 32;
+	*push->cur++ = src;
+	*push->cur++ = dst >> 32;
+	*push->cur++ = dst;
+	*push->cur++ = line_size;	/* PITCH_IN */
+	*push->cur++ = line_size;	/* PITCH_OUT */
+	*push->cur++ = line_size;	/* LINE_LENGTH_IN */
+	*push->cur++ = lines;		/* LINE_COUNT */
+	pushbuf_mthd(push, SUBC_COPY, NVB0B5_LAUNCH_DMA, 1);
+	*push->cur++ = launch;
+}
+
+int
+pushbuf_copy(struct nouveau_pushbuf *push, struct nouveau_bo *dst, uint64_t doff,
+	     struct nouveau_bo *src, uint64_t soff, uint64_t size)
+{
+	CALLED();
+	struct nouveau_pushbuf_refn refs[] = {
+		{ dst, NOUVEAU_BO_WR | NOUVEAU_BO_GART },
+		{ src, NOUVEAU_BO_RD | NOUVEAU_BO_GART },
+	};
+	uint64_t daddr = dst->offset + doff;
+	uint64_t saddr = src->offset + soff;
+	uint32_t lines = size / FILL_LINE_SIZE;
+	int ret;
+
+	ret = nouveau_pushbuf_space(push, 24, 0, 0);
+	if (ret)
+		return ret;
+
+	ret = nouveau_pushbuf_refn(push, refs, 2);
+	if (ret)
+		return ret;
+
+	pushbuf_mthd(push, SUBC_COPY, 0x0000, 1);
+	*push->cur++ = MAXWELL_DMA_COPY_A;
+
+	if (lines) {
+		pushbuf_copy_lines(push, daddr, saddr, FILL_LINE_SIZE, lines);
+		daddr += (uint64_t)lines * FILL_LINE_SIZE;
+		saddr += (uint64_t)lines * FILL_LINE_SIZE;
+		size -= (uint64_t)lines * FILL_LINE_SIZE;
+	}
+
+	if (size)
+		pushbuf_copy_lines(push, daddr, saddr, size, 1);
+
+	return 0;
+}
+
+/* Makes the channel wait for a fence from another channel before running
+ * any further commands.  Fences of the channel itself are skipped, they
+ * are ordered by the GPFIFO already.
+ */
+static int
+pushbuf_wait_fence(struct nouveau_pushbuf *push, NvFence *fence)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	int ret;
+
+	if ((s32)fence->id < 0 ||
+	    fence->id == nvGpuChannelGetSyncpointId(&nvpb->gpu_channel) ||
+	    R_SUCCEEDED(nvFenceWait(fence, 0)))
+		return 0;
+
+	ret = nouveau_pushbuf_space(push, 4, 0, 0);
+	if (ret)
+		return ret;
+
+	pushbuf_mthd(push, 0, NVB06F_SYNCPOINTA, 1);
+	*push->cur++ = fence->value;
+	pushbuf_mthd(push, 0, NVB06F_SYNCPOINTB, 1);
+	*push->cur++ = (fence->id << 8) | NVB06F_SYNCPOINTB_WAIT_SWITCH_EN;
+	return 0;
+}
+
+/* Waits for the GPU accesses to a bo that conflict with the given access */
+int
+pushbuf_wait_bo(struct nouveau_pushbuf *push, struct nouveau_bo *bo, bool write)
+{
+	NvFence fences[BO_MAX_FENCES];
+	int ret, nr, i;
+
+	nr = bo_fence_get(nouveau_bo(bo), write, fences);
+	for (i = 0; i < nr; i++) {
+		ret = pushbuf_wait_fence(push, &fences[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* A four word host semaphore release writes the payload followed by the
+ * GPU time, WFI makes it wait for the work before it to complete.
+ */
+int
+nouveau_pushbuf_timestamp(struct nouveau_pushbuf *push, struct nouveau_bo *bo,
+			  uint32_t offset)
+{
+	CALLED();
+	struct nouveau_pushbuf_refn ref = { bo, NOUVEAU_BO_WR | NOUVEAU_BO_GART };
+	uint64_t addr = bo->offset + offset;
+	int ret;
+
+	if ((offset & 15) || offset > bo->size || bo->size - offset < 16)
+		return -EINVAL;
+
+	ret = nouveau_pushbuf_space(push, 5, 0, 0);
+	if (ret)
+		return ret;
+
+	ret = nouveau_pushbuf_refn(push, &ref, 1);
+	if (ret)
+		return ret;
+
+	pushbuf_mthd(push, 0, NVB06F_SEMAPHOREA, 4);
+	*push->cur++ = addr >> 32;
+	*push->cur++ = addr;
+	*push->cur++ = 0;
+	*push->cur++ = NVB06F_SEMAPHORED_OPERATION_RELEASE |
+		       NVB06F_SEMAPHORED_RELEASE_WFI_EN |
+		       NVB06F_SEMAPHORED_RELEASE_SIZE_16BYTE;
+	return 0;
+}
+
+int
+nouveau_pushbuf_fence_wait(struct nouveau_pushbuf *push,
+			   const struct nouveau_fence *fence)
+{
+	CALLED();
+	NvFence nvfence = { fence->id, fence->value };
+	return pushbuf_wait_fence(push, &nvfence);
+}
+
+int
+nouveau_pushbuf_new(struct nouveau_client *client, struct nouveau_object *chan,
+		    int nr, uint32_t size, bool immediate,
+		    struct nouveau_pushbuf **ppush)
+{
+	CALLED();
+	return nouveau_pushbuf_new_attr(client, chan, nr, size, immediate,
+					NULL, ppush);
+}
+
+int
+nouveau_pushbuf_new_attr(struct nouveau_client *client,
+			 struct nouveau_object *chan, int nr, uint32_t size,
+			 bool immediate, const struct nouveau_pushbuf_attr *attr,
+			 struct nouveau_pushbuf **ppush)
+{
+	CALLED();
+	struct nouveau_device_priv *nvdev = nouveau_device(client->device);
+	struct nouveau_pushbuf_priv *nvpb;
+	struct nouveau_pushbuf *push;
+	int ret;
+
+	nvpb = calloc(1, sizeof(*nvpb) + nr * sizeof(*nvpb->bos));
 	if (!nvpb)
 		return -ENOMEM;
 
-	nvpb->krec = calloc(1, sizeof(*nvpb->krec));
+	DRMINITLISTHEAD(&nvpb->streams);
+	nvpb->krec = krec_new(client);
 	nvpb->list = nvpb->krec;
 	if (!nvpb->krec) {
 		free(nvpb);
 		return -ENOMEM;
 	}
 
+	nvpb->max_buffer = NOUVEAU_GEM_MAX_BUFFERS;
+	nvpb->max_push = NOUVEAU_GEM_MAX_PUSH;
+	if (attr && attr->max_buffers)
+		nvpb->max_buffer = attr->max_buffers;
+	if (attr && attr->max_pushes)
+		nvpb->max_push = attr->max_pushes;
+	nvpb->fence.id = UINT32_MAX;
+	nvpb->owner = pushbuf_self();
+	nvpb->elide_flush = attr && (attr->flags & NOUVEAU_PUSHBUF_ELIDE_FLUSH);
+	nvpb->idle_stats = attr && (attr->flags & NOUVEAU_PUSHBUF_IDLE_STATS);
+
 	push = &nvpb->base;
 	push->client = client;
 	push->channel = immediate ? chan : NULL;
 	push->flags = NOUVEAU_BO_RD | NOUVEAU_BO_GART | NOUVEAU_BO_MAP;
 	nvpb->type = NOUVEAU_BO_GART;
 
-	for (nvpb->bo_nr = 0; nvpb->bo_nr < nr; nvpb->bo_nr++) {
-		ret = nouveau_bo_new(client->device, nvpb->type, 0, size,
-				     NULL, &nvpb->bos[nvpb->bo_nr]);
+	if (attr && (attr->flags & NOUVEAU_PUSHBUF_RING)) {
+		// Deferred pushbufs are replayed, so their commands must stay put
+		if (!immediate) {
+			nouveau_pushbuf_del(&push);
+			return -EINVAL;
+		}
+
+		ret = bo_new(client->device, nvpb->type, 0,
+			     (uint64_t)nr * size, NULL, false, &nvpb->bos[0]);
+		if (!ret)
+			ret = bo_map(nvpb->bos[0], NOUVEAU_BO_WR, client);
 		if (ret) {
 			nouveau_pushbuf_del(&push);
 			return ret;
 		}
+
+		nvpb->bo_nr = 1;
+		nvpb->ring_mode = true;
+		ring_init(&nvpb->ring, nvpb->bos[0]->size);
+		nouveau_bo_ref(nvpb->bos[0], &nvpb->bo);
 	}
 
-	ret = nouveau_bo_new(client->device, NOUVEAU_BO_GART, 0x20000, 0x1000, NULL, &nvpb->bo_builtin_cmdbuf);
+	for (; nvpb->bo_nr < nr && !nvpb->ring_mode; nvpb->bo_nr++) {
+		ret = bo_new(client->device, nvpb->type, 0, size,
+			     NULL, false, &nvpb->bos[nvpb->bo_nr]);
+		if (ret) {
+			nouveau_pushbuf_del(&push);
+			return ret;
+		}
+	}
+
+	ret = bo_new(client->device, NOUVEAU_BO_GART, 0x20000, BUILTIN_CMDBUF_SIZE, NULL, false, &nvpb->bo_builtin_cmdbuf);
 	if (ret) {
 		TRACE("Failed to create BO for the built-in cmdbuf (%d)\n", ret);
 		nouveau_pushbuf_del(&push);
 		return ret;
 	}
 
-	ret = nouveau_bo_new(client->device, NOUVEAU_BO_GART, 0x20000, nvGpuGetZcullCtxSize(), NULL, &nvpb->bo_zcullctx);
+	ret = bo_new(client->device, NOUVEAU_BO_GART, 0x20000, nvGpuGetZcullCtxSize(), NULL, false, &nvpb->bo_zcullctx);
 	if (ret) {
 		TRACE("Failed to create BO for the Zcull context (%d)\n", ret);
 		nouveau_pushbuf_del(&push);
 		return ret;
 	}
 
-	Result res = nvGpuChannelCreate(&nvpb->gpu_channel, &nvdev->addr_space, NvChannelPriority_Medium);
+	uint32_t priority = NOUVEAU_PUSHBUF_PRIORITY_MEDIUM;
+	if (attr && attr->priority)
+		priority = attr->priority;
+
+	Result res = nvGpuChannelCreate(&nvpb->gpu_channel, &nvdev->addr_space, priority);
 	if (R_FAILED(res)) {
 		TRACE("Failed to create GPU channel (%x)\n", res);
 		nouveau_pushbuf_del(&push);
 		return -res;
 	}
 
+	if (attr && attr->timeslice_us) {
+		ret = nouveau_pushbuf_set_timeslice(push, attr->timeslice_us);
+		if (ret) {
+			nouveau_pushbuf_del(&push);
+			return ret;
+		}
+	}
+
 	res = nvGpuChannelZcullBind(&nvpb->gpu_channel, nvpb->bo_zcullctx->offset);
 	if (R_FAILED(res)) {
 		TRACE("Failed to bind Zcull context to GPU channel (%x)\n", res);
@@ -487,12 +1370,13 @@ nouveau_pushbuf_new(struct nouveau_client *client, struct nouveau_object *chan,
 		return -res;
 	}
 
-	nouveau_bo_map(nvpb->bo_builtin_cmdbuf, NOUVEAU_BO_WR, client);
+	bo_map(nvpb->bo_builtin_cmdbuf, NOUVEAU_BO_WR, client);
 	u32* cmds = (u32*)nvpb->bo_builtin_cmdbuf->map;
 	nvpb->fence_num_cmds = generate_fence_cmdlist(cmds, nvGpuChannelGetSyncpointId(&nvpb->gpu_channel));
 
 	cmds += nvpb->fence_num_cmds;
 	nvpb->flush_num_cmds = generate_flush_cmdlist(cmds);
+	ring_init(&nvpb->dep_ring, BUILTIN_CMDBUF_SIZE - BUILTIN_DEP_OFFSET);
 
 	DRMINITLISTHEAD(&nvpb->bctx_list);
 	*ppush = push;
@@ -508,6 +1392,14 @@ nouveau_pushbuf_del(struct nouveau_pushbuf **ppush)
 	if (nvpb) {
 		struct drm_nouveau_gem_pushbuf_bo *kref;
 		struct nouveau_pushbuf_krec *krec;
+		// Another thread is waiting for our commands to be submitted
+		if (nvpb->flush_request && nvpb->base.channel)
+			pushbuf_flush(&nvpb->base);
+		while (!DRMLISTEMPTY(&nvpb->streams)) {
+			struct nouveau_stream *stream =
+				DRMLISTENTRY(struct nouveau_stream, nvpb->streams.next, head);
+			pushbuf_stream_detach(&nvpb->base, stream);
+		}
 		nvGpuChannelClose(&nvpb->gpu_channel);
 		nouveau_bo_ref(NULL, &nvpb->bo_zcullctx);
 		nouveau_bo_ref(NULL, &nvpb->bo_builtin_cmdbuf);
@@ -515,12 +1407,16 @@ nouveau_pushbuf_del(struct nouveau_pushbuf **ppush)
 			kref = krec->buffer;
 			while (krec->nr_buffer--) {
 				struct nouveau_bo *bo = kref++->bo;
-				cli_kref_set(nvpb->base.client, bo, NULL, NULL);
+				cli_kref_clear(nvpb->base.client, bo, &nvpb->base);
+				if (nvpb->base.channel)
+					atomic_dec(&nouveau_bo(bo)->pending_refs, 1);
 				nouveau_bo_ref(NULL, &bo);
 			}
 			nvpb->list = krec->next;
-			free(krec);
+			krec_del(nvpb->base.client, krec);
 		}
+		pushbuf_bo_list_free(&nvpb->cmd_used);
+		pushbuf_bo_list_free(&nvpb->cmd_free);
 		while (nvpb->bo_nr--)
 			nouveau_bo_ref(NULL, &nvpb->bos[nvpb->bo_nr]);
 		nouveau_bo_ref(NULL, &nvpb->bo);
@@ -529,6 +1425,61 @@ nouveau_pushbuf_del(struct nouveau_pushbuf **ppush)
 	*ppush = NULL;
 }
 
+int
+nouveau_pushbuf_set_priority(struct nouveau_pushbuf *push, uint32_t priority)
+{
+	CALLED();
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+
+	Result res = nvChannelSetPriority(&nvpb->gpu_channel.base, priority);
+	if (R_FAILED(res)) {
+		TRACE("Failed to set GPU channel priority (%x)\n", res);
+		return -res;
+	}
+
+	return 0;
+}
+
+int
+nouveau_pushbuf_set_timeslice(struct nouveau_pushbuf *push, uint32_t us)
+{
+	CALLED();
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+
+	Result res = nvIoctl(nvpb->gpu_channel.base.fd, NVGPU_IOCTL_CHANNEL_SET_TIMESLICE, &us);
+	if (R_FAILED(res)) {
+		TRACE("Failed to set GPU channel timeslice (%x)\n", res);
+		return -res;
+	}
+
+	return 0;
+}
+
+/* Submissions stamp the rings of the attached streams, and may run on
+ * another thread than the one creating or deleting a stream.
+ */
+void
+pushbuf_stream_attach(struct nouveau_pushbuf *push, struct nouveau_stream *stream)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+
+	mutexLock(&nvpb->submit_lock);
+	DRMLISTADDTAIL(&stream->head, &nvpb->streams);
+	stream->push = push;
+	mutexUnlock(&nvpb->submit_lock);
+}
+
+void
+pushbuf_stream_detach(struct nouveau_pushbuf *push, struct nouveau_stream *stream)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+
+	mutexLock(&nvpb->submit_lock);
+	DRMLISTDEL(&stream->head);
+	stream->push = NULL;
+	mutexUnlock(&nvpb->submit_lock);
+}
+
 struct nouveau_bufctx *
 nouveau_pushbuf_bufctx(struct nouveau_pushbuf *push, struct nouveau_bufctx *ctx)
 {
@@ -539,6 +1490,65 @@ nouveau_pushbuf_bufctx(struct nouveau_pushbuf *push, struct nouveau_bufctx *ctx)
 	return prev;
 }
 
+/* In ring mode commands are recorded into windows carved out of a single
+ * ring bo, space is reclaimed as the fences of earlier submissions pass.
+ */
+static int
+pushbuf_space_ring(struct nouveau_pushbuf *push, uint32_t dwords,
+		   uint32_t pushes, bool flushed)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct nouveau_pushbuf_krec *krec = nvpb->krec;
+	uint32_t suffix = 2 + push->rsvd_kick;
+	uint64_t size;
+	int64_t off;
+	int ret;
+
+	pushes++;
+
+	if (push->cur + dwords >= push->end) {
+		nouveau_pushbuf_data(push, NULL, 0, 0);
+		pushes++;
+
+		size = (dwords + suffix + 1) * 4;
+		if (size < nvpb->ring.size / RING_WINDOWS)
+			size = nvpb->ring.size / RING_WINDOWS;
+
+		off = ring_alloc(&nvpb->ring, size, 4);
+		if (off == -ENOSPC) {
+			// Everything left is recorded but unsubmitted
+			if (krec->nr_buffer)
+				pushbuf_flush(push);
+			flushed = true;
+			off = ring_alloc(&nvpb->ring, size, 4);
+		}
+		if (off < 0)
+			return off;
+
+		nvpb->ring_window = nvpb->ring.head - size;
+		nvpb->ptr = nvpb->bo->map;
+		nvpb->bgn = nvpb->ptr + off / 4;
+		nvpb->ring_start = nvpb->bgn;
+		push->cur = nvpb->bgn;
+		push->end = push->cur + size / 4 - suffix;
+	}
+
+	if (krec->nr_push + pushes >= nvpb->max_push) {
+		if (krec->nr_buffer) {
+			pushbuf_flush(push);
+			nvpb->stats.limit_flushes++;
+		}
+		flushed = true;
+	}
+
+	ret = krec_grow_push(push, krec->nr_push + pushes);
+	if (ret)
+		return ret;
+
+	pushbuf_kref(push, nvpb->bo, push->flags);
+	return flushed ? pushbuf_validate(push, false) : 0;
+}
+
 int
 nouveau_pushbuf_space(struct nouveau_pushbuf *push,
 		      uint32_t dwords, uint32_t relocs, uint32_t pushes)
@@ -546,11 +1556,29 @@ nouveau_pushbuf_space(struct nouveau_pushbuf *push,
 	CALLED();
 	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
 	struct nouveau_pushbuf_krec *krec = nvpb->krec;
-	struct nouveau_client *client = push->client;
 	struct nouveau_bo *bo = NULL;
-	bool flushed = false;
+	bool flushed = false, limit;
 	int ret = 0;
 
+	nvpb->owner = pushbuf_self();
+	if (nvpb->flush_request && push->channel && nvpb->bo && !nvpb->in_flush) {
+		pushbuf_flush(push);
+		flushed = true;
+	}
+
+	if (nvpb->autokick_enabled && !nvpb->in_flush) {
+		if (pushbuf_autokick_due(push) && nvpb->bo && krec->nr_buffer) {
+			pushbuf_flush(push);
+			nvpb->stats.autokicks++;
+			flushed = true;
+		}
+		if (!nvpb->record_start)
+			nvpb->record_start = armGetSystemTick();
+	}
+
+	if (nvpb->ring_mode)
+		return pushbuf_space_ring(push, dwords, pushes, flushed);
+
 	/* switch to next buffer if insufficient space in the current one */
 	if (push->cur + dwords >= push->end) {
 		if (nvpb->bo_next < nvpb->bo_nr) {
@@ -558,8 +1586,7 @@ nouveau_pushbuf_space(struct nouveau_pushbuf *push,
 			if (nvpb->bo_next == nvpb->bo_nr && push->channel)
 				nvpb->bo_next = 0;
 		} else {
-			ret = nouveau_bo_new(client->device, nvpb->type, 0,
-					     nvpb->bos[0]->size, NULL, &bo);
+			ret = pushbuf_cmd_bo_get(push, &bo);
 			if (ret)
 				return ret;
 		}
@@ -574,17 +1601,28 @@ nouveau_pushbuf_space(struct nouveau_pushbuf *push,
 	 * if the new buffer won't fit, or if the kernel push limits
 	 * have been hit
 	 */
-	if ((bo && ( push->channel ||
-		    !pushbuf_kref(push, bo, push->flags))) ||
-	    krec->nr_push + pushes >= NOUVEAU_GEM_MAX_PUSH) {
-		if (nvpb->bo && krec->nr_buffer)
+	limit = krec->nr_push + pushes >= nvpb->max_push;
+	if (bo && !push->channel && pushbuf_kref(push, bo, push->flags))
+		limit = true;
+	if ((bo && push->channel) || limit) {
+		if (nvpb->bo && krec->nr_buffer) {
 			pushbuf_flush(push);
+			if (limit)
+				nvpb->stats.limit_flushes++;
+		}
 		flushed = true;
+		krec = nvpb->krec;
+	}
+
+	ret = krec_grow_push(push, krec->nr_push + pushes);
+	if (ret) {
+		nouveau_bo_ref(NULL, &bo);
+		return ret;
 	}
 
 	/* if necessary, switch to new buffer */
 	if (bo) {
-		ret = nouveau_bo_map(bo, NOUVEAU_BO_WR, push->client);
+		ret = bo_map(bo, NOUVEAU_BO_WR, push->client);
 		if (ret)
 			return ret;
 
@@ -622,12 +1660,13 @@ nouveau_pushbuf_data(struct nouveau_pushbuf *push, struct nouveau_bo *bo,
 	}
 
 	if (bo) {
-		kref = cli_kref_get(push->client, bo);
+		kref = cli_kref_get(push->client, bo, push);
 		assert(kref);
 		kpsh = &krec->push[krec->nr_push++];
 		kpsh->bo_index = kref - krec->buffer;
 		kpsh->offset   = offset;
 		kpsh->length   = length;
+		nvpb->queued_dwords += length / 4;
 	}
 }
 
@@ -652,7 +1691,13 @@ int
 nouveau_pushbuf_validate(struct nouveau_pushbuf *push)
 {
 	CALLED();
-	return pushbuf_validate(push, true);
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	int ret;
+
+	trace_event(TRACE_VALIDATE, TRACE_BEGIN, nvpb->krec->nr_buffer, 0);
+	ret = pushbuf_validate(push, true);
+	trace_event(TRACE_VALIDATE, TRACE_END, 0, 0);
+	return ret;
 }
 
 uint32_t
@@ -662,9 +1707,8 @@ nouveau_pushbuf_refd(struct nouveau_pushbuf *push, struct nouveau_bo *bo)
 	struct drm_nouveau_gem_pushbuf_bo *kref;
 	uint32_t flags = 0;
 
-	if (cli_push_get(push->client, bo) == push) {
-		kref = cli_kref_get(push->client, bo);
-		assert(kref);
+	kref = cli_kref_get(push->client, bo, push);
+	if (kref) {
 		if (kref->read_domains)
 			flags |= NOUVEAU_BO_RD;
 		if (kref->write_domains)
@@ -675,11 +1719,313 @@ nouveau_pushbuf_refd(struct nouveau_pushbuf *push, struct nouveau_bo *bo)
 }
 
 int
-nouveau_pushbuf_kick(struct nouveau_pushbuf *push, struct nouveau_object *chan)
+pushbuf_kick(struct nouveau_pushbuf *push, struct nouveau_object *chan,
+	     bool force)
 {
 	CALLED();
-	if (!push->channel)
-		return pushbuf_submit(push, chan);
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	int ret;
+
+	nvpb->owner = pushbuf_self();
+	if (!push->channel) {
+		mutexLock(&nvpb->submit_lock);
+		ret = pushbuf_submit(push, chan);
+		mutexUnlock(&nvpb->submit_lock);
+		return ret;
+	}
+
+	// Hold back small kicks so that they can be merged with the next ones
+	if (!force && nvpb->autokick_enabled && !nvpb->flush_request &&
+	    pushbuf_queued_dwords(push) < nvpb->autokick.min_dwords &&
+	    pushbuf_record_age_us(push) < nvpb->autokick.max_delay_us) {
+		nvpb->kick_pending = true;
+		nvpb->stats.coalesced_kicks++;
+		return 0;
+	}
+
 	pushbuf_flush(push);
 	return pushbuf_validate(push, false);
 }
+
+/* Submits the commands of push referencing bo.  A pushbuf being recorded
+ * by another thread is asked to submit them at its next safe point, and
+ * -EAGAIN (NOUVEAU_BO_NOBLOCK) or -EBUSY tells the caller to retry later.
+ */
+int
+pushbuf_flush_bo(struct nouveau_pushbuf *push, struct nouveau_bo *bo,
+		 uint32_t access)
+{
+	CALLED();
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	int ret = 0;
+
+	if (nvpb->owner == pushbuf_self())
+		return pushbuf_kick(push, push->channel, true);
+
+	mutexLock(&nvpb->submit_lock);
+	if (cli_push_get(push->client, bo) == push) {
+		nvpb->flush_request = 1;
+		ret = (access & NOUVEAU_BO_NOBLOCK) ? -EAGAIN : -EBUSY;
+	}
+	mutexUnlock(&nvpb->submit_lock);
+
+	return ret;
+}
+
+int
+nouveau_pushbuf_kick(struct nouveau_pushbuf *push, struct nouveau_object *chan)
+{
+	CALLED();
+	return pushbuf_kick(push, chan, true);
+}
+
+int
+nouveau_pushbuf_kick_lazy(struct nouveau_pushbuf *push, struct nouveau_object *chan)
+{
+	CALLED();
+	return pushbuf_kick(push, chan, false);
+}
+
+int
+nouveau_pushbuf_kick_fence(struct nouveau_pushbuf *push,
+			   struct nouveau_object *chan,
+			   struct nouveau_fence *fence)
+{
+	CALLED();
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	int ret = pushbuf_kick(push, chan, true);
+
+	fence->id = nvpb->fence.id;
+	fence->value = nvpb->fence.value;
+	return ret;
+}
+
+int
+nouveau_pushbuf_reset(struct nouveau_pushbuf *push)
+{
+	CALLED();
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct nouveau_pushbuf_krec *krec;
+	struct drm_nouveau_gem_pushbuf_bo *kref;
+	struct nouveau_bufctx *bctx, *btmp;
+	struct nouveau_bo *bo;
+	int i;
+
+	if (push->channel)
+		return -EINVAL;
+
+	mutexLock(&nvpb->submit_lock);
+	for (krec = nvpb->list; krec; krec = krec->next) {
+		kref = krec->buffer;
+		for (i = 0; i < krec->nr_buffer; i++, kref++) {
+			bo = kref->bo;
+			cli_kref_clear(push->client, bo, push);
+			nouveau_bo_ref(NULL, &bo);
+		}
+		krec->nr_buffer = 0;
+		krec->nr_push = 0;
+		krec->gen++;
+	}
+	while ((krec = nvpb->list->next)) {
+		nvpb->list->next = krec->next;
+		krec_del(push->client, krec);
+	}
+	nvpb->krec = nvpb->list;
+
+	// Start over in the initial command bos, the overflow ones are reused
+	// once the GPU is done with the replays that read them.
+	nouveau_bo_ref(NULL, &nvpb->bo);
+	nvpb->bo_next = 0;
+	nvpb->bgn = nvpb->ptr = NULL;
+	push->cur = push->end = NULL;
+	pushbuf_cmd_bo_retire(push);
+	mutexUnlock(&nvpb->submit_lock);
+
+	DRMLISTFOREACHENTRYSAFE(bctx, btmp, &nvpb->bctx_list, head) {
+		DRMLISTJOIN(&bctx->current, &bctx->pending);
+		DRMINITLISTHEAD(&bctx->current);
+		DRMLISTDELINIT(&bctx->head);
+	}
+
+	return 0;
+}
+
+void
+nouveau_pushbuf_invalidate(struct nouveau_pushbuf *push)
+{
+	CALLED();
+	nouveau_pushbuf(push)->flush_pending = true;
+}
+
+void
+nouveau_pushbuf_get_stats(struct nouveau_pushbuf *push,
+			  struct nouveau_pushbuf_stats *stats)
+{
+	CALLED();
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+
+	*stats = nvpb->stats;
+	stats->ring_stalls = nvpb->ring.stalls;
+}
+
+int
+nouveau_pushbuf_set_autokick(struct nouveau_pushbuf *push,
+			     const struct nouveau_pushbuf_autokick *params)
+{
+	CALLED();
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+
+	// Deferred pushbufs are recordings that get replayed as a whole
+	if (!push->channel)
+		return -EINVAL;
+
+	if (!params) {
+		if (nvpb->kick_pending)
+			pushbuf_kick(push, push->channel, true);
+		nvpb->autokick_enabled = false;
+		return 0;
+	}
+
+	nvpb->autokick = *params;
+	nvpb->autokick_enabled = true;
+	return 0;
+}
+
+struct nouveau_bundle {
+	atomic_t refcnt;
+	struct nouveau_bo *bo;
+	uint32_t size;
+	int nr_refs;
+	struct nouveau_pushbuf_refn refs[];
+};
+
+int
+nouveau_bundle_new(struct nouveau_pushbuf *rec, struct nouveau_bundle **pbundle)
+{
+	CALLED();
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(rec);
+	struct nouveau_pushbuf_krec *krec;
+	struct drm_nouveau_gem_pushbuf_push *kpsh;
+	struct drm_nouveau_gem_pushbuf_bo *kref;
+	struct nouveau_bundle *bundle;
+	uint64_t size = 0;
+	int nr_refs = 0, max_buffer = 0;
+	bool *cmd;
+	char *map;
+	int ret, i;
+
+	// Commands of immediate pushbufs may already have been submitted
+	if (rec->channel)
+		return -EINVAL;
+
+	nouveau_pushbuf_data(rec, NULL, 0, 0);
+	for (krec = nvpb->list; krec; krec = krec->next) {
+		kpsh = krec->push;
+		for (i = 0; i < krec->nr_push; i++, kpsh++)
+			size += kpsh->length;
+		nr_refs += krec->nr_buffer;
+		if (krec->nr_buffer > max_buffer)
+			max_buffer = krec->nr_buffer;
+	}
+	if (!size)
+		return -EINVAL;
+
+	// Buffers holding the commands themselves are not referenced by them
+	cmd = malloc(max_buffer * sizeof(*cmd));
+	if (!cmd)
+		return -ENOMEM;
+
+	bundle = calloc(1, sizeof(*bundle) + nr_refs * sizeof(*bundle->refs));
+	if (!bundle) {
+		free(cmd);
+		return -ENOMEM;
+	}
+
+	ret = nouveau_bo_new(rec->client->device, NOUVEAU_BO_GART | NOUVEAU_BO_MAP |
+			     NOUVEAU_BO_NOZERO, 0, size, NULL, &bundle->bo);
+	if (!ret)
+		ret = bo_map(bundle->bo, NOUVEAU_BO_WR, rec->client);
+	if (ret) {
+		nouveau_bo_ref(NULL, &bundle->bo);
+		free(bundle);
+		free(cmd);
+		return ret;
+	}
+
+	map = bundle->bo->map;
+	for (krec = nvpb->list; krec; krec = krec->next) {
+		memset(cmd, 0, max_buffer * sizeof(*cmd));
+		kpsh = krec->push;
+		for (i = 0; i < krec->nr_push; i++, kpsh++) {
+			struct nouveau_bo *bo = krec->buffer[kpsh->bo_index].bo;
+			memcpy(map, (char *)nouveau_bo(bo)->map_addr + kpsh->offset, kpsh->length);
+			map += kpsh->length;
+			cmd[kpsh->bo_index] = true;
+		}
+
+		kref = krec->buffer;
+		for (i = 0; i < krec->nr_buffer; i++, kref++) {
+			struct nouveau_pushbuf_refn *ref = &bundle->refs[bundle->nr_refs];
+
+			if (cmd[i])
+				continue;
+
+			ref->flags = NOUVEAU_BO_GART;
+			if (kref->read_domains)
+				ref->flags |= NOUVEAU_BO_RD;
+			if (kref->write_domains)
+				ref->flags |= NOUVEAU_BO_WR;
+			ref->bo = NULL;
+			nouveau_bo_ref(kref->bo, &ref->bo);
+			bundle->nr_refs++;
+		}
+	}
+
+	free(cmd);
+	bundle->size = size;
+	atomic_set(&bundle->refcnt, 1);
+	*pbundle = bundle;
+	return 0;
+}
+
+void
+nouveau_bundle_ref(struct nouveau_bundle *bundle, struct nouveau_bundle **pref)
+{
+	CALLED();
+	struct nouveau_bundle *ref = *pref;
+	int i;
+
+	if (bundle)
+		atomic_inc(&bundle->refcnt);
+
+	if (ref && atomic_dec_and_test(&ref->refcnt)) {
+		for (i = 0; i < ref->nr_refs; i++)
+			nouveau_bo_ref(NULL, &ref->refs[i].bo);
+		nouveau_bo_ref(NULL, &ref->bo);
+		free(ref);
+	}
+
+	*pref = bundle;
+}
+
+int
+nouveau_pushbuf_bundle(struct nouveau_pushbuf *push, struct nouveau_bundle *bundle)
+{
+	CALLED();
+	struct nouveau_pushbuf_refn ref = { bundle->bo, NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+	int ret;
+
+	ret = nouveau_pushbuf_space(push, 0, 0, 1);
+	if (ret)
+		return ret;
+
+	// Validate the bos the bundle was recorded against on this submission
+	ret = nouveau_pushbuf_refn(push, bundle->refs, bundle->nr_refs);
+	if (!ret)
+		ret = nouveau_pushbuf_refn(push, &ref, 1);
+	if (ret)
+		return ret;
+
+	nouveau_pushbuf_data(push, bundle->bo, 0, bundle->size);
+	return 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "private.h"
+
+#ifdef DEBUG
+#	define TRACE(x...) printf("nouveau: " x)
+#	define CALLED() TRACE("CALLED: %s\n", __PRETTY_FUNCTION__)
+#else
+#	define TRACE(x...)
+# define CALLED()
+#endif
+
+/* A ring of GPU memory handed out in increasing virtual positions.  The
+ * space between tail and head is in use, either by the CPU or by the GPU
+ * work fenced by the segments; the physical offset of a virtual position
+ * is its remainder modulo the ring size.
+ */
+
+void
+ring_init(struct nouveau_ring *ring, uint64_t size)
+{
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->first_seg = 0;
+	ring->nr_seg = 0;
+	ring->stalls = 0;
+}
+
+static inline struct nouveau_ring_seg *
+ring_seg(struct nouveau_ring *ring, unsigned i)
+{
+	return &ring->seg[(ring->first_seg + i) % RING_MAX_SEGS];
+}
+
+static void
+ring_pop(struct nouveau_ring *ring)
+{
+	ring->tail = ring_seg(ring, 0)->end;
+	ring->first_seg = (ring->first_seg + 1) % RING_MAX_SEGS;
+	ring->nr_seg--;
+}
+
+void
+ring_reclaim(struct nouveau_ring *ring)
+{
+	while (ring->nr_seg && R_SUCCEEDED(nvFenceWait(&ring_seg(ring, 0)->fence, 0)))
+		ring_pop(ring);
+}
+
+int64_t
+ring_alloc(struct nouveau_ring *ring, uint64_t size, uint32_t align)
+{
+	uint64_t head = ring->head;
+	uint64_t off;
+
+	if (size > ring->size)
+		return -EINVAL;
+
+	// Align, and skip the end of the ring if the allocation would wrap
+	if (align > 1)
+		head = (head + align - 1) & ~(uint64_t)(align - 1);
+	off = head % ring->size;
+	if (off + size > ring->size) {
+		head += ring->size - off;
+		off = 0;
+	}
+
+	// Only poll the fences of earlier submissions when out of space
+	if (head + size - ring->tail > ring->size)
+		ring_reclaim(ring);
+	while (head + size - ring->tail > ring->size) {
+		// Space held by the CPU can only be reclaimed once submitted
+		if (!ring->nr_seg)
+			return -ENOSPC;
+
+		TRACE("ring full, waiting on fence {%d,%u}\n",
+		      (int)ring_seg(ring, 0)->fence.id, ring_seg(ring, 0)->fence.value);
+		ring->stalls++;
+		nvFenceWait(&ring_seg(ring, 0)->fence, -1);
+		ring_pop(ring);
+	}
+
+	ring->head = head + size;
+	return off;
+}
+
+void
+ring_stamp(struct nouveau_ring *ring, uint64_t end, NvFence *fence)
+{
+	struct nouveau_ring_seg *seg;
+
+	if (ring->nr_seg) {
+		seg = ring_seg(ring, ring->nr_seg - 1);
+		if (end <= seg->end) {
+			seg->fence = *fence;
+			return;
+		}
+	} else if (end <= ring->tail)
+		return;
+
+	// Fences are from a single timeline, so the newest one covers the
+	// last segment as well if we have run out of them
+	if (ring->nr_seg == RING_MAX_SEGS) {
+		seg = ring_seg(ring, ring->nr_seg - 1);
+	} else {
+		seg = ring_seg(ring, ring->nr_seg);
+		ring->nr_seg++;
+	}
+
+	seg->end = end;
+	seg->fence = *fence;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "private.h"
+
+#ifdef DEBUG
+#	define TRACE(x...) printf("nouveau: " x)
+#	define CALLED() TRACE("CALLED: %s\n", __PRETTY_FUNCTION__)
+#else
+#	define TRACE(x...)
+# define CALLED()
+#endif
+
+/* A stream is a persistently mapped bo handed out as a ring.  Everything
+ * allocated from it is consumed by the next submission of its pushbuf,
+ * which stamps the ring with its fence, so space is recycled once the
+ * GPU has passed that submission.
+ */
+
+int
+nouveau_stream_new(struct nouveau_pushbuf *push, uint64_t size,
+		   struct nouveau_stream **pstream)
+{
+	CALLED();
+	struct nouveau_stream *stream;
+	int ret;
+
+	// Deferred pushbufs are replayed, the data would be gone by then
+	if (!push->channel || !size)
+		return -EINVAL;
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		return -ENOMEM;
+
+	ret = nouveau_bo_new(push->client->device, NOUVEAU_BO_GART | NOUVEAU_BO_MAP |
+			     NOUVEAU_BO_NOZERO, 0x100, size, NULL, &stream->bo);
+	if (!ret)
+		ret = bo_map(stream->bo, NOUVEAU_BO_WR, push->client);
+	if (ret) {
+		nouveau_bo_ref(NULL, &stream->bo);
+		free(stream);
+		return ret;
+	}
+
+	ring_init(&stream->ring, stream->bo->size);
+	pushbuf_stream_attach(push, stream);
+	*pstream = stream;
+	return 0;
+}
+
+void
+nouveau_stream_del(struct nouveau_stream **pstream)
+{
+	CALLED();
+	struct nouveau_stream *stream = *pstream;
+
+	if (!stream)
+		return;
+
+	if (stream->push)
+		pushbuf_stream_detach(stream->push, stream);
+
+	// The bo keeps the fence of the last submission it was referenced on
+	nouveau_bo_ref(NULL, &stream->bo);
+	free(stream);
+	*pstream = NULL;
+}
+
+struct nouveau_bo *
+nouveau_stream_bo(struct nouveau_stream *stream)
+{
+	return stream->bo;
+}
+
+int
+nouveau_stream_alloc(struct nouveau_stream *stream, uint32_t size,
+		     uint32_t align, void **map, uint64_t *offset)
+{
+	CALLED();
+	struct nouveau_pushbuf *push = stream->push;
+	struct nouveau_pushbuf_refn ref = { stream->bo, NOUVEAU_BO_RD | NOUVEAU_BO_GART };
+	int64_t off;
+	int ret;
+
+	if (!push)
+		return -ENODEV;
+	if (!align || (align & (align - 1)))
+		return -EINVAL;
+
+	// Reference the bo first, a flush after the allocation would stamp
+	// it with the fence of a submission that doesn't consume it
+	ret = nouveau_pushbuf_refn(push, &ref, 1);
+	if (ret)
+		return ret;
+
+	off = ring_alloc(&stream->ring, size, align);
+	if (off == -ENOSPC) {
+		// Everything left has been handed out since the last kick
+		ret = pushbuf_kick(push, push->channel, true);
+		if (!ret)
+			ret = nouveau_pushbuf_refn(push, &ref, 1);
+		if (ret)
+			return ret;
+		off = ring_alloc(&stream->ring, size, align);
+	}
+	if (off < 0)
+		return off;
+
+	bo_mark_written(nouveau_bo(stream->bo), true);
+	*map = (char *)stream->bo->map + off;
+	*offset = off;
+	return 0;
+}
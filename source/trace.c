@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include "private.h"
+
+#ifdef DEBUG
+#	define TRACE(x...) printf("nouveau: " x)
+#	define CALLED() TRACE("CALLED: %s\n", __PRETTY_FUNCTION__)
+#else
+#	define TRACE(x...)
+# define CALLED()
+#endif
+
+/* Every thread that records an event gets its own ring, which only that
+ * thread writes to.  Rings are linked into a global list when created and
+ * stay on it when their thread exits, so that its events can still be
+ * exported, until a new thread takes the ring over.  Only the owner moves
+ * head, resets and exports only move the base the events start from.
+ */
+#define TRACE_RING_SIZE 4096
+
+struct trace_event {
+	uint64_t tick;
+	uint16_t type;
+	uint16_t phase;
+	uint32_t arg0;
+	uint64_t arg1;
+};
+
+struct trace_ring {
+	struct trace_ring *next;
+	struct trace_ring *free_next;
+	uint32_t tid;
+	volatile uint32_t head;
+	uint32_t base;
+	struct trace_event ev[TRACE_RING_SIZE];
+};
+
+volatile bool trace_enabled;
+
+static Mutex trace_lock;
+static struct trace_ring *trace_rings;
+static struct trace_ring *trace_free;
+static uint32_t trace_nr_rings;
+static __thread struct trace_ring *trace_self;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+static const struct {
+	const char *name;
+	const char *arg0;
+	const char *arg1;
+} trace_types[] = {
+	[TRACE_BO_NEW]     = { "bo_new",     "handle",  "size" },
+	[TRACE_BO_DESTROY] = { "bo_destroy", "handle",  "size" },
+	[TRACE_VALIDATE]   = { "validate",   "buffers", NULL },
+	[TRACE_KICKOFF]    = { "kickoff",    "entries", "fence" },
+	[TRACE_FENCE_WAIT] = { "fence_wait", "id",      "value" },
+	[TRACE_FLUSH]      = { "flush",      "chid",    NULL },
+};
+
+// Called on thread exit with the ring of the thread
+static void
+trace_ring_put(void *data)
+{
+	struct trace_ring *ring = data;
+
+	mutexLock(&trace_lock);
+	ring->free_next = trace_free;
+	trace_free = ring;
+	mutexUnlock(&trace_lock);
+}
+
+static void
+trace_key_init(void)
+{
+	pthread_key_create(&trace_key, trace_ring_put);
+}
+
+static struct trace_ring *
+trace_ring_get(void)
+{
+	struct trace_ring *ring = trace_self;
+
+	if (ring)
+		return ring;
+
+	pthread_once(&trace_key_once, trace_key_init);
+
+	mutexLock(&trace_lock);
+	ring = trace_free;
+	if (ring) {
+		// The events of the previous owner are dropped
+		trace_free = ring->free_next;
+		ring->base = ring->head;
+	} else {
+		ring = calloc(1, sizeof(*ring));
+		if (!ring) {
+			mutexUnlock(&trace_lock);
+			return NULL;
+		}
+		ring->next = trace_rings;
+		trace_rings = ring;
+	}
+	ring->tid = trace_nr_rings++;
+	mutexUnlock(&trace_lock);
+
+	pthread_setspecific(trace_key, ring);
+	trace_self = ring;
+	return ring;
+}
+
+void
+trace_record(uint32_t type, uint32_t phase, uint32_t arg0, uint64_t arg1)
+{
+	struct trace_ring *ring = trace_ring_get();
+	struct trace_event *ev;
+	uint32_t head;
+
+	if (!ring)
+		return;
+
+	head = ring->head;
+	ev = &ring->ev[head % TRACE_RING_SIZE];
+	ev->tick = armGetSystemTick();
+	ev->type = type;
+	ev->phase = phase;
+	ev->arg0 = arg0;
+	ev->arg1 = arg1;
+
+	// Publish the event only once it is complete
+	__sync_synchronize();
+	ring->head = head + 1;
+}
+
+void
+nouveau_trace_enable(bool enable)
+{
+	CALLED();
+	trace_enabled = enable;
+}
+
+void
+nouveau_trace_reset(void)
+{
+	CALLED();
+	struct trace_ring *ring;
+
+	mutexLock(&trace_lock);
+	for (ring = trace_rings; ring; ring = ring->next)
+		ring->base = ring->head;
+	mutexUnlock(&trace_lock);
+}
+
+static void
+trace_export_event(FILE *f, struct trace_ring *ring, struct trace_event *ev,
+		   bool *first)
+{
+	static const char phases[] = { 'i', 'B', 'E' };
+	double ts = armTicksToNs(ev->tick) / 1000.0;
+
+	if (ev->type >= sizeof(trace_types) / sizeof(trace_types[0]) ||
+	    ev->phase >= sizeof(phases))
+		return;
+
+	fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"nouveau\",\"ph\":\"%c\","
+		"\"ts\":%.3f,\"pid\":0,\"tid\":%u",
+		*first ? "" : ",", trace_types[ev->type].name,
+		phases[ev->phase], ts, ring->tid);
+	*first = false;
+
+	if (ev->phase == TRACE_INSTANT)
+		fputs(",\"s\":\"t\"", f);
+
+	if (ev->phase != TRACE_END) {
+		fprintf(f, ",\"args\":{\"%s\":%u", trace_types[ev->type].arg0,
+			ev->arg0);
+		if (trace_types[ev->type].arg1)
+			fprintf(f, ",\"%s\":%llu", trace_types[ev->type].arg1,
+				(unsigned long long)ev->arg1);
+		fputc('}', f);
+	}
+
+	fputc('}', f);
+}
+
+/* Events being recorded while exporting may be overwritten as they are
+ * read, the ring of each thread is exported up to where it was on entry.
+ */
+int
+nouveau_trace_export(const char *path)
+{
+	CALLED();
+	struct trace_ring *ring;
+	uint32_t head, nr, i;
+	bool first = true;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", f);
+
+	mutexLock(&trace_lock);
+	for (ring = trace_rings; ring; ring = ring->next) {
+		head = ring->head;
+		__sync_synchronize();
+
+		nr = head - ring->base;
+		if (nr > TRACE_RING_SIZE)
+			nr = TRACE_RING_SIZE;
+		for (i = head - nr; i != head; i++)
+			trace_export_event(f, ring, &ring->ev[i % TRACE_RING_SIZE], &first);
+	}
+	mutexUnlock(&trace_lock);
+
+	fputs("\n]}\n", f);
+	if (fclose(f))
+		return -errno;
+	return 0;
+}